@@ -0,0 +1,531 @@
+/*
+ * Lume
+ * Copyright (C) 2025 Dogwalker-kryt
+ *
+*/
+
+// lume-bench: replays a keystroke script against the headless core on a
+// generated file and reports per-operation latency, allocations and peak
+// memory. Everything is seeded, so two runs do the same work. With --check
+// it instead runs a consistency check of the core and exits non-zero if it
+// finds a difference.
+
+// [Indcludes]
+#include "lume_core.hpp"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <unistd.h>
+#include <sys/resource.h>
+
+
+// [Allocation counting]
+std::atomic<unsigned long> allocCount{0};
+
+void *operator new(size_t n) {
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(n ? n : 1);
+    if (!p) std::abort();
+    return p;
+}
+void *operator new[](size_t n) { return operator new(n); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+
+// [Options]
+struct BenchOptions {
+    size_t lines = 200000;
+    int rows = 50;
+    int cols = 160;
+    unsigned seed = 1;
+    size_t longLine = 0; // bytes of a minified row put first, 0: none
+    bool journal = false; // measure with the edit journal on
+    std::string script;  // empty: built-in script
+    std::string check;   // "lexer" or "chunks": run that check instead of the benchmark
+};
+
+
+// [Corpus]
+// A C-like file that exercises every lexer path: keywords, types, numbers,
+// strings, line comments, block comments spanning rows and tabs
+std::string makeCorpus(size_t lines, unsigned seed) {
+    const char *types[] = {"int", "char", "double", "size_t", "uint32_t", "bool"};
+    const char *words[] = {"count", "buffer", "offset", "value", "node", "result", "index"};
+    std::string out;
+    out.reserve(lines * 40);
+    uint64_t s = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    auto next = [&s](unsigned n) {
+        s = s * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (unsigned)(s >> 33) % n;
+    };
+
+    for (size_t i = 0; i < lines; i++) {
+        switch (next(10)) {
+            case 0:
+                out += "/* block comment ";
+                out += words[next(7)];
+                out += "\n   continues here */\n";
+                i++;
+                break;
+            case 1:
+                out += "// ";
+                out += words[next(7)];
+                out += " is updated below\n";
+                break;
+            case 2:
+                out += "\tif (";
+                out += words[next(7)];
+                out += " > " + std::to_string(next(1000)) + ") return;\n";
+                break;
+            case 3:
+                out += "\tprintf(\"%d items in ";
+                out += words[next(7)];
+                out += "\\n\", " + std::to_string(next(100)) + ");\n";
+                break;
+            default:
+                out += "\t";
+                out += types[next(6)];
+                out += " ";
+                out += words[next(7)];
+                out += std::to_string(i) + " = " + std::to_string(next(100000)) + "; // x\n";
+                break;
+        }
+    }
+    return out;
+}
+
+
+// One row of minified JSON, the kind of file that has a single huge line
+std::string makeLongLine(size_t bytes, unsigned seed) {
+    std::string out = "[";
+    unsigned s = seed;
+    for (size_t i = 0; out.size() + 64 < bytes; i++) {
+        s = s * 1103515245u + 12345u;
+        out += "{\"id\":" + std::to_string(i) + ",\"name\":\"item" + std::to_string(s >> 16) +
+               "\",\"tags\":[\"a\",\"b\"],\"ok\":true},";
+    }
+    out += "{}]\n";
+    return out;
+}
+
+
+// [Script]
+// One command per line: a key name as in config.toml ("ArrowDown",
+// "Ctrl-z", "PageDown", "F5") or Enter/Tab/Backspace, optionally followed
+// by a repeat count; "type <text>" types the rest of the line.
+const char *defaultScript =
+    "PageDown 40\n"
+    "ArrowDown 25\n"
+    "End\n"
+    "type  // a comment typed at the end of a line\n"
+    "Enter\n"
+    "type int added = 42; /* opens a block comment\n"
+    "Enter\n"
+    "type still inside */ double after = 1.5;\n"
+    "Backspace 12\n"
+    "Ctrl-z 3\n"
+    "Ctrl-y 2\n"
+    "Ctrl-ArrowRight 30\n"
+    "Ctrl-ArrowLeft 15\n"
+    "ArrowUp 200\n"
+    "PageUp 10\n"
+    "Home\n"
+    "type \tfor (int i = 0; i < n; i++) { total += i; }\n"
+    "Enter 5\n"
+    "PageDown 400\n"
+    "ArrowDown 60\n"
+    "type #include <vector>\n"
+    "Ctrl-z 10\n"
+    "Ctrl-f\n"
+    "type missing_name\n"
+    "ArrowDown 3\n"
+    "ArrowUp\n"
+    "Enter\n"
+    "Ctrl-s\n";
+
+bool parseScript(const std::string &text, std::vector<int> &keys) {
+    std::istringstream in(text);
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(in, line)) {
+        lineNo++;
+        if (line.empty() || line[0] == '#') continue;
+
+        if (line.rfind("type ", 0) == 0) {
+            for (size_t i = 5; i < line.size(); i++) keys.push_back((unsigned char)line[i]);
+            continue;
+        }
+
+        std::string name = line;
+        int count = 1;
+        size_t sp = line.find(' ');
+        if (sp != std::string::npos) {
+            name = line.substr(0, sp);
+            count = std::atoi(line.c_str() + sp + 1);
+        }
+
+        int code;
+        if (name == "Enter") code = '\r';
+        else if (name == "Tab") code = '\t';
+        else if (name == "Backspace") code = 127;
+        else code = parseKeyString(name);
+
+        if (code < 0 || count < 1) {
+            std::fprintf(stderr, "lume-bench: script line %d: cannot parse '%s'\n", lineNo, line.c_str());
+            return false;
+        }
+        keys.insert(keys.end(), count, code);
+    }
+    return true;
+}
+
+
+// [Measurement]
+struct Samples {
+    const char *name;
+    std::vector<double> us;
+};
+
+double percentile(std::vector<double> &v, double p) {
+    if (v.empty()) return 0;
+    size_t k = std::min(v.size() - 1, (size_t)(p * (v.size() - 1) + 0.5));
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+}
+
+void report(Samples &s) {
+    if (s.us.empty()) return;
+    double total = 0, max = 0;
+    for (double x : s.us) {
+        total += x;
+        max = std::max(max, x);
+    }
+    std::printf("%-8s %8zu %10.2f %10.2f %10.2f %10.2f %12.1f\n", s.name, s.us.size(),
+                percentile(s.us, 0.50), percentile(s.us, 0.90), percentile(s.us, 0.99), max, total);
+}
+
+double elapsedUs(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - since).count();
+}
+
+
+// What a repaint asks of the core: scroll into view and highlight the visible
+// part of the visible rows
+void headlessFrame(EditorState &E) {
+    static RowView view;
+    editorScroll(E);
+    if (E.buf.hlSpanCount > HL_SPAN_LIMIT) hlTrimSpans(E.buf);
+    int last = std::min<int>(E.rowOffset + E.screenRows, E.buf.lineCount()) - 1;
+    for (int row = E.rowOffset; row <= last; row++) {
+        int col;
+        size_t x = byteAtColumn(E.buf, row, E.colOffset, E.config.tabSize, col);
+        rowView(E.buf, E.syntax, row, x, x + 4 * (size_t)E.screenCols + 64, view);
+    }
+    computeScreenX(E);
+}
+
+
+// [Checks]
+struct CheckRandom {
+    uint64_t s;
+    unsigned next(unsigned n) {
+        s = s * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (unsigned)(s >> 33) % n;
+    }
+};
+
+// Random edits that open and close comments and strings, each round followed
+// by a few frames at random rows while the background lexer works. The rows
+// before the highlight frontier must then have the states a full hlSync of
+// the same text gives them; every tenth round the worker is let finish and
+// all rows are compared. Returns the number of rounds that differed.
+int checkLexer(EditorState &E, unsigned seed) {
+    const char *inserts[] = {"/*", "*/", "\"", "//", "x", "\\", "\n", "R\"(", ")\""};
+    CheckRandom rnd{seed};
+    int bad = 0;
+    for (int round = 0; round < 200 && bad < 5; round++) {
+        for (int k = rnd.next(4); k >= 0; k--) {
+            E.cy = rnd.next(E.buf.lineCount());
+            E.cx = rnd.next(E.buf.lineLength(E.cy) + 1);
+            if (rnd.next(3)) insertText(E, inserts[rnd.next(9)]);
+            else deleteChar(E);
+        }
+        size_t rows = E.buf.lineCount();
+        for (int k = rnd.next(5); k >= 0; k--) {
+            lexerUpdate(E, rnd.next(rows));
+            usleep(rnd.next(2000));
+        }
+        bool all = round % 10 == 9;
+        while (all && E.buf.hlFrontier < rows) {
+            lexerUpdate(E, rows - 1);
+            usleep(100);
+        }
+
+        TextBuffer ref;
+        for (size_t r = 0; r < rows; r++) ref.appendLine(std::string(E.buf.line(r)));
+        hlSync(ref, *E.syntax, rows - 1);
+        size_t upto = all ? rows : std::min(rows, E.buf.hlFrontier);
+        for (size_t r = 0; r < upto; r++) {
+            const Line &got = E.buf.lineRef(r), &want = ref.lineRef(r);
+            if (got.hlIn != want.hlIn || got.hlOut != want.hlOut) {
+                std::printf("round %d: row %zu has states %u/%u, hlSync gives %u/%u (frontier %zu)\n", round, r,
+                            got.hlIn, got.hlOut, want.hlIn, want.hlOut, E.buf.hlFrontier);
+                bad++;
+                break;
+            }
+        }
+    }
+    lexerStop(E);
+    return bad;
+}
+
+
+// The colour of each byte of a row as the renderer gets it from rowView, a
+// window at a time
+std::string viewColors(EditorState &E, size_t row) {
+    const size_t STEP = 2000;
+    size_t len = E.buf.lineLength(row);
+    std::string out(len, '0');
+    RowView v;
+    for (size_t x = 0; x < len; x += STEP) {
+        rowView(E.buf, E.syntax, row, x, x + STEP + 1000, v);
+        for (const HlSpan &s : *v.spans) {
+            for (size_t k = s.start; k < s.start + s.len; k++) {
+                size_t at = v.base + k;
+                if (at >= x && at < x + STEP && at < len) out[at] = '0' + s.color;
+            }
+        }
+    }
+    return out;
+}
+
+// Code with few break bytes for chunkCut to use: long strings full of
+// escapes, long identifiers and numbers, and minified expressions
+std::string makeHardRow(CheckRandom &rnd, size_t bytes) {
+    const char *pieces[] = {"int ", "return ", "a.b", "+", "=", "(", ")", "x1", "\"", "\\", "\\\\", "/", "*", "'",
+                            "12.5e3", "\xc3\xa9", ",", ";", "R\"x(", ")x\""};
+    std::string s;
+    while (s.size() < bytes) {
+        unsigned kind = rnd.next(10);
+        if (kind == 0) {
+            s += '"';
+            for (unsigned i = 3000 + rnd.next(6000); i > 0; i--) s += rnd.next(40) ? "0123456789abcdef"[rnd.next(16)] : '\\';
+            if (s.back() == '\\') s += 'x';
+            s += '"';
+        } else if (kind == 1) {
+            s += 'q';
+            for (unsigned i = 300 + rnd.next(3000); i > 0; i--) s += "abc123_"[rnd.next(7)];
+            s += '+';
+        } else if (kind == 2) {
+            for (unsigned i = 200 + rnd.next(800); i > 0; i--) s += pieces[rnd.next(8)];
+        } else {
+            s += pieces[rnd.next(20)];
+        }
+    }
+    return s;
+}
+
+// Random edits to one long row of such code. Every few edits its colours
+// through rowView, and the state the next row starts in, must match lexing
+// the whole row in one piece: where chunkCut cuts must not matter. Returns
+// the number of checks that differed.
+int checkChunks(unsigned seed) {
+    CheckRandom rnd{seed};
+    EditorState E;
+    E.config.journal = false;
+    E.screenRows = 20;
+    E.screenCols = 80;
+    E.syntax = selectSyntax("check.c");
+    E.buf.appendLine(makeHardRow(rnd, 60000));
+    E.buf.appendLine(std::string("int z;"));
+    int bad = 0;
+    for (int op = 0; op < 400 && bad < 5; op++) {
+        if (op % 20 == 0) {
+            std::string text(E.buf.line(0));
+            std::vector<HlSpan> spans;
+            uint32_t state = lexLine(*E.syntax, text, 0, &spans);
+            std::string want(text.size(), '0');
+            for (const HlSpan &s : spans) {
+                for (size_t k = s.start; k < s.start + s.len && k < text.size(); k++) want[k] = '0' + s.color;
+            }
+            hlSync(E.buf, *E.syntax, 1);
+            std::string got = viewColors(E, 0);
+            if (got != want || E.buf.lineRef(1).hlIn != state) {
+                size_t at = std::mismatch(got.begin(), got.end(), want.begin()).first - got.begin();
+                std::printf("edit %d: colours differ at byte %zu of %zu, next row starts in %u, not %u\n", op, at,
+                            text.size(), E.buf.lineRef(1).hlIn, state);
+                bad++;
+            }
+        }
+
+        std::string_view row = E.buf.line(0);
+        size_t at = rnd.next(row.size() + 1);
+        while (at > 0 && at < row.size() && ((unsigned char)row[at] & 0xC0) == 0x80) at--;
+        E.cy = 0;
+        E.cx = at;
+        if (rnd.next(2)) {
+            std::string piece = makeHardRow(rnd, 1).substr(0, 1 + rnd.next(50));
+            while (!piece.empty() && ((unsigned char)piece.back() & 0x80)) piece.pop_back(); // no half characters
+            insertText(E, piece);
+        } else {
+            for (unsigned k = rnd.next(30); k > 0; k--) deleteChar(E);
+        }
+    }
+    return bad;
+}
+
+
+// [main]
+void usage() {
+    std::fprintf(stderr, "usage: lume-bench [--lines N] [--rows N] [--cols N] [--seed N] [--long-line BYTES] [--journal] [--script FILE] [--check lexer|chunks]\n");
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions opt;
+    for (int i = 1; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--journal") {
+            opt.journal = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage();
+            return 2;
+        }
+        if (a == "--lines") opt.lines = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "--rows") opt.rows = std::atoi(argv[++i]);
+        else if (a == "--cols") opt.cols = std::atoi(argv[++i]);
+        else if (a == "--seed") opt.seed = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "--long-line") opt.longLine = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "--script") opt.script = argv[++i];
+        else if (a == "--check") opt.check = argv[++i];
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    std::string scriptText = defaultScript;
+    if (!opt.script.empty()) {
+        std::ifstream in(opt.script);
+        if (!in) {
+            std::perror(opt.script.c_str());
+            return 1;
+        }
+        std::stringstream ss;
+        ss << in.rdbuf();
+        scriptText = ss.str();
+    }
+    std::vector<int> keys;
+    if (!parseScript(scriptText, keys)) return 1;
+    if (!opt.check.empty() && opt.check != "lexer" && opt.check != "chunks") {
+        usage();
+        return 2;
+    }
+    if (opt.check == "chunks") {
+        int bad = checkChunks(opt.seed);
+        std::printf("lume-bench: chunks check, seed %u: %s\n", opt.seed, bad ? "FAILED" : "ok");
+        return bad ? 1 : 0;
+    }
+
+    // The corpus goes through a real file so loading and saving are measured too
+    char path[] = "/tmp/lume-bench-XXXXXX.c";
+    int fd = mkstemps(path, 2);
+    if (fd < 0) {
+        std::perror("mkstemps");
+        return 1;
+    }
+    std::string corpus = makeCorpus(opt.lines, opt.seed);
+    if (opt.longLine > 0) corpus.insert(0, makeLongLine(opt.longLine, opt.seed));
+    if (write(fd, corpus.data(), corpus.size()) != (ssize_t)corpus.size()) {
+        std::perror("write");
+        close(fd);
+        unlink(path);
+        return 1;
+    }
+    close(fd);
+
+    EditorState E;
+    setDefaultKeybindings(E.config); // no user config: every run binds the same keys
+    buildDispatchTable(E.config);
+    E.config.journal = opt.journal;
+    E.screenRows = opt.rows;
+    E.screenCols = opt.cols;
+
+    auto t0 = std::chrono::steady_clock::now();
+    openFile(E, path);
+    finishLoading(E);
+    double loadUs = elapsedUs(t0);
+
+    if (!opt.check.empty()) {
+        int bad = checkLexer(E, opt.seed);
+        closeFile(E);
+        unlink(path);
+        std::printf("lume-bench: %s check, seed %u: %s\n", opt.check.c_str(), opt.seed, bad ? "FAILED" : "ok");
+        return bad ? 1 : 0;
+    }
+
+    Samples edit{"edit", {}}, move{"move", {}}, search{"search", {}}, frame{"frame", {}}, save{"save", {}};
+    edit.us.reserve(keys.size());
+    move.us.reserve(keys.size());
+    frame.us.reserve(keys.size() + 1);
+
+    headlessFrame(E);
+    unsigned long allocBefore = allocCount.load();
+    for (int key : keys) {
+        unsigned long change = E.changeId;
+        auto t = std::chrono::steady_clock::now();
+        if (mapKeyToAction(E, key) == Action::SAVE) {
+            saveFile(E);
+            finishSave(E);
+            save.us.push_back(elapsedUs(t));
+        } else {
+            editorHandleKey(E, key);
+            (E.changeId != change ? edit : move).us.push_back(elapsedUs(t));
+        }
+
+        // A search scans in steps between frames; time the whole scan
+        if (E.search.pending) {
+            t = std::chrono::steady_clock::now();
+            while (!searchStep(E, SEARCH_STEP_BYTES)) {}
+            search.us.push_back(elapsedUs(t));
+        }
+
+        t = std::chrono::steady_clock::now();
+        headlessFrame(E);
+        frame.us.push_back(elapsedUs(t));
+        if (E.quit) break;
+    }
+    unsigned long allocs = allocCount.load() - allocBefore;
+
+    finishSave(E);
+    journalDiscard(E);
+    closeFile(E);
+    unlink(path);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    std::printf("lume-bench: %zu lines (%zu bytes), %zu keys, load %.1f ms\n",
+                opt.lines, corpus.size(), keys.size(), loadUs / 1000);
+    std::printf("%-8s %8s %10s %10s %10s %10s %12s\n", "op", "count", "p50 us", "p90 us", "p99 us", "max us", "total us");
+    report(edit);
+    report(move);
+    report(search);
+    report(frame);
+    report(save);
+    std::printf("allocations: %lu (%.1f per key)\n", allocs, keys.empty() ? 0.0 : (double)allocs / keys.size());
+    std::printf("peak RSS: %ld KB\n", ru.ru_maxrss);
+    return 0;
+}
@@ -0,0 +1,5428 @@
+/*
+ * Lume
+ * Copyright (C) 2025 Dogwalker-kryt
+ *
+*/
+
+// [Indcludes]
+#include "lume_core.hpp"
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+#include <climits>
+#include <cerrno>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+// [Default keybindings (fallback if not set in config)]
+void setDefaultKeybindings(EditorConfig &conf) {
+    conf.keyMap["quit"] = CTRL_KEY('q');   
+    conf.keyMap["save"] = CTRL_KEY('s');
+    conf.keyMap["move_up"] = LUME_KEY_UP;
+    conf.keyMap["move_down"] = LUME_KEY_DOWN;
+    conf.keyMap["move_left"] = LUME_KEY_LEFT;
+    conf.keyMap["move_right"] = LUME_KEY_RIGHT;
+    conf.keyMap["move_word_left"] = CTRL_LEFT; 
+    conf.keyMap["move_word_right"] = CTRL_RIGHT;
+    conf.keyMap["undo"] = CTRL_KEY('z');
+    conf.keyMap["redo"] = CTRL_KEY('y');
+    conf.keyMap["reload_config"] = LUME_KEY_F(5);
+    conf.keyMap["perf_overlay"] = CTRL_KEY('p');
+    conf.keyMap["search"] = CTRL_KEY('f');
+    conf.keyMap["replace"] = CTRL_KEY('r');
+    conf.keyMap["follow"] = CTRL_KEY('t');
+    conf.keyMap["goto"] = CTRL_KEY('g');
+    conf.keyMap["match_bracket"] = CTRL_KEY('b');
+    conf.keyMap["soft_wrap"] = CTRL_KEY('w');
+}
+
+
+struct ActionName {
+    const char *name;
+    Action action;
+};
+
+const ActionName actionNames[] = {
+    {"quit", Action::QUIT},
+    {"save", Action::SAVE},
+    {"move_up", Action::MOVE_UP},
+    {"move_down", Action::MOVE_DOWN},
+    {"move_left", Action::MOVE_LEFT},
+    {"move_right", Action::MOVE_RIGHT},
+    {"move_word_left", Action::MOVE_WORD_LEFT},
+    {"move_word_right", Action::MOVE_WORD_RIGHT},
+    {"undo", Action::UNDO},
+    {"redo", Action::REDO},
+    {"reload_config", Action::RELOAD_CONFIG},
+    {"perf_overlay", Action::PERF_OVERLAY},
+    {"search", Action::SEARCH},
+    {"replace", Action::REPLACE},
+    {"follow", Action::FOLLOW},
+    {"goto", Action::GOTO},
+    {"match_bracket", Action::MATCH_BRACKET},
+    {"soft_wrap", Action::SOFT_WRAP},
+};
+
+
+Action actionFromName(const std::string &name) {
+    for (const ActionName &a : actionNames) {
+        if (name == a.name) return a.action;
+    }
+    return Action::NONE;
+}
+
+
+// We treat certain strings in config.toml as special keys like "Ctrl-q", "ArrowUp"
+int parseKeyString(const std::string &keyStr) {
+    if (keyStr == "ArrowUp") return LUME_KEY_UP;
+    if (keyStr == "ArrowDown") return LUME_KEY_DOWN;
+    if (keyStr == "ArrowLeft") return LUME_KEY_LEFT;
+    if (keyStr == "ArrowRight") return LUME_KEY_RIGHT;
+    if (keyStr == "PageUp") return LUME_KEY_PPAGE;
+    if (keyStr == "PageDown") return LUME_KEY_NPAGE;
+    if (keyStr == "Home") return LUME_KEY_HOME;
+    if (keyStr == "End") return LUME_KEY_END;
+    if (keyStr == "Ctrl-ArrowLeft") return 554; 
+    if (keyStr == "Ctrl-ArrowRight") return 569;
+
+    // Function keys: "F1" .. "F12"
+    if (keyStr.size() >= 2 && keyStr.size() <= 3 && keyStr[0] == 'F' &&
+        std::isdigit(static_cast<unsigned char>(keyStr[1]))) {
+        int n = std::atoi(keyStr.c_str() + 1);
+        if (n >= 1 && n <= 12) return LUME_KEY_F(n);
+    }
+
+    // Ctrl-X: "Ctrl-q", "Ctrl-s", etc.
+    if (keyStr.rfind("Ctrl-", 0) == 0 && keyStr.size() == 6) {
+        char c = keyStr[5];
+        if (std::isalpha(static_cast<unsigned char>(c))) {
+            c = std::tolower(static_cast<unsigned char>(c));
+            return CTRL_KEY(c);
+        }
+    }
+
+    // Single character key
+    if (keyStr.size() == 1) {
+        return static_cast<unsigned char>(keyStr[0]);
+    }
+
+    // Fallback
+    return -1;
+}
+
+
+// Name of a key code in the config file syntax, for messages
+std::string keyName(int code) {
+    switch (code) {
+        case LUME_KEY_UP: return "ArrowUp";
+        case LUME_KEY_DOWN: return "ArrowDown";
+        case LUME_KEY_LEFT: return "ArrowLeft";
+        case LUME_KEY_RIGHT: return "ArrowRight";
+        case LUME_KEY_PPAGE: return "PageUp";
+        case LUME_KEY_NPAGE: return "PageDown";
+        case LUME_KEY_HOME: return "Home";
+        case LUME_KEY_END: return "End";
+        case CTRL_LEFT: return "Ctrl-ArrowLeft";
+        case CTRL_RIGHT: return "Ctrl-ArrowRight";
+        default: break;
+    }
+    if (code >= LUME_KEY_F(1) && code <= LUME_KEY_F(12)) return "F" + std::to_string(code - LUME_KEY_F0);
+    if (code >= 1 && code <= 26) return std::string("Ctrl-") + (char)('a' + code - 1);
+    if (code > 32 && code < 127) return std::string(1, (char)code);
+    return "key " + std::to_string(code);
+}
+
+
+// [Latency instrumentation]
+uint64_t perfNow() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void histAdd(LatencyHistogram &h, uint64_t ns) {
+    int b;
+    if (ns < (uint64_t)HIST_SUB) {
+        b = (int)ns;
+    } else {
+        int shift = 63 - __builtin_clzll(ns) - 3; // keep the top 4 bits
+        b = (shift + 1) * HIST_SUB + (int)((ns >> shift) & (HIST_SUB - 1));
+    }
+    h.counts[b]++;
+    h.samples++;
+    if (ns > h.maxNs) h.maxNs = ns;
+}
+
+
+// Middle of the bucket holding the p-th sample (p in 0..1)
+uint64_t histPercentile(const LatencyHistogram &h, double p) {
+    if (h.samples == 0) return 0;
+    uint64_t want = (uint64_t)(p * (h.samples - 1)) + 1, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h.counts[b];
+        if (seen < want) continue;
+        if (b < HIST_SUB) return b;
+        int shift = b / HIST_SUB - 1;
+        uint64_t low = (uint64_t)(HIST_SUB + b % HIST_SUB) << shift;
+        return std::min<uint64_t>(h.maxNs, low + ((1ULL << shift) >> 1));
+    }
+    return h.maxNs;
+}
+
+
+// Files the stage times of the frame just put on screen
+void perfEndFrame(PerfStats &P, uint64_t now) {
+    if (P.inputAt) P.frameNs[PERF_LATENCY] = now - P.inputAt;
+    for (int s = 0; s < PERF_STAGES; s++) {
+        bool keyStage = s == PERF_INPUT || s == PERF_EDIT || s == PERF_LATENCY;
+        if (!keyStage || P.frameKeys > 0) histAdd(P.hist[s], P.frameNs[s]);
+    }
+
+    if (P.trace) {
+        std::fprintf(P.trace, "%lu %d", P.frames, P.frameKeys);
+        for (int s = 0; s < PERF_STAGES; s++) std::fprintf(P.trace, " %.1f", P.frameNs[s] / 1000.0);
+        std::fputc('\n', P.trace);
+    }
+
+    P.frames++;
+    P.frameKeys = 0;
+    P.inputAt = 0;
+    std::fill(P.frameNs, P.frameNs + PERF_STAGES, 0);
+}
+
+
+std::string formatNs(uint64_t ns) {
+    char out[32];
+    if (ns < 1000000) std::snprintf(out, sizeof(out), "%luus", (unsigned long)(ns / 1000));
+    else std::snprintf(out, sizeof(out), "%.1fms", ns / 1e6);
+    return out;
+}
+
+
+// Status bar text for the overlay
+std::string perfSummary(const PerfStats &P) {
+    const LatencyHistogram &lat = P.hist[PERF_LATENCY];
+    return "key>paint p50 " + formatNs(histPercentile(lat, 0.50)) +
+           " p99 " + formatNs(histPercentile(lat, 0.99)) +
+           "  p99 edit " + formatNs(histPercentile(P.hist[PERF_EDIT], 0.99)) +
+           " hl " + formatNs(histPercentile(P.hist[PERF_HIGHLIGHT], 0.99)) +
+           " paint " + formatNs(histPercentile(P.hist[PERF_PAINT], 0.99)) +
+           " out " + formatNs(histPercentile(P.hist[PERF_REFRESH], 0.99));
+}
+
+
+// [Long lines]
+// Chunk boundaries go where no token, comment marker, escape or UTF-8
+// sequence runs across, so the lexer and the column walk can stop at the end
+// of a chunk and pick up again at the start of the next; strings and line
+// comments go on through HL_OPEN. Such a place is looked for up to
+// CHUNK_CUT_REACH bytes away. Only a longer run of word characters, in
+// practice the inside of a string or comment, may still be cut anywhere.
+bool chunkBreakByte(char c) {
+    return c == ' ' || c == '\t' || c == ',' || c == ';' || c == '{' || c == '}' || c == '[' || c == ']';
+}
+
+
+bool chunkWordByte(char c) {
+    return std::isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+
+// May a chunk end with byte a and the next start with byte b?
+bool chunkSafeCut(char a, char b) {
+    if (chunkBreakByte(a)) return true;
+    if (((unsigned char)b & 0xC0) == 0x80 || a == '\\') return false;
+    if (chunkWordByte(a) && chunkWordByte(b)) return false;
+    if ((a == '/' || a == '*') && (b == '/' || b == '*')) return false;
+    // Quotes and parentheses start and end raw strings, R"delim( ... )delim"
+    for (char c : {a, b}) {
+        if (c == '"' || c == '\'' || c == '(' || c == ')') return false;
+    }
+    return true;
+}
+
+
+// Where to cut t near byte `near`: at a safe place close by if there is one,
+// else at least not inside a UTF-8 sequence
+size_t chunkCut(std::string_view t, size_t near) {
+    for (size_t d = 0; d < CHUNK_CUT_REACH; d++) {
+        if (d < near && near - d < t.size() && chunkSafeCut(t[near - d - 1], t[near - d])) return near - d;
+        if (near + d > 0 && near + d < t.size() && chunkSafeCut(t[near + d - 1], t[near + d])) return near + d;
+    }
+    while (near < t.size() && ((unsigned char)t[near] & 0xC0) == 0x80) near++;
+    return near;
+}
+
+
+// The chunks of a long row, split up on first use; nullptr for short rows
+LongLine *longLine(Line &l) {
+    if (l.big || l.size() <= LONG_LINE) return l.big.get();
+
+    std::unique_ptr<LongLine> L(new LongLine());
+    std::string_view t = l.text();
+    for (size_t pos = 0; pos < t.size();) {
+        size_t end = t.size();
+        if (end - pos > LINE_CHUNK + LINE_CHUNK / 2) end = pos + chunkCut(t.substr(pos), LINE_CHUNK);
+        L->chunks.emplace_back();
+        L->chunks.back().text.assign(t.substr(pos, end - pos));
+        L->chunks.back().start = pos;
+        pos = end;
+    }
+    L->len = t.size();
+    if (l.owned) {
+        L->flat = std::move(*l.owned); // still the whole row until the next edit
+        L->flatValid = true;
+    }
+    l.owned.reset();
+    l.data = nullptr;
+    l.len = 0;
+    l.spans.reset();
+    l.cols.reset();
+    l.big = std::move(L);
+    return l.big.get();
+}
+
+
+// Chunk holding byte `at`; a byte on a boundary belongs to the later chunk
+size_t chunkAt(const LongLine &L, size_t at) {
+    auto it = std::upper_bound(L.chunks.begin(), L.chunks.end(), at,
+                               [](size_t b, const LineChunk &c) { return b < c.start; });
+    return it == L.chunks.begin() ? 0 : it - L.chunks.begin() - 1;
+}
+
+
+// Moves the boundary between two neighbouring chunks to the nearest safe place
+void fixBreak(std::string &a, std::string &b) {
+    if (a.empty() || b.empty() || chunkSafeCut(a.back(), b[0])) return;
+
+    for (size_t d = 1; d < CHUNK_CUT_REACH; d++) {
+        if (d < a.size() && chunkSafeCut(a[a.size() - d - 1], a[a.size() - d])) {
+            b.insert(0, a.substr(a.size() - d));
+            a.erase(a.size() - d);
+            return;
+        }
+        if (d < b.size() && chunkSafeCut(b[d - 1], b[d])) {
+            a.append(b, 0, d);
+            b.erase(0, d);
+            return;
+        }
+    }
+    // Nothing close by: at least keep UTF-8 sequences whole
+    size_t k = 0;
+    while (k < b.size() && k < 3 && ((unsigned char)b[k] & 0xC0) == 0x80) k++;
+    a.append(b, 0, k);
+    b.erase(0, k);
+}
+
+
+// Chunk j was edited: keep chunk sizes in range and boundaries on break
+// bytes, renumber the starts and drop the checkpoints that may have moved
+void chunksChanged(LongLine &L, size_t j) {
+    std::vector<LineChunk> &cs = L.chunks;
+    if (cs[j].text.size() > 2 * LINE_CHUNK) {
+        size_t cut = chunkCut(cs[j].text, cs[j].text.size() / 2);
+        if (cut < cs[j].text.size()) {
+            LineChunk tail;
+            tail.text = cs[j].text.substr(cut);
+            cs[j].text.erase(cut);
+            cs.insert(cs.begin() + j + 1, std::move(tail));
+        }
+    } else if (cs.size() > 1 && cs[j].text.size() < LINE_CHUNK / 4) {
+        // Fold a small chunk into its smaller neighbour
+        bool intoNext = j + 1 < cs.size() && (j == 0 || cs[j + 1].text.size() < cs[j - 1].text.size());
+        size_t k = intoNext ? j : j - 1;
+        cs[k].text += cs[k + 1].text;
+        cs.erase(cs.begin() + k + 1);
+        j = k;
+    }
+
+    size_t first = j > 0 ? j - 1 : 0;
+    for (size_t k = first; k <= j + 1 && k + 1 < cs.size(); k++) fixBreak(cs[k].text, cs[k + 1].text);
+    for (size_t k = std::min(j + 3, cs.size()); k-- > first && cs.size() > 1;) {
+        if (cs[k].text.empty()) cs.erase(cs.begin() + k);
+    }
+
+    for (size_t k = first; k < cs.size(); k++) {
+        cs[k].start = k == 0 ? 0 : cs[k - 1].start + cs[k - 1].text.size();
+        if (k <= j + 2) {
+            cs[k].hlOut = HL_UNKNOWN;
+            cs[k].width = -1;
+        }
+    }
+    L.len = cs.back().start + cs.back().text.size();
+    L.colValid = std::min(L.colValid, first);
+    L.flatValid = false;
+    std::string().swap(L.flat);
+}
+
+
+void longInsert(LongLine &L, size_t at, std::string_view text) {
+    size_t j = chunkAt(L, at);
+    L.chunks[j].text.insert(at - L.chunks[j].start, text);
+    chunksChanged(L, j);
+}
+
+
+std::string longErase(LongLine &L, size_t at, size_t len) {
+    std::string removed;
+    size_t j = chunkAt(L, at);
+    size_t off = at - L.chunks[j].start;
+    for (size_t k = j; len > 0 && k < L.chunks.size(); off = 0) {
+        std::string &t = L.chunks[k].text;
+        size_t n = std::min(len, t.size() - off);
+        removed.append(t, off, n);
+        t.erase(off, n);
+        len -= n;
+        if (t.empty() && k != j) L.chunks.erase(L.chunks.begin() + k);
+        else k++;
+    }
+    chunksChanged(L, j);
+    return removed;
+}
+
+
+// Bytes from..to-1 of a row (cut off at its end) in one piece: a view into the
+// row or into one chunk, or a copy in scratch when it spans chunks
+std::string_view lineSlice(TextBuffer &buf, size_t row, size_t from, size_t to, std::string &scratch) {
+    Line &l = buf.lineRef(row);
+    LongLine *L = longLine(l);
+    size_t len = l.size();
+    to = std::min(to, len);
+    from = std::min(from, to);
+    if (!L) return l.text().substr(from, to - from);
+
+    size_t j = chunkAt(*L, from);
+    const LineChunk &c = L->chunks[j];
+    if (to <= c.start + c.text.size()) return std::string_view(c.text).substr(from - c.start, to - from);
+    scratch.clear();
+    for (; j < L->chunks.size() && L->chunks[j].start < to; j++) {
+        const LineChunk &d = L->chunks[j];
+        size_t a = std::max(from, d.start) - d.start;
+        size_t b = std::min(to, d.start + d.text.size()) - d.start;
+        scratch.append(d.text, a, b - a);
+    }
+    return scratch;
+}
+
+
+// Byte-at-a-time reads from a row that may be chunked; keeps a window of a
+// few KB around the last byte read
+struct RowBytes {
+    TextBuffer &buf;
+    size_t row;
+    size_t base = 0;
+    std::string_view piece;
+    std::string scratch;
+
+    RowBytes(TextBuffer &b, size_t r) : buf(b), row(r) {}
+
+    unsigned char operator[](size_t i) {
+        if (i < base || i >= base + piece.size()) {
+            base = i > LINE_CHUNK / 2 ? i - LINE_CHUNK / 2 : 0;
+            piece = lineSlice(buf, row, base, base + LINE_CHUNK, scratch);
+        }
+        return piece[i - base];
+    }
+};
+
+
+// [Display columns]
+// E.cx is a byte offset into the row; what the screen needs is the display
+// column, which depends on tabs, UTF-8 sequences and double-width characters.
+struct CodeRange {
+    uint32_t first, last;
+};
+
+// Combining marks and other characters drawn on top of the one before
+const CodeRange zeroWidthRanges[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+    {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902},
+    {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+    {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D},
+    {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0x1F3FB, 0x1F3FF},
+    {0xE0100, 0xE01EF},
+};
+
+// East Asian wide and fullwidth forms, and emoji
+const CodeRange doubleWidthRanges[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F2FF},
+    {0x1F300, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+    {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F3FA}, {0x1F400, 0x1F4FF},
+    {0x1F500, 0x1F53D}, {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596},
+    {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+    {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F93A},
+    {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+template <size_t N>
+bool inRanges(const CodeRange (&ranges)[N], uint32_t cp) {
+    if (cp < ranges[0].first || cp > ranges[N - 1].last) return false;
+    const CodeRange *r = std::upper_bound(ranges, ranges + N, cp,
+                                          [](uint32_t v, const CodeRange &c) { return v < c.first; });
+    return r != ranges && cp <= r[-1].last;
+}
+
+
+int codepointWidth(uint32_t cp) {
+    if (cp < 0x300) return 1;
+    if (cp == UTF8_INVALID) return 1; // shown as '?'
+    if (inRanges(zeroWidthRanges, cp)) return 0;
+    if (inRanges(doubleWidthRanges, cp)) return 2;
+    return 1;
+}
+
+
+// Code point of the UTF-8 sequence at s[i]; a byte that does not start a
+// valid sequence decodes to UTF8_INVALID on its own (len 1)
+uint32_t decodeUtf8(std::string_view s, size_t i, size_t &len) {
+    unsigned char c = s[i];
+    len = 1;
+    if (c < 0x80) return c;
+
+    size_t n;
+    uint32_t cp, min;
+    if ((c & 0xE0) == 0xC0) {
+        n = 2, cp = c & 0x1F, min = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+        n = 3, cp = c & 0x0F, min = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+        n = 4, cp = c & 0x07, min = 0x10000;
+    } else {
+        return UTF8_INVALID;
+    }
+    if (i + n > s.size()) return UTF8_INVALID;
+    for (size_t k = 1; k < n; k++) {
+        unsigned char cc = s[i + k];
+        if ((cc & 0xC0) != 0x80) return UTF8_INVALID;
+        cp = (cp << 6) | (cc & 0x3F);
+    }
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) return UTF8_INVALID;
+    len = n;
+    return cp;
+}
+
+
+// Cells taken by the character at s[i] when it starts in column col
+int cellWidth(std::string_view s, size_t i, int col, int tabSize, size_t &next) {
+    unsigned char c = s[i];
+    if (c < 0x80) {
+        next = i + 1;
+        return c == '\t' ? tabSize - col % tabSize : 1;
+    }
+    size_t len;
+    uint32_t cp = decodeUtf8(s, i, len);
+    next = i + len;
+    return codepointWidth(cp);
+}
+
+
+// Start of the character after the one at i, combining marks included
+size_t nextCharStart(std::string_view s, size_t i) {
+    size_t len;
+    if (i >= s.size()) return s.size();
+    decodeUtf8(s, i, len);
+    i += len;
+    while (i < s.size() && (unsigned char)s[i] >= 0x80) {
+        uint32_t cp = decodeUtf8(s, i, len);
+        if (cp == UTF8_INVALID || codepointWidth(cp) != 0) break;
+        i += len;
+    }
+    return i;
+}
+
+
+// Start of the character before i, stepping over combining marks
+size_t prevCharStart(std::string_view s, size_t i) {
+    size_t len;
+    i = std::min(i, s.size());
+    while (i > 0) {
+        size_t p = i - 1;
+        // Back over continuation bytes to a sequence start, if it decodes to here
+        size_t q = p;
+        while (q > 0 && p - q < 3 && ((unsigned char)s[q] & 0xC0) == 0x80) q--;
+        uint32_t cp = decodeUtf8(s, q, len);
+        if (q + len != i) {
+            cp = UTF8_INVALID; // a stray byte stands alone
+            q = p;
+        }
+        i = q;
+        if (cp == UTF8_INVALID || cp < 0x300 || codepointWidth(cp) != 0) break;
+    }
+    return i;
+}
+
+
+// The same two on a row of the buffer, looking only at bytes near i
+size_t nextCharIn(TextBuffer &buf, size_t row, size_t i) {
+    std::string scratch;
+    return i + nextCharStart(lineSlice(buf, row, i, i + 64, scratch), 0);
+}
+
+
+size_t prevCharIn(TextBuffer &buf, size_t row, size_t i) {
+    std::string scratch;
+    size_t from = i > 64 ? i - 64 : 0;
+    return from + prevCharStart(lineSlice(buf, row, from, i, scratch), i - from);
+}
+
+
+// Checkpoints of a long row, built on first use; nullptr for short rows
+const ColumnIndex *columnIndex(TextBuffer &buf, Line &l, int tabSize) {
+    std::string_view t = l.text();
+    if (t.size() <= COL_CHECKPOINT) return nullptr;
+    if (l.cols && l.cols->tabSize == tabSize) return l.cols.get();
+
+    if (!l.cols) {
+        l.cols.reset(new ColumnIndex());
+        buf.hlSpanCount++;
+    }
+    ColumnIndex &ci = *l.cols;
+    ci.tabSize = tabSize;
+    ci.marks.clear();
+    size_t i = 0, nextMark = 0;
+    int col = 0;
+    while (i < t.size()) {
+        if (i >= nextMark) {
+            ci.marks.push_back({(uint32_t)i, (uint32_t)col});
+            nextMark = i + COL_CHECKPOINT;
+        }
+        size_t next;
+        col += cellWidth(t, i, col, tabSize, next);
+        i = next;
+    }
+    return &ci;
+}
+
+
+// Brings the column checkpoints of chunks up to `upto` up to date. A chunk
+// that only moved keeps its width if it has no tabs or moved by whole tab stops.
+void chunkColumns(LongLine &L, size_t upto, int tabSize) {
+    if (L.tabSize != tabSize) {
+        L.tabSize = tabSize;
+        L.colValid = 0;
+        for (LineChunk &c : L.chunks) {
+            if (c.tabs) c.width = -1;
+        }
+    }
+    upto = std::min(upto + 1, L.chunks.size());
+    for (size_t j = L.colValid; j < upto; j++) {
+        LineChunk &c = L.chunks[j];
+        uint32_t col = j == 0 ? 0 : L.chunks[j - 1].col + L.chunks[j - 1].width;
+        if (c.col != col) {
+            if (c.tabs && ((int64_t)col - c.col) % tabSize != 0) c.width = -1;
+            c.col = col;
+        }
+        if (c.width < 0) {
+            int w = 0;
+            c.tabs = false;
+            for (size_t i = 0; i < c.text.size();) {
+                size_t next;
+                if (c.text[i] == '\t') c.tabs = true;
+                w += cellWidth(c.text, i, col + w, tabSize, next);
+                i = next;
+            }
+            c.width = w;
+        }
+    }
+    L.colValid = std::max(L.colValid, upto);
+}
+
+
+// Display column at which byte `byte` of the row starts
+int displayColumn(TextBuffer &buf, size_t row, size_t byte, int tabSize) {
+    Line &l = buf.lineRef(row);
+    std::string_view t;
+    size_t i = 0;
+    int col = 0;
+    if (LongLine *L = longLine(l)) {
+        // Walk from the checkpoint of the chunk that holds the byte
+        size_t j = chunkAt(*L, byte);
+        chunkColumns(*L, j, tabSize);
+        t = L->chunks[j].text;
+        col = L->chunks[j].col;
+        byte -= L->chunks[j].start;
+    } else if (const ColumnIndex *ci = columnIndex(buf, l, tabSize)) {
+        t = l.text();
+        auto it = std::upper_bound(ci->marks.begin(), ci->marks.end(), byte,
+                                   [](size_t b, const std::pair<uint32_t, uint32_t> &m) { return b < m.first; });
+        if (it != ci->marks.begin()) {
+            i = it[-1].first;
+            col = it[-1].second;
+        }
+    } else {
+        t = l.text();
+    }
+    while (i < byte && i < t.size()) {
+        size_t next;
+        col += cellWidth(t, i, col, tabSize, next);
+        i = next;
+    }
+    return col;
+}
+
+
+// Byte of the character that covers display column col, and the column it
+// starts at (less than col for a tab or wide character cut in the middle).
+// Past the end of the row this is the row length.
+size_t byteAtColumn(TextBuffer &buf, size_t row, int col, int tabSize, int &startCol) {
+    Line &l = buf.lineRef(row);
+    std::string_view t;
+    size_t i = 0;
+    int c = 0;
+    size_t base = 0;
+    if (LongLine *L = longLine(l)) {
+        // Check chunks until one reaches past col, then walk the last that starts before it
+        chunkColumns(*L, 0, tabSize);
+        while (L->colValid < L->chunks.size() &&
+               (int64_t)L->chunks[L->colValid - 1].col + L->chunks[L->colValid - 1].width <= col) {
+            chunkColumns(*L, L->colValid, tabSize);
+        }
+        auto it = std::upper_bound(L->chunks.begin(), L->chunks.begin() + L->colValid, col,
+                                   [](int v, const LineChunk &ch) { return v < (int64_t)ch.col; });
+        const LineChunk &ch = it == L->chunks.begin() ? L->chunks[0] : it[-1];
+        t = ch.text;
+        c = ch.col;
+        base = ch.start;
+    } else if (const ColumnIndex *ci = columnIndex(buf, l, tabSize)) {
+        t = l.text();
+        auto it = std::upper_bound(ci->marks.begin(), ci->marks.end(), (uint32_t)std::max(col, 0),
+                                   [](uint32_t v, const std::pair<uint32_t, uint32_t> &m) { return v < m.second; });
+        if (it != ci->marks.begin()) {
+            i = it[-1].first;
+            c = it[-1].second;
+        }
+    } else {
+        t = l.text();
+    }
+    while (i < t.size()) {
+        size_t next;
+        int w = cellWidth(t, i, c, tabSize, next);
+        if (c + w > col) break;
+        c += w;
+        i = next;
+    }
+    startCol = c;
+    return base + i;
+}
+
+
+int lineNumberWidth(const EditorState &E) {
+    if (!E.config.showLineNumbers) return 0;
+    const PagerState &P = E.pager;
+    long maxLine = std::max<long>(1, P.active ? (P.done ? P.rows : std::max(0L, P.baseRow) + E.buf.lineCount()) : E.buf.lineCount());
+    return std::to_string(maxLine).size() + 1; // "N "
+}
+
+
+int computeScreenX(EditorState &E) {
+    if (E.cy >= (int)E.buf.lineCount()) return 0;
+    return displayColumn(E.buf, E.cy, E.cx, E.config.tabSize);
+}
+
+
+// [C/C++ Syntax Highlighting]
+// Keyword tables are hashed at compile time: the constructor searches for a
+// seed that puts every word in its own slot, so classifying an identifier is
+// one hash and at most one compare on a string_view, with no allocation.
+constexpr uint32_t hashWord(std::string_view w, uint32_t seed) {
+    uint32_t h = seed ^ (uint32_t)w.size();
+    for (char c : w) h = (h ^ (unsigned char)c) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+
+template <size_t N>
+struct KeywordSet {
+    static constexpr size_t SLOTS = [] {
+        size_t n = 1;
+        while (n < N * 4) n <<= 1;
+        return n;
+    }();
+
+    std::string_view slot[SLOTS] = {};
+    uint32_t seed = 0;
+
+    constexpr KeywordSet(const std::string_view (&words)[N]) {
+        for (uint32_t s = 1;; s++) {
+            bool collision = false;
+            for (std::string_view &x : slot) x = std::string_view();
+            for (size_t i = 0; i < N && !collision; i++) {
+                std::string_view &dst = slot[hashWord(words[i], s) & (SLOTS - 1)];
+                if (!dst.empty()) collision = true;
+                dst = words[i];
+            }
+            if (!collision) {
+                seed = s;
+                return;
+            }
+        }
+    }
+
+    constexpr bool contains(std::string_view w) const {
+        std::string_view s = slot[hashWord(w, seed) & (SLOTS - 1)];
+        return !s.empty() && s == w;
+    }
+};
+
+
+constexpr std::string_view cppKeywordList[] = {
+    "if","else","for","while","switch","case","default","break","continue",
+    "return","goto","do","sizeof","typedef","static","const","volatile",
+    "inline","struct","class","public","private","protected","virtual",
+    "override","template","typename","using","namespace","enum","union",
+    "new","delete","this","operator","try","catch","throw"
+};
+
+constexpr std::string_view cppTypeList[] = {
+    "int","long","short","char","float","double","void","bool",
+    "unsigned","signed","auto","std","string","size_t"
+};
+
+constexpr KeywordSet cppKeywords(cppKeywordList);
+constexpr KeywordSet cppTypes(cppTypeList);
+
+
+// One entry per language; a new language adds its two word lists above and a
+// row here. extensions is a space separated list matched against the filename.
+struct Syntax {
+    const char *name;
+    const char *extensions;
+    bool (*isKeyword)(std::string_view word);
+    bool (*isType)(std::string_view word);
+};
+
+const Syntax syntaxes[] = {
+    {"C/C++", ".c .h .cc .cpp .cxx .hh .hpp .hxx .ino",
+        [](std::string_view w) { return cppKeywords.contains(w); },
+        [](std::string_view w) { return cppTypes.contains(w); }},
+};
+
+
+// Picks the syntax by file extension, C/C++ when nothing matches
+const Syntax *selectSyntax(const std::string &filename) {
+    size_t dot = filename.find_last_of('.');
+    if (dot != std::string::npos && filename.find('/', dot) == std::string::npos) {
+        std::string ext = filename.substr(dot);
+        for (const Syntax &syn : syntaxes) {
+            std::string_view list = syn.extensions;
+            size_t pos = 0;
+            while (pos < list.size()) {
+                size_t end = std::min(list.find(' ', pos), list.size());
+                if (list.substr(pos, end - pos) == ext) return &syn;
+                pos = end + 1;
+            }
+        }
+    }
+    return &syntaxes[0];
+}
+
+
+// Lexer state carried from one row to the next: the low two bits are the
+// kind, raw strings keep the index of their delimiter in the upper bits.
+// HL_OPEN only occurs between chunks of a long row: inside a line comment, or
+// inside a string whose quote is kept in the upper bits.
+enum HlState : uint32_t {
+    HL_NORMAL = 0,
+    HL_BLOCK_COMMENT = 1,
+    HL_RAW_STRING = 2,
+    HL_OPEN = 3
+};
+
+
+// Terminators ")delim\"" of the raw strings seen so far, indexed by state >> 2.
+// The background lexer adds to them too; a deque keeps references valid.
+std::mutex rawStringLock;
+std::deque<std::string> rawStringEnds;
+
+
+const std::string &rawStringEnd(uint32_t state) {
+    std::lock_guard<std::mutex> guard(rawStringLock);
+    return rawStringEnds[state >> 2];
+}
+
+
+uint32_t rawStringState(const std::string &end) {
+    std::lock_guard<std::mutex> guard(rawStringLock);
+    size_t id = std::find(rawStringEnds.begin(), rawStringEnds.end(), end) - rawStringEnds.begin();
+    if (id == rawStringEnds.size()) rawStringEnds.push_back(end);
+    return HL_RAW_STRING | (uint32_t)(id << 2);
+}
+
+
+void pushSpan(std::vector<HlSpan> *out, size_t start, size_t len, uint8_t color) {
+    if (out && len > 0) out->push_back(HlSpan{(uint32_t)start, (uint32_t)len, color});
+}
+
+
+// Lexes one row starting in state; returns the state at its end. Token spans
+// are only collected when out is given (rows that are actually drawn). With
+// more set, row is a chunk of a longer row that goes on after it. brackets,
+// if given, gets the offsets of the brackets that are code, not comment or string.
+uint32_t lexLine(const Syntax &syn, std::string_view row, uint32_t state, std::vector<HlSpan> *out, bool more,
+                 std::vector<uint32_t> *brackets) {
+    size_t x = 0;
+    size_t n = row.size();
+
+    // Continue a construct left open by the previous row
+    if ((state & 3) == HL_BLOCK_COMMENT) {
+        size_t end = row.find("*/");
+        if (end == std::string_view::npos) {
+            pushSpan(out, 0, n, 4);
+            return state;
+        }
+        pushSpan(out, 0, end + 2, 4);
+        x = end + 2;
+    } else if ((state & 3) == HL_RAW_STRING) {
+        const std::string &term = rawStringEnd(state);
+        size_t end = row.find(term);
+        if (end == std::string_view::npos) {
+            pushSpan(out, 0, n, 5);
+            return state;
+        }
+        pushSpan(out, 0, end + term.size(), 5);
+        x = end + term.size();
+    } else if ((state & 3) == HL_OPEN) {
+        char quote = (char)(state >> 2);
+        if (!quote) {
+            pushSpan(out, 0, n, 4);
+            return more ? state : HL_NORMAL;
+        }
+        while (x < n && row[x] != quote) {
+            if (row[x] == '\\') x++;
+            x++;
+        }
+        if (x >= n && more) {
+            pushSpan(out, 0, n, 5);
+            return state;
+        }
+        x = std::min(x + 1, n);
+        pushSpan(out, 0, x, 5);
+    }
+
+    while (x < n) {
+        char c = row[x];
+
+        // Comments
+        if (c == '/' && x + 1 < n && row[x+1] == '/') {
+            pushSpan(out, x, n - x, 4);
+            return more ? HL_OPEN : HL_NORMAL;
+        }
+        if (c == '/' && x + 1 < n && row[x+1] == '*') {
+            size_t end = row.find("*/", x + 2);
+            if (end == std::string_view::npos) {
+                pushSpan(out, x, n - x, 4);
+                return HL_BLOCK_COMMENT;
+            }
+            pushSpan(out, x, end + 2 - x, 4);
+            x = end + 2;
+            continue;
+        }
+
+        // Strings
+        if (c == '"' || c == '\'') {
+            size_t start = x++;
+            while (x < n && row[x] != c) {
+                if (row[x] == '\\') x++;
+                x++;
+            }
+            if (x >= n && more) {
+                pushSpan(out, start, n - start, 5);
+                return HL_OPEN | (uint32_t)(unsigned char)c << 2;
+            }
+            x = std::min(x + 1, n);
+            pushSpan(out, start, x - start, 5);
+            continue;
+        }
+
+        // Numbers
+        if (std::isdigit((unsigned char)c)) {
+            size_t start = x;
+            while (x < n && (std::isalnum((unsigned char)row[x]) || row[x]=='.')) x++;
+            pushSpan(out, start, x - start, 6);
+            continue;
+        }
+
+        // Identifiers
+        if (std::isalpha((unsigned char)c) || c == '_' ) {
+            size_t start = x;
+            while (x < n && (std::isalnum((unsigned char)row[x]) || row[x]=='_')) x++;
+            std::string_view word = row.substr(start, x - start);
+
+            // Raw string literal: R"delim( ... )delim" (also u8R, LR, ...)
+            bool rawPrefix = word == "R" || word == "u8R" || word == "uR" || word == "UR" || word == "LR";
+            if (rawPrefix && x < n && row[x] == '"') {
+                size_t open = row.find('(', x + 1);
+                if (open != std::string_view::npos && open - x - 1 <= 16) {
+                    std::string term = ")" + std::string(row.substr(x + 1, open - x - 1)) + "\"";
+                    size_t end = row.find(term, open + 1);
+                    if (end == std::string_view::npos) {
+                        pushSpan(out, start, n - start, 5);
+                        return rawStringState(term);
+                    }
+                    x = end + term.size();
+                    pushSpan(out, start, x - start, 5);
+                    continue;
+                }
+            }
+
+            if (syn.isKeyword(word)) {
+                pushSpan(out, start, x - start, 1);
+            } else if (syn.isType(word)) {
+                pushSpan(out, start, x - start, 2);
+            }
+            continue;
+        }
+
+        if (brackets && (c == '(' || c == ')' || c == '[' || c == ']' || c == '{' || c == '}')) {
+            brackets->push_back((uint32_t)x);
+        }
+        x++;
+    }
+    return HL_NORMAL;
+}
+
+
+// Brings the lexer checkpoints of the chunks before `upto` up to date, from the
+// row's input state; a chunk whose input state and text are unchanged is not
+// lexed again. Returns the state at the start of chunk upto.
+uint32_t chunkStates(const Syntax &syn, LongLine &L, uint32_t state, size_t upto) {
+    upto = std::min(upto, L.chunks.size());
+    for (size_t j = 0; j < upto; j++) {
+        LineChunk &c = L.chunks[j];
+        if (c.hlIn != state) {
+            c.hlIn = state;
+            c.hlOut = HL_UNKNOWN;
+        }
+        if (c.hlOut == HL_UNKNOWN) c.hlOut = lexLine(syn, c.text, state, nullptr, j + 1 < L.chunks.size());
+        state = c.hlOut;
+    }
+    return state;
+}
+
+
+// Makes sure rows up to target carry a correct lexer state. Work starts at the
+// first changed row; rows whose input state is unchanged are reused without
+// lexing, and whole blocks are skipped once the states converge again. Stops
+// early once buf.hlBudget rows have been lexed.
+void hlSync(TextBuffer &buf, const Syntax &syn, size_t target) {
+    if (target >= buf.lineCount() || buf.hlFrontier > target) return;
+
+    size_t i = buf.hlFrontier;
+    uint32_t state = i == 0 ? HL_NORMAL : buf.lineRef(i - 1).hlOut;
+    size_t off = i;
+    size_t b = buf.locate(off);
+
+    while (i <= target && b < buf.blocks.size()) {
+        TextBuffer::Block &blk = buf.blocks[b];
+        if (!blk.hlStale && off == 0 && blk.lines.front().hlIn == state) {
+            state = blk.lines.back().hlOut;
+            i += blk.lines.size();
+        } else {
+            // Finish the whole block so its stale flag can be cleared
+            for (size_t k = off; k < blk.lines.size(); k++, i++) {
+                Line &l = blk.lines[k];
+                if (l.hlOut == HL_UNKNOWN || l.hlIn != state) {
+                    if (buf.hlBudget == 0) {
+                        // The rest of the block may still have the old states
+                        blk.hlStale = true;
+                        buf.hlFrontier = i;
+                        return;
+                    }
+                    buf.hlBudget--;
+                    if (k == 0 && l.hlIn != state) buf.bracketsStale(b);
+                    l.hlIn = state;
+                    LongLine *L = longLine(l);
+                    l.hlOut = L ? chunkStates(syn, *L, state, L->chunks.size()) : lexLine(syn, l.text(), state, nullptr);
+                    l.spans.reset();
+                }
+                state = l.hlOut;
+            }
+            blk.hlStale = false;
+        }
+        b++;
+        off = 0;
+    }
+    buf.hlFrontier = i;
+}
+
+
+// Token spans of one row, lexed again only if the row or its input state changed
+const std::vector<HlSpan> &hlSpans(TextBuffer &buf, const Syntax &syn, size_t row) {
+    hlSync(buf, syn, row);
+    Line &l = buf.lineRef(row);
+    if (!l.spans) {
+        l.spans.reset(new std::vector<HlSpan>());
+        lexLine(syn, l.text(), l.hlIn, l.spans.get());
+        buf.hlSpanCount++;
+    }
+    return *l.spans;
+}
+
+
+// Text and spans to draw bytes from..to-1 of a row. A long row is lexed from
+// the checkpoint of the chunk holding `from`, not from its start; syn may be
+// nullptr for no colours.
+void rowView(TextBuffer &buf, const Syntax *syn, size_t row, size_t from, size_t to, RowView &v) {
+    static const std::vector<HlSpan> noSpans;
+    Line &l = buf.lineRef(row);
+    LongLine *L = longLine(l);
+    if (!L) {
+        v.spans = syn ? &hlSpans(buf, *syn, row) : &noSpans;
+        v.text = l.text();
+        v.base = 0;
+        return;
+    }
+
+    size_t j = chunkAt(*L, from);
+    v.base = L->chunks[j].start;
+    v.text = lineSlice(buf, row, v.base, std::max(from, to), v.scratch);
+    v.chunkSpans.clear();
+    v.spans = &v.chunkSpans;
+    if (syn) {
+        hlSync(buf, *syn, row);
+        uint32_t state = chunkStates(*syn, *L, l.hlIn, j);
+        lexLine(*syn, v.text, state, &v.chunkSpans, v.base + v.text.size() < L->len);
+    }
+}
+
+
+// Drops the cached spans and column indexes of every row, used when too
+// many have piled up
+void hlTrimSpans(TextBuffer &buf) {
+    for (TextBuffer::Block &blk : buf.blocks) {
+        for (Line &l : blk.lines) {
+            l.spans.reset();
+            l.cols.reset();
+        }
+    }
+    buf.hlSpanCount = 0;
+}
+
+
+// [Background lexer]
+// Worker thread: lexes one job at a time. A row keeps the state it had if it
+// starts in the same state as before and was not changed since, like in
+// hlSync. Gives up on a job as soon as the buffer has changed under it.
+void lexerRun(BackgroundLexer *X) {
+    for (;;) {
+        HlJob *job;
+        {
+            std::unique_lock<std::mutex> guard(X->lock);
+            X->wake.wait(guard, [X] { return X->stop || X->job.load(); });
+            if (X->stop) return;
+            job = X->job.exchange(nullptr);
+        }
+        uint32_t state = job->state;
+        size_t part = 0;
+        job->out.reserve(job->ends.size());
+        for (size_t r = 0; r < job->ends.size(); r++) {
+            if ((r & 1023) == 0 && (X->stop || X->latest != job->edits)) break;
+            if (job->oldOut[r] != HL_UNKNOWN && job->oldIn[r] == state) {
+                state = job->oldOut[r];
+            } else {
+                for (; part < job->ends[r]; part++) {
+                    state = lexLine(*job->syn, job->parts[part], state, nullptr, part + 1 < job->ends[r]);
+                }
+            }
+            part = job->ends[r];
+            job->out.push_back(state);
+        }
+        delete X->result.exchange(job);
+    }
+}
+
+
+// Hands the rows from the frontier on to the worker, up to target or, past
+// it, to the furthest row highlighted so far
+void lexerSchedule(EditorState &E, size_t target) {
+    BackgroundLexer &X = E.lexer;
+    TextBuffer &buf = E.buf;
+    size_t from = buf.hlFrontier;
+    size_t end = std::min(buf.lineCount(), std::max(target + 1, X.reach));
+    if (X.busy || !E.syntax || from >= end) return;
+    end = std::min(end, from + HL_JOB_ROWS);
+
+    HlJob *job = new HlJob;
+    job->syn = E.syntax;
+    job->edits = buf.hlEdits;
+    job->first = from;
+    job->state = from == 0 ? HL_NORMAL : buf.lineRef(from - 1).hlOut;
+    size_t n = end - from;
+    job->parts.reserve(n);
+    job->ends.reserve(n);
+    job->oldIn.reserve(n);
+    job->oldOut.reserve(n);
+    const char *map = E.map.data, *mapEnd = E.map.data + E.map.size;
+    size_t off = from;
+    for (size_t b = buf.locate(off); from < end; b++, off = 0) {
+        const std::vector<Line> &lines = buf.blocks[b].lines;
+        for (size_t k = off; k < lines.size() && from < end; k++, from++) {
+            const Line &l = lines[k];
+            job->oldIn.push_back(l.hlIn);
+            job->oldOut.push_back(l.hlOut);
+            if (l.big) {
+                for (const LineChunk &c : l.big->chunks) {
+                    job->copies.push_back(c.text);
+                    job->parts.push_back(job->copies.back());
+                }
+            } else if (l.mapped() && l.data >= map && l.data + l.len <= mapEnd) {
+                job->parts.push_back(std::string_view(l.data, l.len));
+            } else {
+                // Edited, or a view into the pager's window, which is replaced as it moves
+                job->copies.emplace_back(l.text());
+                job->parts.push_back(job->copies.back());
+            }
+            job->ends.push_back(job->parts.size());
+        }
+    }
+
+    X.busy = true;
+    X.latest = buf.hlEdits;
+    if (!X.worker.joinable()) {
+        X.stop = false;
+        X.worker = std::thread(lexerRun, &X);
+    }
+    X.job = job;
+    { std::lock_guard<std::mutex> guard(X.lock); }
+    X.wake.notify_one();
+}
+
+
+// Takes a finished job, if there is one, and moves the frontier over its rows
+// when the buffer has not changed since it was made
+void lexerPoll(EditorState &E) {
+    BackgroundLexer &X = E.lexer;
+    TextBuffer &buf = E.buf;
+    X.latest = buf.hlEdits;
+    std::unique_ptr<HlJob> job(X.result.exchange(nullptr));
+    if (!job) return;
+    X.busy = false;
+
+    size_t end = job->first + job->out.size();
+    if (job->edits != buf.hlEdits || buf.hlFrontier < job->first || buf.hlFrontier >= end || end > buf.lineCount()) return;
+    size_t r = buf.hlFrontier, off = r;
+    uint32_t state = r == job->first ? job->state : job->out[r - job->first - 1];
+    for (size_t b = buf.locate(off); r < end; b++, off = 0) {
+        TextBuffer::Block &blk = buf.blocks[b];
+        bool whole = r - off + blk.lines.size() <= end;
+        for (size_t k = off; k < blk.lines.size() && r < end; k++, r++) {
+            Line &l = blk.lines[k];
+            if (l.hlIn != state) {
+                l.spans.reset();
+                if (k == 0) buf.bracketsStale(b);
+            }
+            l.hlIn = state;
+            l.hlOut = state = job->out[r - job->first];
+        }
+        blk.hlStale = !whole; // past end the block may still have the old states
+    }
+    buf.hlFrontier = end;
+    X.reach = std::max(X.reach, end);
+}
+
+
+// Called by drawRows before the rows on screen, the last of them lastRow, are
+// drawn: brings in what the worker finished, lexes a little right away and
+// leaves the rest to the worker
+void lexerUpdate(EditorState &E, size_t lastRow) {
+    TextBuffer &buf = E.buf;
+    lexerPoll(E);
+    buf.hlBudget = HL_SYNC_ROWS;
+    hlSync(buf, *E.syntax, lastRow);
+    E.lexer.reach = std::max(E.lexer.reach, buf.hlFrontier);
+    lexerSchedule(E, lastRow);
+}
+
+
+void lexerStop(EditorState &E) {
+    BackgroundLexer &X = E.lexer;
+    if (X.worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(X.lock);
+            X.stop = true;
+        }
+        X.wake.notify_one();
+        X.worker.join();
+    }
+    delete X.job.exchange(nullptr);
+    delete X.result.exchange(nullptr);
+    X.busy = false;
+    X.reach = 0;
+}
+
+
+// [Bracket matching]
+// Every block keeps what its code brackets do to the depth (a BracketSum); a
+// segment tree over the blocks combines them, so the block holding the match
+// of a bracket is found in O(log n) however far away it is, and only that
+// block and the cursor's are scanned row by row. The lexer decides what is
+// code, so brackets in comments and strings do not count. A block is counted
+// again when one of its rows changes or its first row starts in another state.
+const size_t BRACKET_DRAW_BLOCKS = 64; // blocks counted per frame for drawing
+
+struct BracketAt {
+    size_t at;
+    char c;
+};
+
+// What one search needs; lexed is the number of blocks before the highlight frontier
+struct BracketSearch {
+    TextBuffer &buf;
+    const Syntax &syn;
+    bool sync;     // lex rows as far as needed, or give up at the frontier
+    size_t budget; // blocks that may still be counted
+    size_t lexed;
+    int kind;
+    std::vector<BracketAt> found;
+};
+
+
+int bracketKind(char c) {
+    switch (c) {
+        case '(': case ')': return 0;
+        case '[': case ']': return 1;
+        case '{': case '}': return 2;
+        default: return -1;
+    }
+}
+
+
+bool bracketOpens(char c) {
+    return c == '(' || c == '[' || c == '{';
+}
+
+
+void addBracket(BracketSum &s, char c) {
+    int k = bracketKind(c);
+    s.minBefore[k] = std::min(s.minBefore[k], s.delta[k]);
+    s.delta[k] += bracketOpens(c) ? 1 : -1;
+    s.minAfter[k] = std::min(s.minAfter[k], s.delta[k]);
+}
+
+
+BracketSum joinBrackets(const BracketSum &a, const BracketSum &b) {
+    BracketSum s;
+    for (int k = 0; k < 3; k++) {
+        s.delta[k] = a.delta[k] + b.delta[k];
+        s.minAfter[k] = b.minAfter[k] == BRACKET_NONE ? a.minAfter[k] : std::min(a.minAfter[k], a.delta[k] + b.minAfter[k]);
+        s.minBefore[k] = b.minBefore[k] == BRACKET_NONE ? a.minBefore[k] : std::min(a.minBefore[k], a.delta[k] + b.minBefore[k]);
+    }
+    return s;
+}
+
+
+// A row is lexed in pieces: the row itself, or the chunks of a long row
+size_t pieceCount(Line &l) {
+    LongLine *L = longLine(l);
+    return L ? L->chunks.size() : 1;
+}
+
+
+size_t pieceAt(Line &l, size_t at) {
+    LongLine *L = longLine(l);
+    return L ? chunkAt(*L, at) : 0;
+}
+
+
+// Code brackets of piece j of a lexed row, with their offsets in the row
+void pieceBrackets(const Syntax &syn, Line &l, size_t j, std::vector<BracketAt> &out) {
+    static std::vector<uint32_t> at;
+    at.clear();
+    out.clear();
+    LongLine *L = longLine(l);
+    std::string_view text;
+    size_t base = 0;
+    if (L) {
+        uint32_t state = chunkStates(syn, *L, l.hlIn, j);
+        text = L->chunks[j].text;
+        base = L->chunks[j].start;
+        lexLine(syn, text, state, nullptr, j + 1 < L->chunks.size(), &at);
+    } else {
+        text = l.text();
+        lexLine(syn, text, l.hlIn, nullptr, false, &at);
+    }
+    for (uint32_t x : at) out.push_back(BracketAt{base + x, text[x]});
+}
+
+
+// Lexes the rows up to the end of block b
+void bracketLex(BracketSearch &S, size_t b) {
+    TextBuffer &buf = S.buf;
+    size_t budget = buf.hlBudget;
+    buf.hlBudget = SIZE_MAX;
+    hlSync(buf, S.syn, buf.blockStart(b) + buf.blocks[b].lines.size() - 1);
+    buf.hlBudget = budget;
+    size_t off = buf.hlFrontier;
+    S.lexed = buf.locate(off);
+}
+
+
+// Brackets of block b, counted again if the block changed; false if it is not
+// lexed yet or the budget is used up
+bool bracketLeaf(BracketSearch &S, size_t b, BracketSum &sum) {
+    if (b >= S.buf.blocks.size()) {
+        sum = BracketSum();
+        return true;
+    }
+    if (b >= S.lexed) return false;
+    TextBuffer::Block &blk = S.buf.blocks[b];
+    uint32_t in = blk.lines.empty() ? HL_NORMAL : blk.lines.front().hlIn;
+    if (!blk.bracketsValid || blk.bracketsIn != in) {
+        if (S.budget == 0) return false;
+        S.budget--;
+        blk.brackets = BracketSum();
+        for (Line &l : blk.lines) {
+            for (size_t j = 0, n = pieceCount(l); j < n; j++) {
+                pieceBrackets(S.syn, l, j, S.found);
+                for (const BracketAt &x : S.found) addBracket(blk.brackets, x.c);
+            }
+        }
+        blk.bracketsIn = in;
+        blk.bracketsValid = true;
+    }
+    sum = blk.brackets;
+    return true;
+}
+
+
+// Sum of the blocks lo..hi-1 under tree node n, all lexed; inner nodes are
+// kept until a block under them changes
+bool bracketNode(BracketSearch &S, size_t n, size_t lo, size_t hi, BracketSum &sum) {
+    TextBuffer &buf = S.buf;
+    if (hi - lo == 1) return bracketLeaf(S, lo, sum);
+    if (lo >= buf.blocks.size()) {
+        sum = BracketSum();
+        return true;
+    }
+    if (buf.bracketTreeValid[n]) {
+        sum = buf.bracketTree[n];
+        return true;
+    }
+    BracketSum a, b;
+    size_t mid = (lo + hi) / 2;
+    if (!bracketNode(S, 2 * n, lo, mid, a) || !bracketNode(S, 2 * n + 1, mid, hi, b)) return false;
+    sum = joinBrackets(a, b);
+    buf.bracketTree[n] = sum;
+    buf.bracketTreeValid[n] = 1;
+    return true;
+}
+
+
+// First block from `first` on in which the depth, e before it, drops below
+// zero; e is moved past the blocks skipped. -1 if there is none, -2 if blocks
+// that cannot be lexed or counted now are in the way.
+long findForward(BracketSearch &S, size_t n, size_t lo, size_t hi, size_t first, int32_t &e) {
+    size_t blocks = S.buf.blocks.size();
+    if (hi <= first || lo >= blocks) return -1;
+    int k = S.kind;
+    if (lo >= first && std::min(hi, blocks) <= S.lexed) {
+        BracketSum sum;
+        if (!bracketNode(S, n, lo, hi, sum)) return -2;
+        if (sum.minAfter[k] == BRACKET_NONE || e + sum.minAfter[k] >= 0) {
+            e += sum.delta[k];
+            return -1;
+        }
+        if (hi - lo == 1) return (long)lo;
+    } else if (hi - lo == 1) {
+        if (!S.sync) return -2;
+        bracketLex(S, lo);
+        return findForward(S, n, lo, hi, first, e);
+    }
+    size_t mid = (lo + hi) / 2;
+    long r = findForward(S, 2 * n, lo, mid, first, e);
+    return r != -1 ? r : findForward(S, 2 * n + 1, mid, hi, first, e);
+}
+
+
+// Last block before `last` in which the depth, read backwards with e after
+// it, drops below zero; the blocks before the cursor are always lexed
+long findBackward(BracketSearch &S, size_t n, size_t lo, size_t hi, size_t last, int32_t &e) {
+    if (lo >= last || lo >= S.buf.blocks.size()) return -1;
+    int k = S.kind;
+    if (hi <= last) {
+        BracketSum sum;
+        if (!bracketNode(S, n, lo, hi, sum)) return -2;
+        if (sum.minBefore[k] == BRACKET_NONE || e + sum.minBefore[k] - sum.delta[k] >= 0) {
+            e -= sum.delta[k];
+            return -1;
+        }
+        if (hi - lo == 1) return (long)lo;
+    }
+    size_t mid = (lo + hi) / 2;
+    long r = findBackward(S, 2 * n + 1, mid, hi, last, e);
+    return r != -1 ? r : findBackward(S, 2 * n, lo, mid, last, e);
+}
+
+
+// Rows row..end-1, from byte `from` of the first: the bracket that takes the
+// depth e below zero
+bool scanForward(BracketSearch &S, size_t row, size_t from, size_t end, int32_t &e, BracketPair &p) {
+    for (; row < end; row++, from = 0) {
+        Line &l = S.buf.lineRef(row);
+        for (size_t j = pieceAt(l, from), n = pieceCount(l); j < n; j++) {
+            pieceBrackets(S.syn, l, j, S.found);
+            for (const BracketAt &x : S.found) {
+                if (x.at < from || bracketKind(x.c) != S.kind) continue;
+                e += bracketOpens(x.c) ? 1 : -1;
+                if (e < 0) {
+                    p.matchRow = (long)row;
+                    p.matchCol = x.at;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+
+// The same backwards, from row down to stop, before byte `before` of row
+bool scanBackward(BracketSearch &S, size_t row, size_t before, size_t stop, int32_t &e, BracketPair &p) {
+    for (;; row--, before = SIZE_MAX) {
+        Line &l = S.buf.lineRef(row);
+        size_t j = before == SIZE_MAX ? pieceCount(l) : pieceAt(l, before) + 1;
+        while (j-- > 0) {
+            pieceBrackets(S.syn, l, j, S.found);
+            for (size_t i = S.found.size(); i-- > 0;) {
+                const BracketAt &x = S.found[i];
+                if (x.at >= before || bracketKind(x.c) != S.kind) continue;
+                e += bracketOpens(x.c) ? -1 : 1;
+                if (e < 0) {
+                    p.matchRow = (long)row;
+                    p.matchCol = x.at;
+                    return true;
+                }
+            }
+        }
+        if (row == stop) return false;
+    }
+}
+
+
+// Finds the bracket at the cursor, or just before it, and its match. With
+// sync rows are lexed as far as the search needs; without, only rows lexed
+// already are looked at, a few blocks are counted, and p.pending says the
+// answer is not known yet. Returns whether a match was found.
+bool bracketPair(EditorState &E, BracketPair &p, bool sync) {
+    TextBuffer &buf = E.buf;
+    p.row = p.matchRow = -1;
+    p.pending = p.counting = false;
+    if (!E.syntax || E.cy < 0 || E.cy >= (int)buf.lineCount() || E.cx < 0) return false;
+
+    BracketSearch S{buf, *E.syntax, sync, sync ? SIZE_MAX : BRACKET_DRAW_BLOCKS, 0, 0, {}};
+    size_t cy = E.cy, cx = E.cx;
+    size_t off = cy;
+    size_t b = buf.locate(off);
+    size_t start = cy - off, end = start + buf.blocks[b].lines.size();
+    if (sync) bracketLex(S, b);
+    if (cy >= buf.hlFrontier) {
+        p.pending = true;
+        return false;
+    }
+    off = buf.hlFrontier;
+    S.lexed = buf.locate(off);
+
+    Line &l = buf.lineRef(cy);
+    BracketAt at{0, 0};
+    for (size_t i = 0; i < 2 && i <= cx && !at.c; i++) {
+        size_t want = cx - i;
+        if (want >= l.size()) continue;
+        pieceBrackets(S.syn, l, pieceAt(l, want), S.found);
+        for (const BracketAt &x : S.found) {
+            if (x.at == want) at = x;
+        }
+    }
+    if (!at.c) return false;
+    p.row = (long)cy;
+    p.col = at.at;
+    S.kind = bracketKind(at.c);
+
+    size_t leaves = 1;
+    while (leaves < buf.blocks.size()) leaves *= 2;
+    if (buf.bracketTreeValid.size() != 2 * leaves) {
+        buf.bracketTree.assign(2 * leaves, BracketSum());
+        buf.bracketTreeValid.assign(2 * leaves, 0);
+    }
+
+    int32_t e = 0;
+    long blk;
+    if (bracketOpens(at.c)) {
+        size_t stop = std::min(end, buf.hlFrontier);
+        if (scanForward(S, cy, at.at + 1, stop, e, p)) return true;
+        if (stop < end) {
+            p.pending = true;
+            return false;
+        }
+        blk = findForward(S, 1, 0, leaves, b + 1, e);
+        if (blk >= 0) {
+            size_t first = buf.blockStart(blk);
+            return scanForward(S, first, 0, first + buf.blocks[blk].lines.size(), e, p);
+        }
+    } else {
+        if (scanBackward(S, cy, at.at, start, e, p)) return true;
+        blk = findBackward(S, 1, 0, leaves, b, e);
+        if (blk >= 0) {
+            size_t first = buf.blockStart(blk);
+            return scanBackward(S, first + buf.blocks[blk].lines.size() - 1, SIZE_MAX, first, e, p);
+        }
+    }
+    p.pending = blk == -2;
+    p.counting = p.pending && S.budget == 0;
+    return false;
+}
+
+
+// Called by drawRows: looks for the pair under the cursor again when the
+// cursor or the text moved, or when an answer left open can get further, and
+// marks the rows of the old and the new pair for repainting. A match past the
+// highlight frontier has the background lexer go on further down.
+void bracketUpdate(EditorState &E) {
+    BracketPair &p = E.bracket;
+    TextBuffer &buf = E.buf;
+    bool open = p.counting || (p.pending && p.frontier != buf.hlFrontier);
+    if (!open && p.cx == E.cx && p.cy == E.cy && p.edits == buf.hlEdits && p.lines == buf.lineCount()) return;
+    BracketPair old = p;
+    bracketPair(E, p, false);
+    p.cx = E.cx;
+    p.cy = E.cy;
+    p.edits = buf.hlEdits;
+    p.lines = buf.lineCount();
+    p.frontier = buf.hlFrontier;
+    if (p.pending && !p.counting) E.lexer.reach = std::max(E.lexer.reach, buf.hlFrontier + HL_JOB_ROWS);
+    if (old.row == p.row && old.col == p.col && old.matchRow == p.matchRow && old.matchCol == p.matchCol) return;
+    for (long row : {old.row, old.matchRow, p.row, p.matchRow}) {
+        if (row >= 0) damageRows(E, (int)row, (int)row);
+    }
+}
+
+
+// Moves the cursor onto the match of the bracket at or before it
+void jumpToBracket(EditorState &E) {
+    BracketPair p;
+    if (bracketPair(E, p, true)) {
+        E.cy = (int)p.matchRow;
+        E.cx = (int)p.matchCol;
+    } else {
+        setStatusMessage(E, p.row < 0 ? "No bracket at the cursor" : "No matching bracket");
+    }
+}
+
+
+// [Config and Key Management]
+
+// Minimal "TOML-like" parser for our config file
+void loadConfig(EditorConfig &conf, const std::string &path) {
+    setDefaultKeybindings(conf);
+
+    std::ifstream in(path);
+    if (!in) {
+        // No config file, keep defaults
+        return;
+    }
+
+    std::string line;
+    std::string section;
+    while (std::getline(in, line)) {
+        // Trim
+        auto trim = [](std::string &s) {
+            s.erase(s.begin(), std::find_if(s.begin(), s.end(),
+                   [](unsigned char ch){ return !std::isspace(ch); }));
+            s.erase(std::find_if(s.rbegin(), s.rend(),
+                   [](unsigned char ch){ return !std::isspace(ch); }).base(),
+                   s.end());
+        };
+
+        trim(line);
+        if (line.empty() || line[0] == '#') continue;
+
+        if (line.front() == '[' && line.back() == ']') {
+            section = line.substr(1, line.size() - 2);
+            trim(section);
+            continue;
+        }
+
+        auto pos = line.find('=');
+        if (pos == std::string::npos) continue;
+
+        std::string key = line.substr(0, pos);
+        std::string value = line.substr(pos + 1);
+        trim(key);
+        trim(value);
+
+        // Remove quotes if present
+        if (!value.empty() && value.front() == '"' && value.back() == '"') {
+            value = value.substr(1, value.size() - 2);
+        }
+
+        if (section == "options") {
+            if (key == "tabsize") {
+                conf.tabSize = std::atoi(value.c_str());
+            } else if (key == "show_line_numbers") {
+                conf.showLineNumbers = (value == "true" || value == "1");
+            } else if (key == "journal") {
+                conf.journal = (value == "true" || value == "1");
+            } else if (key == "reopen_cache") {
+                conf.reopenCache = (value == "true" || value == "1");
+            } else if (key == "undo_memory_mb") {
+                conf.undoMemory = (size_t)std::max(1, std::atoi(value.c_str())) << 20;
+            } else if (key == "soft_wrap") {
+                conf.softWrap = (value == "true" || value == "1");
+            }
+        } else if (section == "keys") {
+            // Preferred form is action = "Key" like the defaults;
+            // the older "Key" = action form is still understood
+            std::string action = key;
+            std::string keyStr = value;
+            if (actionFromName(key) == Action::NONE && actionFromName(value) != Action::NONE) {
+                std::swap(action, keyStr);
+            }
+
+            int kcode = parseKeyString(keyStr);
+            if (actionFromName(action) == Action::NONE) {
+                conf.warnings.push_back("unknown action '" + action + "'");
+            } else if (kcode == -1) {
+                conf.warnings.push_back("unknown key '" + keyStr + "' for " + action);
+            } else {
+                conf.keyMap[action] = kcode;
+                conf.userBound.push_back(action);
+            }
+        }
+    }
+}
+
+
+// Turns the action -> key map into a flat key -> action table, so a keypress
+// resolves with one array lookup. Defaults go in first and bindings from the
+// config file override them; every key claimed twice is reported.
+void buildDispatchTable(EditorConfig &conf) {
+    conf.dispatch.assign(KEY_TABLE_SIZE, Action::NONE);
+    std::vector<std::string> names;
+    for (const auto &kv : conf.keyMap) names.push_back(kv.first);
+    std::sort(names.begin(), names.end());
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (const std::string &name : names) {
+            bool user = std::find(conf.userBound.begin(), conf.userBound.end(), name) != conf.userBound.end();
+            if (user != (pass == 1)) continue;
+
+            int code = conf.keyMap[name];
+            Action act = actionFromName(name);
+            if (act == Action::NONE) continue;
+            if (code < 0 || code >= KEY_TABLE_SIZE) {
+                conf.warnings.push_back("key code " + std::to_string(code) + " of " + name + " is out of range");
+                continue;
+            }
+
+            Action prev = conf.dispatch[code];
+            if (prev != Action::NONE) {
+                std::string prevName;
+                for (const ActionName &a : actionNames) {
+                    if (a.action == prev) prevName = a.name;
+                }
+                conf.warnings.push_back(keyName(code) + " is bound to both " + prevName + " and " + name);
+            }
+            conf.dispatch[code] = act;
+        }
+    }
+}
+
+
+Action mapKeyToAction(const EditorState &E, int key) {
+    if (key < 0 || key >= (int)E.config.dispatch.size()) return Action::NONE;
+    return E.config.dispatch[key];
+}
+
+
+void setStatusMessage(EditorState &E, const std::string &msg) {
+    E.statusMsg = msg;
+    E.statusTime = std::time(nullptr);
+}
+
+
+void reloadConfig(EditorState &E) {
+    EditorConfig conf;
+    loadConfig(conf, E.configPath);
+    buildDispatchTable(conf);
+    E.config = std::move(conf);
+    E.screen.full = true; // tab size or line numbers may have changed
+
+    if (E.config.warnings.empty()) {
+        setStatusMessage(E, "Config reloaded");
+    } else {
+        setStatusMessage(E, "config: " + E.config.warnings.front() +
+                         (E.config.warnings.size() > 1 ? " (+" + std::to_string(E.config.warnings.size() - 1) + " more)" : ""));
+    }
+}
+
+
+// Marks file rows from..to (inclusive) for repainting; to < 0 means down to the last screen row
+void damageRows(EditorState &E, int from, int to) {
+    ScreenState &S = E.screen;
+    if (S.wrap) {
+        // Screen rows no longer follow file rows one to one
+        for (size_t y = 0; y < S.dirty.size() && y < S.painted.size(); y++) {
+            int row = S.painted[y].first;
+            if (row >= from && (to < 0 || row <= to)) S.dirty[y] = 1;
+        }
+        return;
+    }
+    int first = std::max(0, from - S.rowOffset);
+    int last = to < 0 ? (int)S.dirty.size() - 1 : std::min((int)S.dirty.size() - 1, to - S.rowOffset);
+    for (int y = first; y <= last; y++) S.dirty[y] = 1;
+}
+
+
+// [Buffer Edits]
+// Every change to the text is one of these two primitives, so undo/redo only
+// has to remember the text that went in or came out, never the whole buffer.
+
+// Inserts text (may contain '\n') at row/col; endRow/endCol get the position after it
+void bufferInsert(TextBuffer &buf, int row, int col, const std::string &text, int &endRow, int &endCol) {
+    if (row == (int)buf.lineCount()) buf.appendLine("");
+
+    size_t nl = text.find('\n');
+    if (nl == std::string::npos) {
+        // Within a row: a long row only moves the bytes of one chunk
+        if (LongLine *L = longLine(buf.changeLine(row))) longInsert(*L, col, text);
+        else buf.mutableLine(row).insert(col, text);
+        endRow = row;
+        endCol = col + (int)text.size();
+        return;
+    }
+
+    std::string &line = buf.mutableLine(row);
+    std::string tail = line.substr(col);
+    line.erase(col);
+    line.append(text, 0, nl);
+
+    size_t start = nl + 1;
+    while ((nl = text.find('\n', start)) != std::string::npos) {
+        buf.insertLine(++row, text.substr(start, nl - start));
+        start = nl + 1;
+    }
+    std::string last = text.substr(start);
+    endRow = row + 1;
+    endCol = (int)last.size();
+    buf.insertLine(endRow, last + tail);
+}
+
+
+// Removes len bytes starting at row/col, where a line break counts as one byte
+std::string bufferErase(TextBuffer &buf, int row, int col, size_t len) {
+    std::string removed;
+    while (len > 0 && row < (int)buf.lineCount()) {
+        size_t avail = buf.lineLength(row) - col;
+        if (len <= avail) {
+            if (LongLine *L = longLine(buf.changeLine(row))) {
+                removed += longErase(*L, col, len);
+            } else {
+                std::string &line = buf.mutableLine(row);
+                removed.append(line, col, len);
+                line.erase(col, len);
+            }
+            break;
+        }
+        std::string &line = buf.mutableLine(row);
+        if (row + 1 >= (int)buf.lineCount()) {
+            removed.append(line, col, avail);
+            line.erase(col);
+            break;
+        }
+        // Take the rest of this line plus the line break, then join the next line
+        removed.append(line, col, avail);
+        removed += '\n';
+        line.erase(col);
+        line += buf.line(row + 1);
+        buf.eraseLine(row + 1);
+        len -= avail + 1;
+    }
+    return removed;
+}
+
+
+// [Binary encoding]
+// Little endian integers, varints and FNV-1a, shared by the on-disk formats
+void putU64(std::string &out, uint64_t v) {
+    for (int i = 0; i < 8; i++) out += (char)(v >> (8 * i));
+}
+
+
+uint64_t getU64(const char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    return v;
+}
+
+
+void putVarint(std::string &out, uint64_t v) {
+    for (; v >= 0x80; v >>= 7) out += (char)(v | 0x80);
+    out += (char)v;
+}
+
+
+bool getVarint(std::string_view in, size_t &pos, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        unsigned char b = in[pos++];
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+
+uint32_t fnv1a(const char *p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char)p[i]) * 16777619u;
+    return h;
+}
+
+
+uint64_t fnv1a64(const char *p, size_t n, uint64_t h = 14695981039346656037ull) {
+    for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char)p[i]) * 1099511628211ull;
+    return h;
+}
+
+
+// [Undo and Redo Logic]
+// The history is kept per editor in E.history, see UndoHistory.
+
+
+// [Undo spill]
+// See UndoSpill: the oldest steps are serialized, compressed and appended to
+// an unlinked temp file, which works as a stack of chunks.
+
+
+size_t groupBytes(const UndoGroup &g) {
+    size_t n = sizeof(UndoGroup);
+    for (const EditOp &op : g.ops) n += sizeof(EditOp) + op.text.size();
+    return n;
+}
+
+
+// LZ4 block format: sequences of a token (literal count << 4 | match length
+// - 4), the literals, a 16-bit offset back into the output and the match;
+// counts of 15 or more continue in bytes of 255. The last sequence has
+// literals only and, as the format requires, covers at least the last 5 bytes;
+// no match starts in the last 12. Matches are found through a hash of 4-byte
+// prefixes. The table is kept between calls and not cleared: a stale entry is
+// only used when it lies before i and its bytes still match.
+void lz4Compress(std::string_view in, std::string &out, std::vector<uint32_t> &table) {
+    const int HASH_BITS = 14;
+    const size_t LAST_LITERALS = 5, MATCH_LIMIT = 12;
+    table.resize(1 << HASH_BITS); // position + 1 of the last prefix with this hash
+    size_t n = in.size(), anchor = 0, i = 0;
+    auto load32 = [&](size_t at) {
+        uint32_t v;
+        memcpy(&v, in.data() + at, 4);
+        return v;
+    };
+    auto putCount = [&](size_t v) {
+        for (; v >= 255; v -= 255) out += (char)255;
+        out += (char)v;
+    };
+    auto putSequence = [&](size_t literals, size_t offset, size_t match) {
+        size_t lit = literals - anchor;
+        size_t m = match ? match - 4 : 0;
+        out += (char)(std::min<size_t>(lit, 15) << 4 | std::min<size_t>(m, 15));
+        if (lit >= 15) putCount(lit - 15);
+        out.append(in.data() + anchor, lit);
+        if (!match) return;
+        out += (char)offset;
+        out += (char)(offset >> 8);
+        if (m >= 15) putCount(m - 15);
+    };
+
+    while (i + MATCH_LIMIT <= n) {
+        uint32_t seq = load32(i);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        size_t cand = table[h];
+        table[h] = i + 1;
+        if (cand && cand - 1 < i && i - (cand - 1) <= 65535 && load32(cand - 1) == seq) {
+            size_t from = cand - 1, len = 4;
+            while (i + len < n - LAST_LITERALS && in[from + len] == in[i + len]) len++;
+            putSequence(i, i - from, len);
+            i += len;
+            anchor = i;
+        } else {
+            i += 1 + ((i - anchor) >> 6); // skip faster through data that does not compress
+        }
+    }
+    putSequence(n, 0, 0);
+}
+
+
+bool lz4Decompress(std::string_view in, size_t raw, std::string &out) {
+    out.clear();
+    out.reserve(raw);
+    size_t i = 0;
+    auto getCount = [&](size_t &v) {
+        if (v < 15) return true;
+        unsigned char b;
+        do {
+            if (i >= in.size()) return false;
+            b = in[i++];
+            v += b;
+        } while (b == 255);
+        return true;
+    };
+    while (i < in.size()) {
+        unsigned char token = in[i++];
+        size_t lit = token >> 4, match = token & 15;
+        if (!getCount(lit) || lit > in.size() - i || lit > raw - out.size()) return false;
+        out.append(in.data() + i, lit);
+        i += lit;
+        if (i == in.size()) break;
+        if (in.size() - i < 2) return false;
+        size_t offset = (unsigned char)in[i] | (unsigned char)in[i + 1] << 8;
+        i += 2;
+        if (!getCount(match)) return false;
+        match += 4;
+        if (offset == 0 || offset > out.size() || match > raw - out.size()) return false;
+        size_t from = out.size() - offset;
+        for (size_t k = 0; k < match; k++) out += out[from + k]; // may overlap what it copies
+    }
+    return out.size() == raw;
+}
+
+
+void putGroup(std::string &out, const UndoGroup &g) {
+    for (int v : {g.cxBefore, g.cyBefore, g.cxAfter, g.cyAfter}) putVarint(out, v);
+    putVarint(out, g.ops.size());
+    for (const EditOp &op : g.ops) {
+        out += op.insert ? 'i' : 'e';
+        putVarint(out, op.row);
+        putVarint(out, op.col);
+        putVarint(out, op.text.size());
+        out += op.text;
+    }
+}
+
+
+bool getGroup(std::string_view in, size_t &pos, UndoGroup &g) {
+    uint64_t v[5];
+    for (uint64_t &x : v) {
+        if (!getVarint(in, pos, x)) return false;
+    }
+    g.cxBefore = v[0];
+    g.cyBefore = v[1];
+    g.cxAfter = v[2];
+    g.cyAfter = v[3];
+    for (uint64_t k = 0; k < v[4]; k++) {
+        uint64_t row, col, len;
+        if (pos >= in.size()) return false;
+        bool insert = in[pos++] == 'i';
+        if (!getVarint(in, pos, row) || !getVarint(in, pos, col) || !getVarint(in, pos, len) || len > in.size() - pos) return false;
+        g.ops.push_back(EditOp{insert, (int)row, (int)col, std::string(in.substr(pos, len))});
+        pos += len;
+    }
+    return true;
+}
+
+
+int undoSpillFile(UndoSpill &S) {
+    if (S.failed) return -1;
+    if (S.fd != -1) return S.fd;
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/lume-undo-XXXXXX";
+    S.fd = mkstemp(&path[0]);
+    if (S.fd == -1) {
+        S.failed = true;
+        return -1;
+    }
+    unlink(path.c_str()); // gone with the process, however it ends
+    fcntl(S.fd, F_SETFD, FD_CLOEXEC);
+    return S.fd;
+}
+
+
+// Moves the oldest steps out of memory until undoStack is back to three
+// quarters of the budget; the newest step always stays
+void undoTrim(EditorState &E) {
+    UndoHistory &H = E.history;
+    size_t budget = E.config.undoMemory;
+    if (H.undoBytes <= budget || H.undoStack.size() < 2) return;
+
+    std::string raw;
+    size_t keep = budget / 4 * 3, taken = 0;
+    while (H.undoStack.size() > 1 && (H.undoBytes > keep || taken == 0)) {
+        putGroup(raw, H.undoStack.front());
+        H.undoBytes -= groupBytes(H.undoStack.front());
+        H.undoStack.pop_front();
+        taken++;
+    }
+
+    UndoSpill &S = H.spill;
+    int fd = undoSpillFile(S);
+    if (fd == -1) return;
+    std::string packed;
+    lz4Compress(raw, packed, S.hashTable);
+    size_t done = 0;
+    while (done < packed.size()) {
+        ssize_t n = pwrite(fd, packed.data() + done, packed.size() - done, S.end + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done < packed.size()) {
+        // Disk full or similar: these steps are lost, and so is everything older
+        S.chunks.clear();
+        S.end = 0;
+        if (ftruncate(fd, 0) != 0) S.failed = true;
+        return;
+    }
+    S.chunks.push_back(SpillChunk{S.end, packed.size(), raw.size()});
+    S.end += packed.size();
+}
+
+
+// Brings the newest spilled chunk back into undoStack, which is empty
+bool undoUnspill(UndoHistory &H) {
+    UndoSpill &S = H.spill;
+    if (S.chunks.empty()) return false;
+    SpillChunk c = S.chunks.back();
+    S.chunks.pop_back();
+    S.end = c.offset;
+
+    std::string packed(c.packed, '\0'), raw;
+    bool ok = pread(S.fd, &packed[0], c.packed, c.offset) == (ssize_t)c.packed && lz4Decompress(packed, c.raw, raw);
+    if (ftruncate(S.fd, c.offset) != 0) S.failed = true;
+    size_t pos = 0;
+    while (ok && pos < raw.size()) {
+        UndoGroup g;
+        ok = getGroup(raw, pos, g);
+        if (!ok) break;
+        H.undoBytes += groupBytes(g);
+        H.undoStack.push_back(std::move(g));
+    }
+    if (!ok) {
+        // Unreadable: the history ends here
+        S.chunks.clear();
+        S.end = 0;
+    }
+    return !H.undoStack.empty();
+}
+
+
+// Forgets all history, when the buffer is replaced under it
+void undoClear(EditorState &E) {
+    UndoHistory &H = E.history;
+    H.undoStack.clear();
+    H.redoStack.clear();
+    H.undoBytes = 0;
+    H.spill.chunks.clear();
+    H.spill.end = 0;
+    if (H.spill.fd != -1 && ftruncate(H.spill.fd, 0) != 0) H.spill.failed = true;
+}
+
+
+// Stops the current typing run, so the next edit starts a new undo step
+void closeUndoRun(EditorState &E) {
+    UndoHistory &H = E.history;
+    if (!H.undoStack.empty()) H.undoStack.back().open = false;
+}
+
+
+// Records one edit; consecutive single-line inserts (or backspaces) that
+// continue where the last one ended are merged into a single undo step
+void recordEdit(EditorState &E, EditOp op, int cxBefore, int cyBefore, int cxAfter, int cyAfter, bool coalesce) {
+    UndoHistory &H = E.history;
+    H.redoStack.clear();
+
+    if (coalesce && !H.undoStack.empty() && H.undoStack.back().open &&
+        op.text.find('\n') == std::string::npos) {
+        UndoGroup &g = H.undoStack.back();
+        EditOp &last = g.ops.back();
+        if (op.insert && last.insert && op.row == last.row &&
+            op.col == last.col + (int)last.text.size()) {
+            last.text += op.text;
+            H.undoBytes += op.text.size();
+            g.cxAfter = cxAfter;
+            g.cyAfter = cyAfter;
+            undoTrim(E);
+            return;
+        }
+        if (!op.insert && !last.insert && op.row == last.row &&
+            op.col + (int)op.text.size() == last.col) {
+            last.text.insert(0, op.text);
+            H.undoBytes += op.text.size();
+            last.col = op.col;
+            g.cxAfter = cxAfter;
+            g.cyAfter = cyAfter;
+            undoTrim(E);
+            return;
+        }
+    }
+
+    UndoGroup g;
+    g.cxBefore = cxBefore;
+    g.cyBefore = cyBefore;
+    g.cxAfter = cxAfter;
+    g.cyAfter = cyAfter;
+    g.open = coalesce;
+    g.ops.push_back(std::move(op));
+    H.undoBytes += groupBytes(g);
+    H.undoStack.push_back(std::move(g));
+    undoTrim(E);
+}
+
+
+// Records a batch of edits made in one go (replace-all) as a single undo step
+void recordGroup(EditorState &E, UndoGroup g) {
+    UndoHistory &H = E.history;
+    H.redoStack.clear();
+    closeUndoRun(E);
+    g.open = false;
+    H.undoBytes += groupBytes(g);
+    H.undoStack.push_back(std::move(g));
+    undoTrim(E);
+}
+
+
+// Inserts text at the cursor and moves the cursor behind it
+void editInsert(EditorState &E, const std::string &text, bool coalesce) {
+    int cx = E.cx, cy = E.cy;
+    int endRow, endCol;
+    bufferInsert(E.buf, cy, cx, text, endRow, endCol);
+    damageRows(E, cy, endRow == cy ? cy : -1);
+    journalEdit(E, true, cy, cx, text);
+    E.cy = endRow;
+    E.cx = endCol;
+    E.dirty = true;
+    E.changeId++;
+    recordEdit(E, EditOp{true, cy, cx, text}, cx, cy, E.cx, E.cy, coalesce);
+}
+
+
+// Removes len bytes at row/col and leaves the cursor there
+void editErase(EditorState &E, int row, int col, size_t len, bool coalesce) {
+    int cx = E.cx, cy = E.cy;
+    std::string removed = bufferErase(E.buf, row, col, len);
+    damageRows(E, row, removed.find('\n') == std::string::npos ? row : -1);
+    journalEdit(E, false, row, col, removed);
+    E.cy = row;
+    E.cx = col;
+    E.dirty = true;
+    E.changeId++;
+    recordEdit(E, EditOp{false, row, col, std::move(removed)}, cx, cy, E.cx, E.cy, coalesce);
+}
+
+
+void applyOp(EditorState &E, const EditOp &op, bool inverse) {
+    int endRow, endCol;
+    damageRows(E, op.row, op.text.find('\n') == std::string::npos ? op.row : -1);
+    if (op.insert != inverse) {
+        bufferInsert(E.buf, op.row, op.col, op.text, endRow, endCol);
+    } else {
+        bufferErase(E.buf, op.row, op.col, op.text.size());
+    }
+    journalEdit(E, op.insert != inverse, op.row, op.col, op.text);
+}
+
+
+void undo(EditorState &E) {
+    UndoHistory &H = E.history;
+    if (H.undoStack.empty() && !undoUnspill(H)) return;
+    UndoGroup g = std::move(H.undoStack.back());
+    H.undoStack.pop_back();
+    H.undoBytes -= groupBytes(g);
+
+    for (auto it = g.ops.rbegin(); it != g.ops.rend(); ++it) {
+        applyOp(E, *it, true);
+    }
+    E.cx = g.cxBefore;
+    E.cy = g.cyBefore;
+    E.dirty = true; // still dirty after undo
+    E.changeId++;
+
+    g.open = false;
+    H.redoStack.push_back(std::move(g));
+}
+
+
+void redo(EditorState &E) {
+    UndoHistory &H = E.history;
+    if (H.redoStack.empty()) return;
+    UndoGroup g = std::move(H.redoStack.back());
+    H.redoStack.pop_back();
+
+    for (const EditOp &op : g.ops) {
+        applyOp(E, op, false);
+    }
+    E.cx = g.cxAfter;
+    E.cy = g.cyAfter;
+    E.dirty = true;
+    E.changeId++;
+
+    H.undoBytes += groupBytes(g);
+    H.undoStack.push_back(std::move(g));
+    undoTrim(E);
+}
+
+
+// [Regular expressions]
+// A small engine for replace-all: the pattern is parsed into a tree, compiled
+// to a program and run as a Pike VM, so matching stays linear in the row
+// length whatever the pattern. Supported: literals, . [] [^] \d \w \s (and
+// the upper-case negations), \b \B ^ $, groups ( ) (?: ), | and the
+// quantifiers * + ? {m} {m,} {m,n}, each optionally lazy with a trailing ?.
+enum ReNodeType { RN_EMPTY, RN_CHAR, RN_ANY, RN_CLASS, RN_BOL, RN_EOL, RN_WORDB, RN_NWORDB,
+                  RN_CAT, RN_ALT, RN_GROUP, RN_REPEAT };
+
+struct ReNode {
+    ReNodeType type = RN_EMPTY;
+    unsigned char c = 0;
+    int cls = -1;
+    int group = -1;        // RN_GROUP: capture index, -1 for (?: )
+    int min = 0, max = -1; // RN_REPEAT, max -1 is unbounded
+    bool greedy = true;
+    std::vector<int> kids;
+};
+
+struct ReParser {
+    const std::string &src;
+    size_t pos = 0;
+    std::vector<ReNode> nodes;
+    Regex &re;
+    std::string error;
+
+    ReParser(const std::string &s, Regex &r) : src(s), re(r) {}
+
+    int add(ReNode n) {
+        nodes.push_back(std::move(n));
+        return (int)nodes.size() - 1;
+    }
+
+    bool more() const { return pos < src.size(); }
+
+    int fail(const std::string &msg) {
+        if (error.empty()) error = msg + " at " + std::to_string(pos);
+        return -1;
+    }
+
+    // \d \w \s and their negations, as a class
+    int namedClass(char k) {
+        std::bitset<256> set;
+        char lower = std::tolower((unsigned char)k);
+        for (int ch = 0; ch < 256; ch++) {
+            bool in = lower == 'd' ? std::isdigit(ch) != 0
+                    : lower == 'w' ? (std::isalnum(ch) != 0 || ch == '_')
+                    : std::isspace(ch) != 0;
+            set[ch] = in;
+        }
+        if (k != lower) set.flip();
+        re.classes.push_back(set);
+        return (int)re.classes.size() - 1;
+    }
+
+    int parseClass() {
+        std::bitset<256> set;
+        bool negate = more() && src[pos] == '^';
+        if (negate) pos++;
+        bool first = true;
+        while (more() && (src[pos] != ']' || first)) {
+            first = false;
+            unsigned char lo = src[pos++];
+            if (lo == '\\' && more()) {
+                char k = src[pos++];
+                if (std::strchr("dDwWsS", k)) {
+                    set |= re.classes[namedClass(k)];
+                    re.classes.pop_back();
+                    continue;
+                }
+                lo = k == 't' ? '\t' : (unsigned char)k;
+            }
+            unsigned char hi = lo;
+            if (pos + 1 < src.size() && src[pos] == '-' && src[pos + 1] != ']') {
+                pos++;
+                hi = src[pos++];
+                if (hi == '\\' && more()) hi = src[pos++];
+                if (hi < lo) return fail("bad range");
+            }
+            for (int ch = lo; ch <= hi; ch++) set[ch] = true;
+        }
+        if (!more()) return fail("missing ]");
+        pos++;
+        if (negate) set.flip();
+        re.classes.push_back(set);
+        ReNode n;
+        n.type = RN_CLASS;
+        n.cls = (int)re.classes.size() - 1;
+        return add(n);
+    }
+
+    int parseAtom() {
+        char ch = src[pos++];
+        ReNode n;
+        switch (ch) {
+            case '(': {
+                if (src.compare(pos, 2, "?:") == 0) {
+                    pos += 2;
+                } else {
+                    if (re.groups >= REGEX_MAX_GROUPS) return fail("too many groups");
+                    n.group = ++re.groups;
+                }
+                int inner = parseAlt();
+                if (inner < 0) return -1;
+                if (!more() || src[pos] != ')') return fail("missing )");
+                pos++;
+                n.type = RN_GROUP;
+                n.kids.push_back(inner);
+                return add(n);
+            }
+            case '[':
+                return parseClass();
+            case '.':
+                n.type = RN_ANY;
+                return add(n);
+            case '^':
+                n.type = RN_BOL;
+                return add(n);
+            case '$':
+                n.type = RN_EOL;
+                return add(n);
+            case '\\': {
+                if (!more()) return fail("trailing \\");
+                char k = src[pos++];
+                if (std::strchr("dDwWsS", k)) {
+                    n.type = RN_CLASS;
+                    n.cls = namedClass(k);
+                } else if (k == 'b' || k == 'B') {
+                    n.type = k == 'b' ? RN_WORDB : RN_NWORDB;
+                } else {
+                    n.type = RN_CHAR;
+                    n.c = k == 't' ? '\t' : (unsigned char)k;
+                }
+                return add(n);
+            }
+            case '*': case '+': case '?': case '{':
+                pos--;
+                return fail("nothing to repeat");
+            default:
+                n.type = RN_CHAR;
+                n.c = (unsigned char)ch;
+                return add(n);
+        }
+    }
+
+    // Reads {m}, {m,} or {m,n}; false leaves pos alone so '{' is a literal
+    bool parseCount(int &min, int &max) {
+        size_t p = pos + 1;
+        auto number = [&](int &out) {
+            size_t start = p;
+            out = 0;
+            while (p < src.size() && std::isdigit((unsigned char)src[p]) && out <= 1000) out = out * 10 + (src[p++] - '0');
+            return p > start;
+        };
+        if (!number(min)) return false;
+        max = min;
+        if (p < src.size() && src[p] == ',') {
+            p++;
+            if (!number(max)) max = -1;
+        }
+        if (p >= src.size() || src[p] != '}') return false;
+        pos = p + 1;
+        return true;
+    }
+
+    int parseRepeat() {
+        int atom = parseAtom();
+        while (atom >= 0 && more()) {
+            ReNode n;
+            n.type = RN_REPEAT;
+            char q = src[pos];
+            if (q == '*') {
+                n.min = 0, n.max = -1, pos++;
+            } else if (q == '+') {
+                n.min = 1, n.max = -1, pos++;
+            } else if (q == '?') {
+                n.min = 0, n.max = 1, pos++;
+            } else if (q != '{' || !parseCount(n.min, n.max)) {
+                break;
+            }
+            if (n.max >= 0 && (n.max < n.min || n.max > 1000)) return fail("bad repeat count");
+            if (more() && src[pos] == '?') {
+                n.greedy = false;
+                pos++;
+            }
+            n.kids.push_back(atom);
+            atom = add(n);
+        }
+        return atom;
+    }
+
+    int parseCat() {
+        ReNode n;
+        n.type = RN_CAT;
+        while (more() && src[pos] != '|' && src[pos] != ')') {
+            int k = parseRepeat();
+            if (k < 0) return -1;
+            n.kids.push_back(k);
+        }
+        return add(n);
+    }
+
+    int parseAlt() {
+        int left = parseCat();
+        while (left >= 0 && more() && src[pos] == '|') {
+            pos++;
+            int right = parseCat();
+            if (right < 0) return -1;
+            ReNode n;
+            n.type = RN_ALT;
+            n.kids = {left, right};
+            left = add(n);
+        }
+        return left;
+    }
+
+    void emit(ReOp op, int x = 0, int y = 0, unsigned char c = 0) {
+        re.prog.push_back(ReInst{op, c, x, y});
+    }
+
+    // Stops emitting as soon as the program is over REGEX_MAX_PROGRAM, so
+    // nested counted repeats like (a{1000}){1000} are turned down cheaply
+    void compile(int id) {
+        if (re.prog.size() > REGEX_MAX_PROGRAM) return;
+        const ReNode &n = nodes[id];
+        switch (n.type) {
+            case RN_EMPTY: break;
+            case RN_CHAR: emit(RE_CHAR, 0, 0, n.c); break;
+            case RN_ANY: emit(RE_ANY); break;
+            case RN_CLASS: emit(RE_CLASS, n.cls); break;
+            case RN_BOL: emit(RE_BOL); break;
+            case RN_EOL: emit(RE_EOL); break;
+            case RN_WORDB: emit(RE_WORDB); break;
+            case RN_NWORDB: emit(RE_NWORDB); break;
+            case RN_CAT:
+                for (int k : n.kids) compile(k);
+                break;
+            case RN_ALT: {
+                size_t split = re.prog.size();
+                emit(RE_SPLIT);
+                re.prog[split].x = (int)re.prog.size();
+                compile(n.kids[0]);
+                size_t jmp = re.prog.size();
+                emit(RE_JMP);
+                re.prog[split].y = (int)re.prog.size();
+                compile(n.kids[1]);
+                re.prog[jmp].x = (int)re.prog.size();
+                break;
+            }
+            case RN_GROUP:
+                if (n.group >= 0) emit(RE_SAVE, 2 * n.group);
+                compile(n.kids[0]);
+                if (n.group >= 0) emit(RE_SAVE, 2 * n.group + 1);
+                break;
+            case RN_REPEAT: {
+                for (int i = 0; i < n.min && re.prog.size() <= REGEX_MAX_PROGRAM; i++) compile(n.kids[0]);
+                if (n.max < 0) {
+                    // L: split body, out; body; jmp L
+                    size_t split = re.prog.size();
+                    emit(RE_SPLIT);
+                    compile(n.kids[0]);
+                    emit(RE_JMP, (int)split);
+                    setSplit(split, split + 1, re.prog.size(), n.greedy);
+                } else {
+                    // Optional copies: split body, out; body; ...
+                    std::vector<size_t> splits;
+                    for (int i = n.min; i < n.max && re.prog.size() <= REGEX_MAX_PROGRAM; i++) {
+                        splits.push_back(re.prog.size());
+                        emit(RE_SPLIT);
+                        compile(n.kids[0]);
+                    }
+                    for (size_t s : splits) setSplit(s, s + 1, re.prog.size(), n.greedy);
+                }
+                break;
+            }
+        }
+    }
+
+    void setSplit(size_t at, size_t body, size_t out, bool greedy) {
+        re.prog[at].x = (int)(greedy ? body : out);
+        re.prog[at].y = (int)(greedy ? out : body);
+    }
+};
+
+
+// Longest run of literal bytes every match must start with; zero-width
+// assertions in front of it are checked by the VM at the same position
+std::string regexPrefix(const Regex &re) {
+    std::string prefix;
+    size_t pc = 0;
+    for (; pc < re.prog.size(); pc++) {
+        ReOp op = re.prog[pc].op;
+        if (op == RE_SAVE || (prefix.empty() && (op == RE_BOL || op == RE_WORDB || op == RE_NWORDB))) continue;
+        if (op != RE_CHAR) break;
+        prefix += (char)re.prog[pc].c;
+    }
+    // A jump back into the run would make part of it optional or repeated
+    for (const ReInst &in : re.prog) {
+        bool jumps = in.op == RE_SPLIT || in.op == RE_JMP;
+        if (jumps && (in.x < (int)pc || (in.op == RE_SPLIT && in.y < (int)pc))) return std::string();
+    }
+    return prefix;
+}
+
+
+bool compileRegex(const std::string &pattern, Regex &re, std::string &error) {
+    re = Regex();
+    ReParser p(pattern, re);
+    int root = p.parseAlt();
+    if (root >= 0 && p.more()) root = p.fail("unmatched )");
+    if (root < 0) {
+        error = p.error;
+        return false;
+    }
+    p.emit(RE_SAVE, 0);
+    p.compile(root);
+    p.emit(RE_SAVE, 1);
+    p.emit(RE_MATCH);
+    if (re.prog.size() > REGEX_MAX_PROGRAM) {
+        error = "pattern too large";
+        return false;
+    }
+    re.prefix = regexPrefix(re);
+    // SAVE 0, the bytes, SAVE 1, MATCH: no VM needed
+    re.literal = re.groups == 0 && re.prog.size() == re.prefix.size() + 3;
+    return true;
+}
+
+
+bool isWordByte(std::string_view t, size_t i) {
+    return i < t.size() && (std::isalnum((unsigned char)t[i]) || t[i] == '_');
+}
+
+
+// Follows jumps and zero-width instructions from pc and queues the threads
+// that wait on a byte, in priority order
+void reAddThread(const Regex &re, RegexVM &vm, std::vector<RegexVM::Thread> &list, int pc,
+                 const RegexCaps &caps, std::string_view t, size_t pos) {
+    if (vm.mark[pc] == vm.gen) return;
+    vm.mark[pc] = vm.gen;
+    const ReInst &in = re.prog[pc];
+    switch (in.op) {
+        case RE_JMP:
+            reAddThread(re, vm, list, in.x, caps, t, pos);
+            break;
+        case RE_SPLIT:
+            reAddThread(re, vm, list, in.x, caps, t, pos);
+            reAddThread(re, vm, list, in.y, caps, t, pos);
+            break;
+        case RE_SAVE: {
+            RegexCaps next = caps;
+            next[in.x] = pos;
+            reAddThread(re, vm, list, pc + 1, next, t, pos);
+            break;
+        }
+        case RE_BOL:
+            if (pos == 0) reAddThread(re, vm, list, pc + 1, caps, t, pos);
+            break;
+        case RE_EOL:
+            if (pos == t.size()) reAddThread(re, vm, list, pc + 1, caps, t, pos);
+            break;
+        case RE_WORDB:
+        case RE_NWORDB: {
+            bool edge = (pos > 0 && isWordByte(t, pos - 1)) != isWordByte(t, pos);
+            if (edge == (in.op == RE_WORDB)) reAddThread(re, vm, list, pc + 1, caps, t, pos);
+            break;
+        }
+        default:
+            list.push_back(RegexVM::Thread{pc, caps});
+            break;
+    }
+}
+
+
+// Leftmost match starting at or after from; caps[2g], caps[2g+1] bound group g
+bool regexSearch(const Regex &re, RegexVM &vm, std::string_view t, size_t from, RegexCaps &caps) {
+    if (re.literal) {
+        size_t hit = from <= t.size() ? findSubstring(t.data() + from, t.size() - from, re.prefix) : std::string_view::npos;
+        if (hit == std::string_view::npos) return false;
+        caps[0] = from + hit;
+        caps[1] = from + hit + re.prefix.size();
+        return true;
+    }
+    if (vm.mark.size() < re.prog.size()) vm.mark.assign(re.prog.size(), 0);
+    vm.cur.clear();
+    bool matched = false;
+    RegexCaps none;
+    none.fill(std::string_view::npos);
+
+    for (size_t pos = from; pos <= t.size(); pos++) {
+        if (!matched) {
+            if (vm.cur.empty() && !re.prefix.empty()) {
+                // No thread alive: skip straight to the next place the prefix occurs
+                size_t hit = findSubstring(t.data() + pos, t.size() - pos, re.prefix);
+                if (hit == std::string_view::npos) return false;
+                pos += hit;
+            }
+            vm.gen++;
+            for (const RegexVM::Thread &th : vm.cur) vm.mark[th.pc] = vm.gen;
+            reAddThread(re, vm, vm.cur, 0, none, t, pos);
+        }
+        if (vm.cur.empty()) {
+            if (matched) break;
+            continue; // an assertion failed here; try the next position
+        }
+
+        vm.next.clear();
+        vm.gen++;
+        for (const RegexVM::Thread &th : vm.cur) {
+            const ReInst &in = re.prog[th.pc];
+            bool step = false;
+            if (in.op == RE_MATCH) {
+                matched = true;
+                caps = th.caps;
+                break; // lower-priority threads lose
+            }
+            if (pos < t.size()) {
+                unsigned char ch = t[pos];
+                step = in.op == RE_ANY || (in.op == RE_CHAR && in.c == ch) ||
+                       (in.op == RE_CLASS && re.classes[in.x][ch]);
+            }
+            if (step) reAddThread(re, vm, vm.next, th.pc + 1, th.caps, t, pos + 1);
+        }
+        vm.cur.swap(vm.next);
+        if (matched && vm.cur.empty()) break;
+    }
+    return matched;
+}
+
+
+// Appends the replacement for one match: \0 is the whole match, \1..\9 the groups
+void regexExpand(const std::string &tmpl, std::string_view t, const RegexCaps &caps, std::string &out) {
+    for (size_t i = 0; i < tmpl.size(); i++) {
+        char ch = tmpl[i];
+        if (ch == '\\' && i + 1 < tmpl.size()) {
+            char k = tmpl[++i];
+            if (k >= '0' && k <= '9') {
+                size_t g = k - '0';
+                if (caps[2 * g] != std::string_view::npos && caps[2 * g + 1] != std::string_view::npos) {
+                    out.append(t, caps[2 * g], caps[2 * g + 1] - caps[2 * g]);
+                }
+                continue;
+            }
+            ch = k == 't' ? '\t' : k;
+        }
+        out += ch;
+    }
+}
+
+
+// [Replace all]
+const size_t REPLACE_ROWS_PER_THREAD = 16384;
+
+struct RowReplace {
+    size_t row = 0;
+    size_t matches = 0;
+    std::string text;        // the new row
+    std::vector<EditOp> ops; // erase + insert per match, for undo
+};
+
+
+// Worker: rewrites every matching row of blocks [fromBlock, toBlock), whose
+// first row is firstRow. Only reads the buffer.
+void replaceBlocks(const TextBuffer &buf, size_t fromBlock, size_t toBlock, size_t firstRow,
+                   const Regex &re, const std::string &with, std::vector<RowReplace> *out) {
+    RegexVM vm;
+    RegexCaps caps;
+    size_t row = firstRow;
+    for (size_t b = fromBlock; b < toBlock; b++) {
+        for (const Line &l : buf.blocks[b].lines) {
+            std::string_view t = l.text();
+            RowReplace *r = nullptr;
+            size_t pos = 0, copied = 0;
+            while (pos <= t.size() && regexSearch(re, vm, t, pos, caps)) {
+                size_t s = caps[0], e = caps[1];
+                if (!r) {
+                    out->emplace_back();
+                    r = &out->back();
+                    r->row = row;
+                }
+                r->text.append(t, copied, s - copied);
+                size_t col = r->text.size();
+                regexExpand(with, t, caps, r->text);
+                // Columns are those of the row as rewritten so far, so the
+                // ops replay left to right and undo right to left
+                if (e > s) r->ops.push_back(EditOp{false, (int)row, (int)col, std::string(t.substr(s, e - s))});
+                if (r->text.size() > col) r->ops.push_back(EditOp{true, (int)row, (int)col, r->text.substr(col)});
+                r->matches++;
+                copied = e;
+                if (e == s) {
+                    // An empty match: keep the next byte and move past it
+                    if (s < t.size()) r->text += t[s];
+                    copied = pos = s + 1;
+                } else {
+                    pos = e;
+                }
+            }
+            if (r && copied < t.size()) r->text.append(t, copied, std::string_view::npos);
+            row++;
+        }
+    }
+}
+
+
+// Rewrites all matches of pattern in the buffer: the rows are split across
+// threads, the new rows are put in afterwards, and the whole change is one
+// undo step and one repaint.
+void replaceAll(EditorState &E, const std::string &pattern, const std::string &with) {
+    Regex re;
+    std::string error;
+    if (!compileRegex(pattern, re, error)) {
+        setStatusMessage(E, "regex: " + error);
+        return;
+    }
+    finishLoading(E);
+    uint64_t start = perfNow();
+
+    const TextBuffer &buf = E.buf;
+    size_t workers = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(),
+                                                          buf.lineCount() / REPLACE_ROWS_PER_THREAD));
+    std::vector<std::vector<RowReplace>> results(workers);
+    std::vector<std::thread> threads;
+    size_t block = 0, row = 0;
+    for (size_t w = 0; w < workers; w++) {
+        // Whole blocks, about lineCount / workers rows each
+        size_t firstBlock = block, firstRow = row;
+        size_t target = buf.lineCount() * (w + 1) / workers;
+        while (block < buf.blocks.size() && (row < target || w + 1 == workers)) {
+            row += buf.blocks[block].lines.size();
+            block++;
+        }
+        if (w + 1 == workers) {
+            replaceBlocks(buf, firstBlock, block, firstRow, re, with, &results[w]);
+        } else {
+            threads.emplace_back(replaceBlocks, std::cref(buf), firstBlock, block, firstRow,
+                                 std::cref(re), std::cref(with), &results[w]);
+        }
+    }
+    for (std::thread &t : threads) t.join();
+
+    UndoGroup g;
+    g.cxBefore = E.cx;
+    g.cyBefore = E.cy;
+    size_t matches = 0, rows = 0;
+    for (std::vector<RowReplace> &part : results) {
+        for (RowReplace &r : part) {
+            E.buf.mutableLine(r.row) = std::move(r.text);
+            std::move(r.ops.begin(), r.ops.end(), std::back_inserter(g.ops));
+            matches += r.matches;
+            rows++;
+        }
+    }
+    if (matches == 0) {
+        setStatusMessage(E, "No match for " + pattern);
+        return;
+    }
+
+    if (E.cy < (int)E.buf.lineCount()) E.cx = std::min<int>(E.cx, E.buf.lineLength(E.cy));
+    g.cxAfter = E.cx;
+    g.cyAfter = E.cy;
+    for (const EditOp &op : g.ops) journalEdit(E, op.insert, op.row, op.col, op.text);
+    recordGroup(E, std::move(g));
+    E.dirty = true;
+    E.changeId++;
+    E.screen.full = true;
+
+    char msg[128];
+    std::snprintf(msg, sizeof(msg), "Replaced %zu matches in %zu rows (%.1f ms, %zu threads)",
+                  matches, rows, (perfNow() - start) / 1e6, workers);
+    setStatusMessage(E, msg);
+}
+
+
+// [Prompt]
+void promptOpen(EditorState &E, PromptKind kind, const std::string &label) {
+    E.prompt.kind = kind;
+    E.prompt.label = label;
+    E.prompt.text.clear();
+}
+
+
+// The answer to the prompt is in; runs whatever asked for it
+void promptSubmit(EditorState &E) {
+    PromptState &P = E.prompt;
+    PromptKind kind = P.kind;
+    P.kind = PromptKind::NONE;
+    switch (kind) {
+        case PromptKind::REPLACE_PATTERN:
+            if (P.text.empty()) return;
+            P.pattern = P.text;
+            promptOpen(E, PromptKind::REPLACE_WITH, "Replace " + P.pattern + " with: ");
+            break;
+        case PromptKind::REPLACE_WITH:
+            replaceAll(E, P.pattern, P.text);
+            break;
+        case PromptKind::GOTO:
+            gotoLine(E, P.text);
+            break;
+        default:
+            break;
+    }
+}
+
+
+void promptKey(EditorState &E, int c) {
+    PromptState &P = E.prompt;
+    if (c == 27) { // Escape
+        P.kind = PromptKind::NONE;
+    } else if (c == '\r' || c == '\n') {
+        promptSubmit(E);
+    } else if (c == LUME_KEY_BACKSPACE || c == 127 || c == CTRL_KEY('h')) {
+        if (!P.text.empty()) P.text.pop_back();
+    } else if (c == '\t' || (c >= 32 && c < 127)) {
+        P.text += (char)c;
+    }
+}
+
+
+// [Newline scanning]
+// Finds the end of the row starting at pos; returns where the next row starts
+size_t scanLine(const MappedFile &m, size_t pos, size_t &len) {
+    const char *nl = (const char *)std::memchr(m.data + pos, '\n', m.size - pos);
+    size_t end = nl ? nl - m.data : m.size;
+    len = end - pos;
+    // Remove trailing '\r'
+    if (len > 0 && m.data[end - 1] == '\r') len--;
+    return nl ? end + 1 : m.size;
+}
+
+
+// Appends the offset (base + index) of every '\n' in p[0..n)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void findNewlinesAVX2(const char *p, size_t n, size_t base, std::vector<size_t> &out) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        while (mask) {
+            out.push_back(base + i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < n; i++) {
+        if (p[i] == '\n') out.push_back(base + i);
+    }
+}
+
+
+__attribute__((target("sse2")))
+void findNewlinesSSE2(const char *p, size_t n, size_t base, std::vector<size_t> &out) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask) {
+            out.push_back(base + i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; i < n; i++) {
+        if (p[i] == '\n') out.push_back(base + i);
+    }
+}
+#endif
+
+
+void findNewlinesScalar(const char *p, size_t n, size_t base, std::vector<size_t> &out) {
+    const char *end = p + n;
+    const char *q = p;
+    while ((q = (const char *)std::memchr(q, '\n', end - q)) != nullptr) {
+        out.push_back(base + (q - p));
+        q++;
+    }
+}
+
+
+void findNewlines(const char *p, size_t n, size_t base, std::vector<size_t> &out) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    static const bool hasSSE2 = __builtin_cpu_supports("sse2");
+    if (hasAVX2) return findNewlinesAVX2(p, n, base, out);
+    if (hasSSE2) return findNewlinesSSE2(p, n, base, out);
+#endif
+    findNewlinesScalar(p, n, base, out);
+}
+
+
+const size_t SCAN_CHUNK = 4 << 20;
+
+
+// Background thread: indexes rows from pos to the end of the mapping. Each
+// round hands one SCAN_CHUNK per core to a scanning thread, then merges the
+// per-chunk newline tables in order into rows and publishes them.
+void indexLines(LineLoader *L, MappedFile m, size_t pos) {
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::vector<size_t>> found(workers);
+    std::vector<std::pair<size_t, size_t>> batch;
+    size_t scanPos = pos; // pos is where the current row starts
+
+    while (scanPos < m.size && !L->stop) {
+        size_t roundEnd = std::min(m.size, scanPos + SCAN_CHUNK * workers);
+        size_t chunks = (roundEnd - scanPos + SCAN_CHUNK - 1) / SCAN_CHUNK;
+
+        auto scanChunk = [&](size_t c) {
+            size_t from = scanPos + c * SCAN_CHUNK;
+            size_t to = std::min(roundEnd, from + SCAN_CHUNK);
+            found[c].clear();
+            findNewlines(m.data + from, to - from, from, found[c]);
+        };
+        std::vector<std::thread> pool;
+        for (size_t c = 1; c < chunks; c++) pool.emplace_back(scanChunk, c);
+        scanChunk(0);
+        for (auto &t : pool) t.join();
+
+        batch.clear();
+        for (size_t c = 0; c < chunks; c++) {
+            for (size_t nl : found[c]) {
+                size_t len = nl - pos;
+                // Remove trailing '\r'
+                if (len > 0 && m.data[nl - 1] == '\r') len--;
+                batch.emplace_back(pos, len);
+                pos = nl + 1;
+            }
+        }
+        scanPos = roundEnd;
+
+        if (scanPos == m.size && pos < m.size) {
+            // Last row without a line break
+            size_t len = m.size - pos;
+            if (m.data[m.size - 1] == '\r') len--;
+            batch.emplace_back(pos, len);
+            pos = m.size;
+        }
+
+        std::lock_guard<std::mutex> guard(L->lock);
+        L->ready.insert(L->ready.end(), batch.begin(), batch.end());
+        L->scanned = scanPos;
+    }
+    L->done = true;
+}
+
+
+// [Edit journal]
+// File layout, integers little endian:
+//   header  "LUMEJNL1", u64 file size, u64 mtime seconds, u64 mtime nanoseconds
+//   record  'i' or 'e', varint row, varint col, varint length, the inserted
+//           bytes ('i' only), u32 FNV-1a of everything before it in the record
+// A torn record at the end (the crash hit mid-write) fails its checksum and
+// ends the replay there.
+const char JOURNAL_MAGIC[] = "LUMEJNL1";
+const size_t JOURNAL_HEADER = 32;
+
+std::string journalPath(const std::string &filename) {
+    size_t slash = filename.find_last_of('/');
+    size_t name = slash == std::string::npos ? 0 : slash + 1;
+    return filename.substr(0, name) + "." + filename.substr(name) + ".lume-journal";
+}
+
+
+// Header for the file as it is on disk now; a file that does not exist yet has size and mtime 0
+std::string journalHeader(const std::string &filename) {
+    struct stat st;
+    bool exists = stat(filename.c_str(), &st) == 0;
+    std::string h(JOURNAL_MAGIC, 8);
+    putU64(h, exists ? st.st_size : 0);
+    putU64(h, exists ? st.st_mtim.tv_sec : 0);
+    putU64(h, exists ? st.st_mtim.tv_nsec : 0);
+    return h;
+}
+
+
+// Writer thread: appends whatever records piled up, then syncs them
+void journalWriter(EditJournal *J) {
+    std::unique_lock<std::mutex> guard(J->lock);
+    for (;;) {
+        J->wake.wait(guard, [J] { return !J->pending.empty() || J->stop; });
+        if (J->pending.empty()) break; // stopped and drained
+        std::string out;
+        out.swap(J->pending);
+        guard.unlock();
+
+        for (size_t done = 0; done < out.size();) {
+            ssize_t n = write(J->fd, out.data() + done, out.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break; // disk full or gone: the journal just ends here
+            done += n;
+        }
+        fdatasync(J->fd);
+        guard.lock();
+    }
+}
+
+
+void journalRun(EditJournal &J, int fd) {
+    J.fd = fd;
+    J.stop = false;
+    J.worker = std::thread(journalWriter, &J);
+}
+
+
+// Starts a new journal for the file as it is on disk
+bool journalStart(EditorState &E) {
+    EditJournal &J = E.journal;
+    J.path = journalPath(E.filename);
+    int fd = open(J.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    std::string header = journalHeader(E.filename);
+    if (fd == -1 || write(fd, header.data(), header.size()) != (ssize_t)header.size()) {
+        setStatusMessage(E, "No edit journal (" + J.path + ": " + std::strerror(errno) + ")");
+        if (fd != -1) {
+            close(fd);
+            unlink(J.path.c_str());
+        }
+        J.failed = true;
+        return false;
+    }
+    journalRun(J, fd);
+    return true;
+}
+
+
+// Lets the writer drain and closes the journal, which stays on disk
+void journalStop(EditJournal &J) {
+    if (J.fd == -1) return;
+    {
+        std::lock_guard<std::mutex> guard(J.lock);
+        J.stop = true;
+    }
+    J.wake.notify_one();
+    J.worker.join();
+    close(J.fd);
+    J.fd = -1;
+}
+
+
+// The file on disk has everything: the journal is not needed any more
+void journalDiscard(EditorState &E) {
+    EditJournal &J = E.journal;
+    if (J.fd == -1) return;
+    journalStop(J);
+    unlink(J.path.c_str());
+}
+
+
+// Called for every change to the buffer, before the editor marks itself
+// dirty. A journal is only started on a clean buffer, whose text is still
+// the file's; during a save the records wait for the new file instead.
+void journalEdit(EditorState &E, bool insert, int row, int col, const std::string &text) {
+    EditJournal &J = E.journal;
+    if (!E.config.journal) {
+        journalDiscard(E);
+        return;
+    }
+    if (E.filename.empty() || J.failed) return;
+
+    std::string rec;
+    rec += insert ? 'i' : 'e';
+    putVarint(rec, row);
+    putVarint(rec, col);
+    putVarint(rec, text.size());
+    if (insert) rec += text;
+    uint32_t sum = fnv1a(rec.data(), rec.size());
+    for (int i = 0; i < 4; i++) rec += (char)(sum >> (8 * i));
+
+    if (J.saving) J.sinceSave += rec;
+    if (J.fd == -1 && (J.saving || E.dirty || !journalStart(E))) return;
+    {
+        std::lock_guard<std::mutex> guard(J.lock);
+        J.pending += rec;
+    }
+    J.wake.notify_one();
+}
+
+
+// A save finished: the old journal goes, and edits typed while the snapshot
+// was written start a new one against the file just saved
+void journalSaved(EditorState &E, bool ok, bool editedSince) {
+    EditJournal &J = E.journal;
+    J.saving = false;
+    std::string since = std::move(J.sinceSave);
+    J.sinceSave.clear();
+    if (!ok) return;
+
+    journalDiscard(E);
+    if (!editedSince || since.empty() || !E.config.journal || !journalStart(E)) return;
+    {
+        std::lock_guard<std::mutex> guard(J.lock);
+        J.pending += since;
+    }
+    J.wake.notify_one();
+}
+
+
+// Reads rows from the loader until row n exists or the file is done
+void waitForRows(EditorState &E, size_t n) {
+    while (E.loader.active && E.buf.lineCount() < n) {
+        if (!pullLoadedLines(E)) std::this_thread::yield();
+    }
+}
+
+
+// Replays a journal left by a session that did not end cleanly. Runs right
+// after openFile; only the rows the records reach have to be loaded, and the
+// replay is a single undo step.
+void journalRecover(EditorState &E) {
+    EditJournal &J = E.journal;
+    if (!E.config.journal || E.filename.empty()) return;
+    J.path = journalPath(E.filename);
+
+    int fd = open(J.path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) return;
+    std::string data;
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n > 0) data.append(chunk, n);
+    }
+
+    if (data.size() < JOURNAL_HEADER || data.compare(0, JOURNAL_HEADER, journalHeader(E.filename)) != 0) {
+        // Written against another version of the file: keep it out of the way
+        close(fd);
+        std::string stale = J.path + ".stale";
+        if (std::rename(J.path.c_str(), stale.c_str()) == 0) {
+            setStatusMessage(E, "Journal does not match " + E.filename + ", moved to " + stale);
+        }
+        return;
+    }
+
+    std::string_view in = data;
+    size_t pos = JOURNAL_HEADER;
+    size_t applied = 0;
+    bool damaged = false;
+    UndoGroup g;
+    g.cxBefore = E.cx;
+    g.cyBefore = E.cy;
+    while (pos < in.size()) {
+        size_t p = pos + 1;
+        uint64_t row, col, len;
+        char kind = in[pos];
+        if (!getVarint(in, p, row) || !getVarint(in, p, col) || !getVarint(in, p, len)) break;
+        size_t textLen = kind == 'i' ? len : 0;
+        if (len > in.size() || p + textLen + 4 > in.size()) break;
+        uint32_t sum = 0;
+        for (int i = 0; i < 4; i++) sum |= (uint32_t)(unsigned char)in[p + textLen + i] << (8 * i);
+        if (fnv1a(in.data() + pos, p + textLen - pos) != sum || (kind != 'i' && kind != 'e')) break;
+
+        // An erase may join up to len rows; make sure they are loaded
+        waitForRows(E, row + 2 + (kind == 'e' ? len : 0));
+        if (row > E.buf.lineCount() || (row < E.buf.lineCount() && col > E.buf.lineLength(row)) ||
+            (row == E.buf.lineCount() && (kind != 'i' || col != 0))) {
+            damaged = true;
+            break;
+        }
+        if (kind == 'i') {
+            std::string text(in.substr(p, len));
+            int endRow, endCol;
+            bufferInsert(E.buf, row, col, text, endRow, endCol);
+            g.ops.push_back(EditOp{true, (int)row, (int)col, std::move(text)});
+            E.cy = endRow;
+            E.cx = endCol;
+        } else {
+            g.ops.push_back(EditOp{false, (int)row, (int)col, bufferErase(E.buf, row, col, len)});
+            E.cy = row;
+            E.cx = col;
+        }
+        applied++;
+        pos = p + textLen + 4;
+    }
+
+    if (applied == 0 && !damaged) {
+        close(fd);
+        unlink(J.path.c_str());
+        return;
+    }
+    if (damaged) {
+        // Keep the whole journal around for a closer look
+        std::ofstream(J.path + ".stale", std::ios::binary) << data;
+    }
+    // Drop a torn tail and keep appending to the same journal
+    if (ftruncate(fd, pos) != 0 || lseek(fd, pos, SEEK_SET) < 0) {
+        close(fd);
+        J.failed = true;
+    } else {
+        journalRun(J, fd);
+    }
+
+    if (applied > 0) {
+        g.cxAfter = E.cx;
+        g.cyAfter = E.cy;
+        recordGroup(E, std::move(g));
+        E.dirty = true;
+        E.changeId++;
+        E.screen.full = true;
+    }
+    char msg[160];
+    std::snprintf(msg, sizeof(msg), "Recovered %zu edits from %s%s", applied, J.path.c_str(),
+                  damaged ? " (the rest did not fit the file, see .stale)" : "");
+    setStatusMessage(E, msg);
+}
+
+
+// [Follow mode]
+std::string followLastRow(const TextBuffer &buf) {
+    return buf.empty() ? std::string() : std::string(buf.line(buf.lineCount() - 1));
+}
+
+
+// (Re)opens the file under E.filename for following, offset bytes of it being
+// in the buffer already, and moves the inotify watch over to it
+bool followWatch(EditorState &E, size_t offset) {
+    FollowState &F = E.follow;
+    if (F.fd != -1) close(F.fd);
+    if (F.watch != -1) inotify_rm_watch(F.notify, F.watch);
+    F.watch = -1;
+    F.offset = offset;
+
+    struct stat st;
+    F.fd = open(E.filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (F.fd == -1 || fstat(F.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (F.fd != -1) close(F.fd);
+        F.fd = -1;
+        return false;
+    }
+    F.dev = st.st_dev;
+    F.ino = st.st_ino;
+    F.tail.assign(std::min(offset, FOLLOW_TAIL), '\0');
+    if (pread(F.fd, &F.tail[0], F.tail.size(), offset - F.tail.size()) != (ssize_t)F.tail.size()) F.tail.clear();
+    F.partial = !F.tail.empty() && F.tail.back() != '\n';
+    F.last = followLastRow(E.buf);
+    F.watch = inotify_add_watch(F.notify, E.filename.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    return true;
+}
+
+
+// A followed file may be truncated at any time (logrotate copytruncate), and
+// touching a page of the mapping past its new end raises SIGBUS. So the rows
+// already in the buffer are moved over to a copy (copyMapping). The loader is
+// stopped first; the rows it had not handed over yet are left to followPoll,
+// which reads them like appended bytes. False if the file had already shrunk
+// and some of the rows were lost.
+bool followDetach(EditorState &E) {
+    MappedFile &M = E.map;
+    if (!M.data || M.copied) return true;
+    finishSave(E); // its spans point into the mapping
+    lexerStop(E);  // and so may the rows of the job being lexed
+    LineLoader &L = E.loader;
+    size_t size = M.size;
+    if (L.active) {
+        L.stop = true;
+        L.worker.join();
+        L.active = false;
+        L.ready.clear();
+        size = L.nextRow;
+    }
+
+    // The offset is the file size, or what a save wrote, tail not loaded included
+    E.follow.offset -= M.size - size;
+    return copyMapping(E, size);
+}
+
+
+// The file shrank or was replaced: what is in the buffer no longer matches
+// it, so it is opened again from the start. Unsaved edits are not thrown
+// away for it: following stops instead, and the buffer and journal stay.
+void followReload(EditorState &E, const char *what) {
+    if (E.dirty) {
+        followStop(E);
+        setStatusMessage(E, E.filename + what + ", follow off: unsaved changes kept");
+        return;
+    }
+    journalDiscard(E);
+    openFile(E, E.filename);
+    E.cx = E.cy = E.rowOffset = E.colOffset = 0;
+    E.dirty = false;
+    E.changeId++;
+    E.screen.full = true;
+    E.follow.toEnd = true;
+    followWatch(E, E.follow.offset);
+    setStatusMessage(E, E.filename + what + ", reloaded");
+}
+
+
+bool followStart(EditorState &E) {
+    FollowState &F = E.follow;
+    if (F.active) return true;
+    if (E.filename.empty()) {
+        setStatusMessage(E, "Nothing to follow");
+        return false;
+    }
+
+    bool whole = followDetach(E);
+
+    // The directory is watched too, to see a new file take the name
+    size_t slash = E.filename.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : E.filename.substr(0, slash);
+    F.notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (F.notify == -1 || inotify_add_watch(F.notify, dir.c_str(), IN_CREATE | IN_MOVED_TO) == -1 ||
+        !followWatch(E, F.offset)) {
+        setStatusMessage(E, "Cannot follow " + E.filename + " (" + std::strerror(errno) + ")");
+        followStop(E);
+        return false;
+    }
+    F.active = true;
+    F.toEnd = true;
+    setStatusMessage(E, "Following " + E.filename);
+    if (!whole) followReload(E, " was truncated");
+    return F.active;
+}
+
+
+void followStop(EditorState &E) {
+    FollowState &F = E.follow;
+    if (F.fd != -1) close(F.fd);
+    if (F.notify != -1) close(F.notify); // takes the watches with it
+    F.fd = F.notify = F.watch = -1;
+    F.active = false;
+}
+
+
+// New bytes from the end of the file: the first piece may finish the last
+// row, the rest become new rows. Rows already in the buffer are left alone.
+// False, and nothing added, once the last row is no longer the file's: the
+// end of the buffer was edited, so there is no telling where the bytes go.
+bool followAppend(EditorState &E, const char *p, size_t n) {
+    FollowState &F = E.follow;
+    TextBuffer &buf = E.buf;
+    if (followLastRow(buf) != F.last) return false;
+    bool stick = E.cy >= (int)buf.lineCount() - 1; // cursor at the end: keep it there
+    int first = (int)buf.lineCount() - (F.partial && !buf.empty() ? 1 : 0);
+
+    size_t pos = 0;
+    while (pos < n) {
+        const char *nl = (const char *)std::memchr(p + pos, '\n', n - pos);
+        size_t len = (nl ? nl - p : n) - pos;
+        if (nl && len > 0 && p[pos + len - 1] == '\r') len--;
+        if (F.partial && !buf.empty()) {
+            int row = (int)buf.lineCount() - 1, endRow, endCol;
+            bufferInsert(buf, row, buf.lineLength(row), std::string(p + pos, len), endRow, endCol);
+        } else {
+            buf.appendLine(std::string(p + pos, len));
+        }
+        F.partial = !nl;
+        pos = nl ? nl - p + 1 : n;
+    }
+
+    damageRows(E, first, -1);
+    if (stick && !buf.empty()) {
+        E.cy = (int)buf.lineCount() - 1;
+        E.cx = std::min<int>(E.cx, buf.lineLength(E.cy));
+    }
+    F.last = followLastRow(buf);
+    return true;
+}
+
+
+// Called every frame while following. The inotify events only wake the main
+// loop up; what changed is read off the file itself. Returns true while
+// appended bytes are still waiting to be read.
+bool followPoll(EditorState &E) {
+    FollowState &F = E.follow;
+    if (!F.active) return false;
+    char events[4096];
+    while (read(F.notify, events, sizeof(events)) > 0) {}
+
+    // A save is about to replace the file. The loader never runs while
+    // following: see followDetach, and openFile maps nothing then.
+    if (E.save.active) return false;
+    if (F.toEnd) {
+        E.cy = E.buf.empty() ? 0 : (int)E.buf.lineCount() - 1;
+        E.cx = 0;
+        F.toEnd = false;
+    }
+
+    struct stat st;
+    if (F.fd == -1 || fstat(F.fd, &st) != 0) {
+        // The name is gone for now: wait for the next file to show up
+        if (stat(E.filename.c_str(), &st) == 0) followReload(E, " appeared");
+        return false;
+    }
+    // A file truncated and written again may already be longer than before,
+    // so the bytes just before the offset have to be the ones we read
+    size_t size = st.st_size;
+    std::string seen(F.tail.size(), '\0');
+    if (size < F.offset || pread(F.fd, &seen[0], seen.size(), F.offset - seen.size()) != (ssize_t)seen.size() ||
+        seen != F.tail) {
+        followReload(E, " was truncated");
+        return false;
+    }
+    if (size > F.offset) {
+        std::string chunk(std::min(size - F.offset, FOLLOW_STEP_BYTES), '\0');
+        ssize_t n = pread(F.fd, &chunk[0], chunk.size(), F.offset);
+        if (n <= 0) return false;
+        // A "\r" at the very end may be half of a "\r\n"; leave it for next time
+        bool held = n > 1 && chunk[n - 1] == '\r';
+        if (held) n--;
+        if (!followAppend(E, chunk.data(), n)) {
+            followStop(E);
+            setStatusMessage(E, "Stopped following: the end of " + E.filename + " was edited");
+            return false;
+        }
+        F.offset += n;
+        F.tail.append(chunk.data() + std::max<ssize_t>(0, n - (ssize_t)FOLLOW_TAIL), std::min<size_t>(n, FOLLOW_TAIL));
+        if (F.tail.size() > FOLLOW_TAIL) F.tail.erase(0, F.tail.size() - FOLLOW_TAIL);
+        if (F.offset + held < size) return true;
+    }
+
+    // All read; after log rotation the old file is drained first
+    if (stat(E.filename.c_str(), &st) == 0 && (st.st_dev != F.dev || st.st_ino != F.ino)) {
+        followReload(E, " was rotated");
+    }
+    return false;
+}
+
+
+// [Pager]
+// Start of the row byte pos is in: looks back for the '\n' before it
+size_t pagerRowStart(PagerState &P, size_t pos) {
+    char buf[65536];
+    while (pos > 0) {
+        size_t from = pos > sizeof(buf) ? pos - sizeof(buf) : 0;
+        ssize_t n = pread(P.fd, buf, pos - from, from);
+        if (n <= 0) return 0;
+        const char *nl = (const char *)memrchr(buf, '\n', n);
+        if (nl) return from + (nl - buf) + 1;
+        pos = from;
+    }
+    return 0;
+}
+
+
+// Start of the row n rows after the one at pos; P.size if the file ends first
+size_t pagerSkipRows(PagerState &P, size_t pos, size_t n) {
+    char buf[65536];
+    while (n > 0 && pos < P.size) {
+        ssize_t got = pread(P.fd, buf, std::min(sizeof(buf), P.size - pos), pos);
+        if (got <= 0) return P.size;
+        const char *p = buf, *end = buf + got;
+        while (n > 0 && (p = (const char *)std::memchr(p, '\n', end - p))) {
+            p++;
+            n--;
+        }
+        pos += n > 0 ? got : p - buf;
+    }
+    return std::min(pos, P.size);
+}
+
+
+// Worker: notes where every PAGER_CHECKPOINT-th row starts
+void pagerIndex(PagerState *P) {
+    std::vector<char> buf(1 << 20);
+    std::vector<uint64_t> found;
+    size_t pos = 0, newlines = 0;
+    while (pos < P->size && !P->stop) {
+        ssize_t n = pread(P->fd, buf.data(), std::min(buf.size(), P->size - pos), pos);
+        if (n <= 0) break;
+        found.clear();
+        for (const char *p = buf.data(), *end = p + n; (p = (const char *)std::memchr(p, '\n', end - p));) {
+            p++;
+            if (++newlines % PAGER_CHECKPOINT == 0) found.push_back(pos + (p - buf.data()));
+        }
+        if (!found.empty()) {
+            std::lock_guard<std::mutex> guard(P->lock);
+            P->checkpoints.insert(P->checkpoints.end(), found.begin(), found.end());
+        }
+        pos += n;
+        P->scanned = pos;
+    }
+    // A last row without a newline counts too
+    char last = '\n';
+    P->rows = newlines + (P->size > 0 && pread(P->fd, &last, 1, P->size - 1) == 1 && last != '\n');
+    P->done = true;
+}
+
+
+// Row number of the row starting at byte at; -1 until the scan gets there
+long pagerRowOf(PagerState &P, size_t at) {
+    if (!P.done && P.scanned < at) return -1;
+    size_t i;
+    uint64_t start;
+    {
+        std::lock_guard<std::mutex> guard(P.lock);
+        i = std::upper_bound(P.checkpoints.begin(), P.checkpoints.end(), at) - P.checkpoints.begin() - 1;
+        start = P.checkpoints[i];
+    }
+    size_t rows = 0;
+    char buf[65536];
+    for (size_t pos = start; pos < at;) {
+        ssize_t n = pread(P.fd, buf, std::min(sizeof(buf), at - pos), pos);
+        if (n <= 0) break;
+        rows += std::count(buf, buf + n, '\n');
+        pos += n;
+    }
+    return (long)(i * PAGER_CHECKPOINT + rows);
+}
+
+
+// File offset of the cursor's row
+size_t pagerCursorByte(const EditorState &E) {
+    const PagerState &P = E.pager;
+    if (E.cy < (int)P.rowStarts.size()) return P.windowStart + P.rowStarts[E.cy];
+    return P.windowStart + P.window.size();
+}
+
+
+// Fills the buffer with the rows around byte at, a row start, and puts the
+// cursor on that row at the same height on the screen
+void pagerLoad(EditorState &E, size_t at) {
+    PagerState &P = E.pager;
+    size_t half = PAGER_WINDOW_BYTES / 2;
+    size_t from = at > half ? pagerRowStart(P, at - half) : 0;
+    if (at - from > PAGER_WINDOW_BYTES - half / 2) from = at; // a huge row above: start at the cursor
+
+    E.buf.clear(); // the rows point into the old window
+    P.window.resize(std::min(PAGER_WINDOW_BYTES, P.size - from));
+    ssize_t n = pread(P.fd, &P.window[0], P.window.size(), from);
+    P.window.resize(n > 0 ? n : 0);
+    // Leave out a row cut by the end of the window, unless the cursor is on it
+    if (from + P.window.size() < P.size) {
+        size_t nl = P.window.rfind('\n');
+        if (nl != std::string::npos && from + nl >= at) P.window.resize(nl + 1);
+    }
+    P.windowStart = from;
+
+    int cursorRow = 0;
+    const char *data = P.window.data();
+    P.rowStarts.clear();
+    for (size_t pos = 0; pos < P.window.size();) {
+        if (from + pos == at) cursorRow = (int)E.buf.lineCount();
+        P.rowStarts.push_back(pos);
+        const char *nl = (const char *)std::memchr(data + pos, '\n', P.window.size() - pos);
+        size_t end = nl ? nl - data : P.window.size();
+        size_t len = end - pos;
+        if (len > 0 && data[end - 1] == '\r') len--;
+        E.buf.appendView(data + pos, len);
+        pos = end + 1;
+    }
+
+    int screenY = E.cy - E.rowOffset;
+    E.cy = cursorRow;
+    E.rowOffset = std::max(0, E.cy - screenY);
+    if (E.cy < (int)E.buf.lineCount()) E.cx = std::min<int>(E.cx, E.buf.lineLength(E.cy));
+    P.baseRow = pagerRowOf(P, from);
+    E.screen.full = true;
+}
+
+
+// Keeps a screenful of rows on both sides of the cursor inside the window
+void pagerSettle(EditorState &E) {
+    PagerState &P = E.pager;
+    int rows = (int)E.buf.lineCount();
+    bool above = P.windowStart > 0 && E.cy < E.screenRows;
+    bool below = P.windowStart + P.window.size() < P.size && E.cy + E.screenRows >= rows;
+    if (!above && !below) return;
+
+    size_t at = pagerCursorByte(E);
+    // Past the last row of the window; it may be the cut start of a huge row
+    if (E.cy >= rows && rows > 0) at = pagerSkipRows(P, P.windowStart + P.rowStarts.back(), 1);
+    if (at >= P.size) at = pagerRowStart(P, P.size - 1);
+    pagerLoad(E, at);
+}
+
+
+bool pagerOpen(EditorState &E, const std::string &filename) {
+    closeFile(E);
+    E.filename = filename;
+    E.syntax = selectSyntax(filename);
+
+    PagerState &P = E.pager;
+    struct stat st;
+    P.fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (P.fd == -1 || fstat(P.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        setStatusMessage(E, "Cannot view " + filename + (P.fd == -1 ? std::string(" (") + std::strerror(errno) + ")" : ""));
+        if (P.fd != -1) close(P.fd);
+        P.fd = -1;
+        return false;
+    }
+    P.size = st.st_size;
+    P.checkpoints.assign(1, 0);
+    P.scanned = 0;
+    P.rows = 0;
+    P.done = false;
+    P.stop = false;
+    P.active = true;
+    P.worker = std::thread(pagerIndex, &P);
+    E.cx = E.cy = E.rowOffset = E.colOffset = 0;
+    pagerLoad(E, 0);
+    return true;
+}
+
+
+void pagerClose(EditorState &E) {
+    PagerState &P = E.pager;
+    if (!P.active) return;
+    P.stop = true;
+    if (P.worker.joinable()) P.worker.join();
+    close(P.fd);
+    P.fd = -1;
+    P.active = false;
+    E.buf.clear();
+    P.window.clear();
+    P.window.shrink_to_fit();
+    P.rowStarts.clear();
+    P.rowStarts.shrink_to_fit();
+    P.checkpoints.clear();
+    P.checkpoints.shrink_to_fit();
+}
+
+
+// Called every frame in --view: the window follows the cursor, and row
+// numbers show up once the scan has passed the window
+void pagerPoll(EditorState &E) {
+    PagerState &P = E.pager;
+    if (!P.active) return;
+    pagerSettle(E);
+    if (P.baseRow < 0 && (P.baseRow = pagerRowOf(P, P.windowStart)) >= 0) E.screen.full = true;
+    if (P.done && P.worker.joinable()) P.worker.join();
+}
+
+
+// Keys in --view: moving around and going to a line, nothing that edits.
+// Returns true if the key was dealt with here.
+bool pagerKey(EditorState &E, int c) {
+    if (!E.pager.active || E.prompt.kind != PromptKind::NONE) return false;
+    if (c == 'q') {
+        E.quit = true;
+        return true;
+    }
+    switch (mapKeyToAction(E, c)) {
+        case Action::QUIT:
+        case Action::MOVE_UP:
+        case Action::MOVE_DOWN:
+        case Action::MOVE_LEFT:
+        case Action::MOVE_RIGHT:
+        case Action::MOVE_WORD_LEFT:
+        case Action::MOVE_WORD_RIGHT:
+        case Action::RELOAD_CONFIG:
+        case Action::PERF_OVERLAY:
+        case Action::GOTO:
+        case Action::MATCH_BRACKET:
+        case Action::SOFT_WRAP:
+            break;
+        case Action::NONE:
+            if (c == LUME_KEY_HOME || c == LUME_KEY_END || c == LUME_KEY_PPAGE || c == LUME_KEY_NPAGE ||
+                c == LUME_KEY_UP || c == LUME_KEY_DOWN || c == LUME_KEY_LEFT || c == LUME_KEY_RIGHT) break;
+            [[fallthrough]];
+        default:
+            setStatusMessage(E, "Read-only view (q quits, Ctrl-G goes to a line or N%)");
+            return true;
+    }
+    // Make room for the move before it happens
+    pagerSettle(E);
+    return false;
+}
+
+
+// Row number shown for buffer row row: in --view the buffer is a window
+// into the file; -1 if that is not known yet
+long rowNumber(const EditorState &E, int row) {
+    if (!E.pager.active) return row;
+    return E.pager.baseRow < 0 ? -1 : E.pager.baseRow + row;
+}
+
+
+void pagerGoto(EditorState &E, double n, bool percent) {
+    PagerState &P = E.pager;
+    if (P.size == 0) return;
+    size_t at;
+    if (percent) {
+        at = pagerRowStart(P, std::min<size_t>(P.size - 1, (size_t)(n / 100 * P.size)));
+    } else {
+        size_t row = n >= 1 ? (size_t)n - 1 : 0;
+        if (P.done) row = std::min(row, P.rows - 1);
+        size_t i;
+        uint64_t start;
+        bool indexed;
+        {
+            std::lock_guard<std::mutex> guard(P.lock);
+            indexed = P.done || row / PAGER_CHECKPOINT < P.checkpoints.size();
+            i = std::min(row / PAGER_CHECKPOINT, P.checkpoints.size() - 1);
+            start = P.checkpoints[i];
+        }
+        if (!indexed) {
+            char msg[96];
+            std::snprintf(msg, sizeof(msg), "Line %zu is not indexed yet (%zu%%)", row + 1, P.scanned * 100 / P.size);
+            setStatusMessage(E, msg);
+            return;
+        }
+        at = pagerSkipRows(P, start, row - i * PAGER_CHECKPOINT);
+        if (at >= P.size) at = pagerRowStart(P, P.size - 1);
+    }
+    E.cx = 0;
+    pagerLoad(E, at);
+    E.rowOffset = std::max(0, E.cy - E.screenRows / 2);
+    if (P.windowStart + P.window.size() == P.size) {
+        E.rowOffset = std::min(E.rowOffset, std::max(0, (int)E.buf.lineCount() - E.screenRows));
+    }
+}
+
+
+// Ctrl-G: "120" goes to line 120, "50%" halfway through the file
+void gotoLine(EditorState &E, const std::string &where) {
+    char *end;
+    double n = std::strtod(where.c_str(), &end);
+    bool percent = *end == '%';
+    if (end == where.c_str() || *(end + percent) != '\0' || !(n >= 0) || (percent && n > 100)) {
+        setStatusMessage(E, "Not a line number or percentage: " + where);
+        return;
+    }
+    if (E.pager.active) {
+        pagerGoto(E, n, percent);
+        return;
+    }
+
+    size_t row = n >= 1 ? (size_t)n - 1 : 0;
+    if (percent) finishLoading(E);
+    else waitForRows(E, row + 1);
+    if (E.buf.empty()) return;
+    size_t last = E.buf.lineCount() - 1;
+    if (percent) row = (size_t)(n / 100 * last + 0.5);
+    E.cy = (int)std::min(row, last);
+    E.cx = 0;
+    // Centred, but the last screen stays full
+    E.rowOffset = std::max(0, std::min(E.cy - E.screenRows / 2, (int)last + 1 - E.screenRows));
+}
+
+
+// [Reopen cache]
+// File layout, integers little endian:
+//   header  "LUMECCH1", u64 size, mtime seconds, mtime nanoseconds, inode and
+//           sample hash of the file, u64 cx, cy, rowOffset, colOffset, u64
+//           rows and bytes of the index that follows (0 when there is none)
+//   index   varint per row: its length << 1, | 1 if it ends in "\r\n"
+//   states  varint hash of the syntax name, varint frontier, the state after
+//           it, varint count, then per listed row varint distance from the
+//           previous one and its state, u32 FNV-1a of the section
+// A state is a varint kind; a raw string's is followed by its terminator,
+// varint length and bytes, since the ids are only known to one process.
+const char CACHE_MAGIC[] = "LUMECCH1";
+const size_t CACHE_HEADER = 96;
+const size_t CACHE_SAMPLE = 4096;
+const size_t CACHE_BATCH = 1 << 16; // rows published to the loader at a time
+
+
+// Sidecar of a file: ~/.cache/lume/<hash of the real path>, or "" when there is no cache directory
+std::string cachePath(const std::string &filename, bool create) {
+    std::string dir;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) dir = xdg;
+    else if (home && *home) dir = std::string(home) + "/.cache";
+    else return "";
+    char *real = realpath(filename.c_str(), nullptr);
+    if (!real) return "";
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)fnv1a64(real, strlen(real)));
+    free(real);
+
+    if (create) mkdir(dir.c_str(), 0700);
+    dir += "/lume";
+    if (create) mkdir(dir.c_str(), 0700);
+    return dir + "/" + name;
+}
+
+
+// Tells the contents of a file apart cheaply: stat fields plus a hash of its
+// first, middle and last CACHE_SAMPLE bytes
+std::array<uint64_t, 5> cacheStamp(int fd, const struct stat &st) {
+    size_t size = st.st_size;
+    size_t at[3] = {0, size / 2, size > CACHE_SAMPLE ? size - CACHE_SAMPLE : 0};
+    uint64_t h = fnv1a64(nullptr, 0);
+    char block[CACHE_SAMPLE];
+    for (size_t a : at) {
+        ssize_t n = pread(fd, block, sizeof(block), a);
+        if (n > 0) h = fnv1a64(block, n, h);
+    }
+    return {(uint64_t)size, (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec, (uint64_t)st.st_ino, h};
+}
+
+
+bool cacheWrite(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+
+// Like cacheWrite, at offset at
+bool cacheWriteAt(int fd, const char *data, size_t size, off_t at) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, data + done, size - done, at + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+
+void putState(std::string &out, uint32_t state) {
+    putVarint(out, state & 3);
+    if ((state & 3) == HL_RAW_STRING) {
+        const std::string &end = rawStringEnd(state);
+        putVarint(out, end.size());
+        out += end;
+    }
+}
+
+
+bool getState(std::string_view in, size_t &pos, uint32_t &state) {
+    uint64_t kind, len;
+    if (!getVarint(in, pos, kind) || kind > HL_RAW_STRING) return false;
+    state = kind;
+    if (kind != HL_RAW_STRING) return true;
+    if (!getVarint(in, pos, len) || len > in.size() - pos) return false;
+    state = rawStringState(std::string(in.substr(pos, len)));
+    pos += len;
+    return true;
+}
+
+
+// Background thread: like indexLines, but the rows come from the index in the
+// sidecar. It is checked first to cover the file exactly; if it does not,
+// the sidecar is deleted and the file scanned after all.
+void indexFromCache(LineLoader *L, MappedFile m, size_t pos, size_t skip, std::string path, size_t rows, size_t bytes) {
+    std::string index(bytes, '\0');
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    size_t got = 0;
+    while (fd != -1 && got < bytes) {
+        ssize_t n = pread(fd, &index[got], bytes - got, CACHE_HEADER + got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    if (fd != -1) close(fd);
+
+    bool ok = got == bytes;
+    size_t at = 0, end = 0, n = 0, start = 0;
+    uint64_t v;
+    while (ok && at < bytes) {
+        ok = getVarint(index, at, v) && (v >> 1) <= m.size;
+        end += (v >> 1) + (v & 1) + 1;
+        if (++n == skip) start = end;
+    }
+    if (!ok || n != rows || n < skip || start != pos || (end != m.size && end != m.size + 1)) {
+        unlink(path.c_str());
+        indexLines(L, m, pos);
+        return;
+    }
+
+    std::vector<std::pair<size_t, size_t>> batch;
+    at = 0;
+    start = 0;
+    for (size_t r = 0; r < rows && !L->stop; r++) {
+        getVarint(index, at, v);
+        if (r >= skip) batch.emplace_back(start, v >> 1);
+        start += (v >> 1) + (v & 1) + 1;
+        if (batch.size() == CACHE_BATCH || r + 1 == rows) {
+            std::lock_guard<std::mutex> guard(L->lock);
+            L->ready.insert(L->ready.end(), batch.begin(), batch.end());
+            L->scanned = std::min(start, m.size);
+            batch.clear();
+        }
+    }
+    L->done = true;
+}
+
+
+// The states section: the lexer state at the start of each row before the
+// highlight frontier, only listing the rows that do not start in HL_NORMAL
+std::string cacheStates(EditorState &E) {
+    std::string rows;
+    size_t front = E.syntax ? std::min(E.buf.hlFrontier, E.buf.lineCount()) : 0;
+    size_t r = 0, prev = 0, count = 0;
+    uint32_t last = HL_NORMAL;
+    for (TextBuffer::Block &blk : E.buf.blocks) {
+        for (Line &l : blk.lines) {
+            if (r == front) break;
+            if (l.hlIn != HL_NORMAL) {
+                putVarint(rows, r - prev);
+                putState(rows, l.hlIn);
+                prev = r;
+                count++;
+            }
+            last = l.hlOut;
+            r++;
+        }
+        if (r == front) break;
+    }
+    if (last == HL_UNKNOWN || (last & 3) == HL_OPEN) {
+        front = count = 0;
+        last = HL_NORMAL;
+        rows.clear();
+    }
+
+    std::string out;
+    putVarint(out, E.syntax ? fnv1a(E.syntax->name, strlen(E.syntax->name)) : 0);
+    putVarint(out, front);
+    putState(out, last);
+    putVarint(out, count);
+    out += rows;
+    uint32_t sum = fnv1a(out.data(), out.size());
+    for (int i = 0; i < 4; i++) out += (char)(sum >> (8 * i));
+    return out;
+}
+
+
+void cacheReadStates(EditorState &E, const std::string &data) {
+    if (data.size() < 4 || !E.syntax) return;
+    size_t n = data.size() - 4;
+    uint32_t sum = 0;
+    for (int i = 0; i < 4; i++) sum |= (uint32_t)(unsigned char)data[n + i] << (8 * i);
+    if (fnv1a(data.data(), n) != sum) return;
+
+    std::string_view in(data.data(), n);
+    size_t pos = 0;
+    uint64_t syn, front, count, delta;
+    uint32_t last, state;
+    if (!getVarint(in, pos, syn) || syn != fnv1a(E.syntax->name, strlen(E.syntax->name))) return;
+    if (!getVarint(in, pos, front) || !getState(in, pos, last) || !getVarint(in, pos, count)) return;
+    std::vector<std::pair<size_t, uint32_t>> states;
+    size_t row = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (!getVarint(in, pos, delta) || !getState(in, pos, state) || delta >= front - row) return;
+        row += delta;
+        states.emplace_back(row, state);
+    }
+    E.cache.hlFrontier = front;
+    E.cache.hlLast = last;
+    E.cache.hlStates.swap(states);
+}
+
+
+// Reads the sidecar of a file openFile just mapped; one written for other
+// contents is deleted
+void cacheOpen(EditorState &E, int fd, const struct stat &st) {
+    ReopenCache &C = E.cache;
+    C.stamp = cacheStamp(fd, st);
+    C.path = cachePath(E.filename, false);
+    if (C.path.empty()) return;
+    int cfd = open(C.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (cfd == -1) return;
+
+    char head[CACHE_HEADER];
+    bool ok = pread(cfd, head, CACHE_HEADER, 0) == (ssize_t)CACHE_HEADER && memcmp(head, CACHE_MAGIC, 8) == 0;
+    for (int i = 0; ok && i < 5; i++) ok = getU64(head + 8 + 8 * i) == C.stamp[i];
+    if (!ok) {
+        close(cfd);
+        unlink(C.path.c_str());
+        return;
+    }
+    int *view[4] = {&C.cx, &C.cy, &C.rowOffset, &C.colOffset};
+    for (int i = 0; i < 4; i++) *view[i] = (int)std::min<uint64_t>(getU64(head + 48 + 8 * i), INT_MAX);
+    C.pending = true;
+
+    uint64_t rows = getU64(head + 80), bytes = getU64(head + 88);
+    struct stat cst;
+    if (rows > 0 && fstat(cfd, &cst) == 0 && bytes <= (uint64_t)cst.st_size - CACHE_HEADER) {
+        C.indexRows = rows;
+        C.indexBytes = bytes;
+        std::string states(cst.st_size - CACHE_HEADER - bytes, '\0');
+        if (pread(cfd, &states[0], states.size(), CACHE_HEADER + bytes) == (ssize_t)states.size()) {
+            cacheReadStates(E, states);
+        }
+    }
+    close(cfd);
+}
+
+
+// Puts the cursor back where the last session left it, and gives the rows
+// before the old highlight frontier their lexer states, so the screen is
+// coloured without lexing from the top. Runs right after openFile.
+void cacheRestore(EditorState &E) {
+    ReopenCache &C = E.cache;
+    if (!C.pending) return;
+    C.pending = false;
+    waitForRows(E, std::max((size_t)C.cy + 1, (size_t)C.rowOffset + E.screenRows));
+    size_t rows = E.buf.lineCount();
+    if (rows == 0) return;
+
+    // Rows further down are not loaded yet; they are lexed when needed
+    size_t front = std::min(C.hlFrontier, rows);
+    if (E.syntax && front > E.buf.hlFrontier) {
+        size_t r = 0, k = 0;
+        Line *prev = nullptr;
+        for (TextBuffer::Block &blk : E.buf.blocks) {
+            if (r == front) break;
+            size_t first = r;
+            for (Line &l : blk.lines) {
+                if (r == front) break;
+                bool listed = k < C.hlStates.size() && C.hlStates[k].first == r;
+                l.hlIn = listed ? C.hlStates[k++].second : HL_NORMAL;
+                if (prev) prev->hlOut = l.hlIn;
+                prev = &l;
+                r++;
+            }
+            if (first + blk.lines.size() <= front) blk.hlStale = false;
+        }
+        // The state after the last restored row is the one the next row starts in
+        if (front == C.hlFrontier) prev->hlOut = C.hlLast;
+        else prev->hlOut = k < C.hlStates.size() && C.hlStates[k].first == front ? C.hlStates[k].second : HL_NORMAL;
+        E.buf.hlFrontier = front;
+    }
+    std::vector<std::pair<size_t, uint32_t>>().swap(C.hlStates);
+
+    E.cy = std::min(C.cy, (int)rows - 1);
+    E.cx = std::min(C.cx, (int)E.buf.lineLength(E.cy));
+    E.rowOffset = std::min(C.rowOffset, E.cy);
+    E.colOffset = C.colOffset;
+}
+
+
+// Streams the row index of the buffer to fd. The buffer must still be the
+// mapped file; whether a row ended in "\r\n" is told from where the next one
+// starts in the mapping, so the file's pages are not read again.
+bool cacheWriteIndex(EditorState &E, int fd, uint64_t &rows, uint64_t &bytes) {
+    const char *base = E.map.data;
+    size_t size = E.map.size;
+    std::string out;
+    size_t start = 0, len = 0;
+    rows = bytes = 0;
+
+    auto put = [&](size_t next) {
+        size_t end = start + len;
+        if (next != end + 1 && next != end + 2) return false;
+        putVarint(out, len << 1 | (next - end - 1));
+        start = next;
+        if (out.size() < (1 << 20)) return true;
+        bytes += out.size();
+        bool ok = cacheWrite(fd, out);
+        out.clear();
+        return ok;
+    };
+    for (TextBuffer::Block &blk : E.buf.blocks) {
+        for (Line &l : blk.lines) {
+            if (rows > 0) {
+                size_t end = start + len;
+                bool mapped = l.mapped() && l.data >= base && l.data <= base + size;
+                size_t next = mapped ? l.data - base : end + (end < size && base[end] == '\r') + 1;
+                if (!put(next)) return false;
+            }
+            len = l.size();
+            rows++;
+        }
+    }
+    // The last row ends the file, with or without a line break
+    size_t end = start + len;
+    size_t next = end + (end < size && base[end] == '\r') + 1;
+    if (rows == 0 || (next != size && next != size + 1) || !put(next)) return false;
+    bytes += out.size();
+    return cacheWrite(fd, out);
+}
+
+
+// Called on a clean quit. The view is always recorded; the index and lexer
+// states only while the buffer is still exactly the file on disk. A sidecar
+// that already holds the index for it is updated in place.
+void cacheSave(EditorState &E) {
+    if (!E.config.reopenCache || E.pager.active || E.filename.empty()) return;
+    int fd = open(E.filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+    std::array<uint64_t, 5> stamp{};
+    if (regular) stamp = cacheStamp(fd, st);
+    close(fd);
+    std::string path = regular ? cachePath(E.filename, true) : "";
+    if (path.empty()) return;
+
+    std::string head(CACHE_MAGIC, 8);
+    for (uint64_t v : stamp) putU64(head, v);
+    for (int v : {E.cx, E.cy, E.rowOffset, E.colOffset}) putU64(head, std::max(v, 0));
+    bool whole = E.changeId == 0 && E.map.data && !E.map.copied && !E.loader.active && !E.follow.active &&
+                 E.map.size >= CACHE_INDEX_MIN && stamp == E.cache.stamp;
+
+    int cfd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (cfd != -1) {
+        char old[CACHE_HEADER];
+        if (pread(cfd, old, CACHE_HEADER, 0) == (ssize_t)CACHE_HEADER && memcmp(old, head.data(), 48) == 0 &&
+            getU64(old + 80) > 0) {
+            // A sidecar left half updated is worse than none, so any failure removes it
+            bool ok = cacheWriteAt(cfd, head.data() + 48, 32, 48);
+            if (ok && whole && E.buf.hlFrontier > E.cache.hlFrontier) {
+                std::string states = cacheStates(E);
+                off_t at = CACHE_HEADER + getU64(old + 88);
+                ok = ftruncate(cfd, at) == 0 && cacheWriteAt(cfd, states.data(), states.size(), at);
+            }
+            if (close(cfd) != 0 || !ok) unlink(path.c_str());
+            return;
+        }
+        close(cfd);
+    }
+
+    if (!whole && E.cx == 0 && E.cy == 0 && E.rowOffset == 0 && E.colOffset == 0) {
+        unlink(path.c_str()); // nothing worth remembering
+        return;
+    }
+    std::string tmpPath = path + ".lume-tmp";
+    fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return;
+    putU64(head, 0);
+    putU64(head, 0);
+    bool ok = cacheWrite(fd, head);
+    uint64_t rows, bytes;
+    if (ok && whole) {
+        if (cacheWriteIndex(E, fd, rows, bytes)) {
+            std::string counts;
+            putU64(counts, rows);
+            putU64(counts, bytes);
+            ok = cacheWriteAt(fd, counts.data(), 16, 80) && cacheWrite(fd, cacheStates(E));
+        } else {
+            ok = ftruncate(fd, CACHE_HEADER) == 0 && lseek(fd, CACHE_HEADER, SEEK_SET) == (off_t)CACHE_HEADER;
+        }
+    }
+    if (close(fd) != 0) ok = false;
+    if (!ok || std::rename(tmpPath.c_str(), path.c_str()) != 0) unlink(tmpPath.c_str());
+}
+
+
+// [file I/O Logic]
+// Moves rows indexed by the loader into the buffer; true if any were added
+bool pullLoadedLines(EditorState &E) {
+    LineLoader &L = E.loader;
+    if (!L.active) return false;
+
+    bool finished = L.done;
+    std::vector<std::pair<size_t, size_t>> rows;
+    {
+        std::lock_guard<std::mutex> guard(L.lock);
+        rows.swap(L.ready);
+    }
+    for (const auto &r : rows) {
+        E.buf.appendView(E.map.data + r.first, r.second);
+    }
+    if (!rows.empty()) {
+        // Step over the trimmed "\r\n" or "\n" of the last row taken
+        size_t end = rows.back().first + rows.back().second;
+        if (end < E.map.size && E.map.data[end] == '\r') end++;
+        if (end < E.map.size && E.map.data[end] == '\n') end++;
+        L.nextRow = end;
+    }
+
+    // done is set after the last batch is published, so nothing is left behind
+    if (finished) {
+        if (L.worker.joinable()) L.worker.join();
+        L.active = false;
+    }
+    return !rows.empty() || finished;
+}
+
+
+// Blocks until every row of the file is in the buffer
+void finishLoading(EditorState &E) {
+    if (!E.loader.active) return;
+    E.loader.worker.join();
+    pullLoadedLines(E);
+}
+
+
+void closeFile(EditorState &E) {
+    finishSave(E); // its snapshot points into the mapping
+    lexerStop(E);
+    if (E.loader.active) {
+        E.loader.stop = true;
+        E.loader.worker.join();
+        E.loader.active = false;
+    }
+    journalStop(E.journal);
+    E.journal.failed = false;
+    undoClear(E);
+    pagerClose(E);
+    E.buf.clear();
+    if (E.map.copied) delete[] E.map.data;
+    else if (E.map.data) munmap((void *)E.map.data, E.map.size);
+    if (E.map.fd != -1) close(E.map.fd);
+    E.map = MappedFile();
+}
+
+
+// Also when closeFile was never called, nothing may outlive the state
+EditorState::~EditorState() {
+    followStop(*this);
+    closeFile(*this);
+    if (history.spill.fd != -1) close(history.spill.fd);
+}
+
+
+// Points the rows that view the mapping at a copy of its first size bytes,
+// read with pread, and unmaps the file: for when it is about to change under
+// them. The loader and the background lexer must not be running. False if
+// the file was already shorter; the missing bytes read as zeros.
+bool copyMapping(EditorState &E, size_t size) {
+    MappedFile &M = E.map;
+    if (!M.data || M.copied) return true;
+    char *copy = new char[std::max<size_t>(size, 1)];
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(M.fd, copy + got, size - got, got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    std::memset(copy + got, 0, size - got);
+
+    for (TextBuffer::Block &blk : E.buf.blocks) {
+        for (Line &l : blk.lines) {
+            if (l.mapped() && l.data >= M.data && l.data <= M.data + M.size) l.data = copy + (l.data - M.data);
+        }
+    }
+    munmap((void *)M.data, M.size);
+    M.data = copy;
+    M.size = size;
+    M.copied = true;
+    return got == size;
+}
+
+
+void openFile(EditorState &E, const std::string &filename) {
+    closeFile(E);
+    E.filename = filename;
+    E.follow.offset = 0;
+    E.cache = ReopenCache();
+    E.syntax = selectSyntax(filename);
+    // A followed file is never mapped: followPoll reads all of it with pread
+    if (E.follow.active) return;
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        // File doesn't exist yet: treat as empty buffer
+        return;
+    }
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (p != MAP_FAILED && E.config.reopenCache) cacheOpen(E, fd, st);
+
+    if (p != MAP_FAILED) {
+        E.map.data = (const char *)p;
+        E.map.size = st.st_size;
+        E.map.fd = fd;
+        E.follow.offset = E.map.size;
+
+        // Index the first screen right away, the rest on the loader thread
+        size_t pos = 0;
+        while (pos < E.map.size && (int)E.buf.lineCount() <= E.screenRows) {
+            size_t len;
+            size_t next = scanLine(E.map, pos, len);
+            E.buf.appendView(E.map.data + pos, len);
+            pos = next;
+        }
+        if (pos < E.map.size) {
+            LineLoader &L = E.loader;
+            L.done = false;
+            L.stop = false;
+            L.scanned = pos;
+            L.nextRow = pos;
+            L.active = true;
+            if (E.cache.indexRows > 0) {
+                L.worker = std::thread(indexFromCache, &L, E.map, pos, E.buf.lineCount(), E.cache.path,
+                                       E.cache.indexRows, E.cache.indexBytes);
+            } else {
+                L.worker = std::thread(indexLines, &L, E.map, pos);
+            }
+        }
+        return;
+    }
+
+    close(fd);
+
+    // Pipes and other special files are read the old way
+    std::ifstream in(filename);
+    if (!in) return;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        // Remove trailing '\r'
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        E.buf.appendLine(std::move(line));
+    }
+}
+
+
+// Gives the temp file the extended attributes of path (ACLs and security
+// labels among them); false if one of them could not be set
+bool copyXattrs(const std::string &path, int fd) {
+    ssize_t n = listxattr(path.c_str(), nullptr, 0);
+    if (n <= 0) return n == 0 || errno == ENOTSUP;
+    std::string names(n, '\0');
+    n = listxattr(path.c_str(), &names[0], names.size());
+    if (n < 0) return false;
+    for (size_t i = 0; i < (size_t)n; i += std::strlen(&names[i]) + 1) {
+        const char *name = &names[i];
+        ssize_t len = getxattr(path.c_str(), name, nullptr, 0);
+        if (len < 0) return false;
+        std::string value(len, '\0');
+        if (getxattr(path.c_str(), name, &value[0], value.size()) != len ||
+            fsetxattr(fd, name, value.data(), value.size(), 0) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Creates the temp file a save is written to, next to path so the rename
+// stays on one file system, with the owner, group, mode and attributes of
+// the original. Returns its name, or "" when the file must be rewritten in
+// place: it has other hard links, or the temp file cannot be made like it.
+std::string saveTempFile(const std::string &path, int &fd) {
+    struct stat st;
+    bool exists = stat(path.c_str(), &st) == 0;
+    fd = -1;
+    if (exists && st.st_nlink > 1) return "";
+    std::string tmpPath = path + ".lume-XXXXXX";
+    fd = mkostemp(&tmpPath[0], O_CLOEXEC);
+    if (fd == -1) return "";
+    // chown clears the set-id bits, so the mode goes on after it
+    bool same = exists ? fchown(fd, st.st_uid, st.st_gid) == 0 && fchmod(fd, st.st_mode & 07777) == 0 &&
+                         copyXattrs(path, fd)
+                       : fchmod(fd, 0644) == 0;
+    if (!same) {
+        close(fd);
+        unlink(tmpPath.c_str());
+        fd = -1;
+        return "";
+    }
+    return tmpPath;
+}
+
+
+// Writer thread: everything here works on the snapshot only
+void writeSnapshot(SaveJob *J) {
+    bool inPlace = J->tmpPath.empty();
+    const char *step = "open";
+
+    int fd = inPlace ? open(J->path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644) : J->fd;
+    if (fd != -1) {
+        step = "write";
+        size_t i = 0;
+        while (i < J->spans.size()) {
+            int cnt = (int)std::min<size_t>(IOV_MAX, J->spans.size() - i);
+            ssize_t n = writev(fd, &J->spans[i], cnt);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            J->written += n;
+            // Drop the spans that are fully written, trim a partial one
+            while (i < J->spans.size() && (size_t)n >= J->spans[i].iov_len) {
+                n -= J->spans[i].iov_len;
+                i++;
+            }
+            if (n > 0) {
+                J->spans[i].iov_base = (char *)J->spans[i].iov_base + n;
+                J->spans[i].iov_len -= n;
+            }
+        }
+        if (i == J->spans.size()) {
+            // Written over the old bytes from the start, so cut off what is left of them
+            step = "truncate";
+            if (!inPlace || ftruncate(fd, J->total) == 0) {
+                step = "fsync";
+                if (fsync(fd) == 0) step = nullptr;
+            }
+        }
+        if (close(fd) != 0 && !step) step = "close";
+    }
+
+    if (!step && !inPlace) {
+        step = "rename";
+        if (std::rename(J->tmpPath.c_str(), J->path.c_str()) == 0) {
+            step = nullptr;
+            // Make the rename itself durable
+            std::string dir = J->path.substr(0, J->path.find_last_of('/') + 1);
+            int dfd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_CLOEXEC);
+            if (dfd != -1) {
+                fsync(dfd);
+                close(dfd);
+            }
+        }
+    }
+
+    if (step) {
+        J->error = std::string(step) + ": " + std::strerror(errno);
+        if (!inPlace) unlink(J->tmpPath.c_str());
+    }
+    J->done = true;
+}
+
+
+void saveFile(EditorState &E) {
+    if (E.filename.empty()) return;
+    SaveJob &J = E.save;
+    if (J.active) {
+        setStatusMessage(E, "Save already in progress");
+        return;
+    }
+
+    // Save through symlinks instead of replacing them
+    char *real = realpath(E.filename.c_str(), nullptr);
+    J.path = real ? real : E.filename;
+    std::free(real);
+    J.tmpPath = saveTempFile(J.path, J.fd);
+    if (J.tmpPath.empty() && E.map.data && !E.map.copied) {
+        // Rewriting the file in place would change the mapped rows under
+        // the buffer, so they move to a copy first
+        finishLoading(E);
+        lexerStop(E);
+        copyMapping(E, E.map.size);
+    }
+
+    // Edited rows are copied into the arena, which must not reallocate
+    // once spans point into it
+    size_t ownedBytes = 0;
+    E.buf.forEachLine([&](size_t, std::string_view row) {
+        if (row.data() < E.map.data || row.data() >= E.map.data + E.map.size) {
+            ownedBytes += row.size();
+        }
+    });
+    J.arena.clear();
+    J.arena.reserve(ownedBytes);
+    J.spans.clear();
+
+    static const char newline = '\n';
+    auto addSpan = [&](const char *p, size_t n) {
+        if (n == 0) return;
+        if (!J.spans.empty() && (const char *)J.spans.back().iov_base + J.spans.back().iov_len == p) {
+            J.spans.back().iov_len += n; // neighbouring rows of the mapping become one span
+        } else {
+            J.spans.push_back(iovec{(void *)p, n});
+        }
+    };
+
+    size_t total = E.buf.lineCount();
+    E.buf.forEachLine([&](size_t i, std::string_view row) {
+        bool mapped = row.data() >= E.map.data && row.data() < E.map.data + E.map.size;
+        if (mapped) {
+            addSpan(row.data(), row.size());
+        } else {
+            size_t at = J.arena.size();
+            J.arena.append(row);
+            addSpan(J.arena.data() + at, row.size());
+        }
+        if (i + 1 < total || E.loader.active) {
+            // Reuse the mapping's own line break so unedited rows stay contiguous
+            const char *after = row.data() + row.size();
+            if (mapped && after < E.map.data + E.map.size && *after == '\n') addSpan(after, 1);
+            else addSpan(&newline, 1);
+        }
+    });
+    if (E.loader.active) {
+        // Rows the loader has not handed over yet are saved straight from the mapping
+        addSpan(E.map.data + E.loader.nextRow, E.map.size - E.loader.nextRow);
+    }
+
+    J.total = 0;
+    for (const iovec &v : J.spans) J.total += v.iov_len;
+    J.written = 0;
+    J.done = false;
+    J.error.clear();
+    J.changeId = E.changeId;
+    J.active = true;
+    J.worker = std::thread(writeSnapshot, &J);
+    E.journal.saving = true;
+    E.journal.sinceSave.clear();
+}
+
+
+// Picks up a finished save; true if one completed
+bool pollSave(EditorState &E) {
+    SaveJob &J = E.save;
+    if (!J.active || !J.done) return false;
+
+    if (J.worker.joinable()) J.worker.join();
+    J.active = false;
+    if (J.error.empty()) {
+        // Only clean if nothing was typed while the snapshot was written
+        if (E.changeId == J.changeId) E.dirty = false;
+        setStatusMessage(E, "Wrote " + std::to_string(J.total) + " bytes");
+        // The file was replaced; keep following the new one
+        if (E.follow.active) followWatch(E, J.total);
+        else E.follow.offset = J.total;
+    } else {
+        setStatusMessage(E, "Save failed (" + J.error + ")");
+    }
+    journalSaved(E, J.error.empty(), E.changeId != J.changeId);
+    J.spans.clear();
+    J.arena.clear();
+    J.arena.shrink_to_fit();
+    return true;
+}
+
+
+void finishSave(EditorState &E) {
+    if (!E.save.active) return;
+    E.save.worker.join();
+    pollSave(E);
+}
+
+
+// [Soft wrap]
+// A row wider than the text area goes on over the next screen lines, broken
+// after the last blank that fits, or at the edge when a word is longer than
+// a screen line. The breaks are kept in the row's ColumnIndex, so they are
+// only found again once the row changes or the width does. Rows kept in
+// chunks break at the edge instead, which the chunk column checkpoints give
+// without walking the row. The top of the screen is a row and a screen line
+// in it (rowOffset, wrapOffset): scrolling and paging only look at the rows
+// they pass, never at the ones above.
+int wrapWidth(const EditorState &E) {
+    return std::max(1, E.screenCols - lineNumberWidth(E));
+}
+
+
+// Breaks of a row not kept in chunks; nullptr if it fits on one screen line.
+// Blanks may hang past the edge, so a screen line never starts with one.
+const ColumnIndex *wrapIndex(EditorState &E, Line &l) {
+    int width = wrapWidth(E), tabSize = E.config.tabSize;
+    std::string_view t = l.text();
+    if (t.size() <= (size_t)width && !std::memchr(t.data(), '\t', t.size())) return nullptr;
+    if (l.cols && l.cols->wrapWidth == width && l.cols->wrapTabSize == tabSize) return l.cols.get();
+
+    if (!l.cols) {
+        l.cols.reset(new ColumnIndex());
+        E.buf.hlSpanCount++;
+    }
+    ColumnIndex &ci = *l.cols;
+    ci.wrapWidth = width;
+    ci.wrapTabSize = tabSize;
+    ci.wraps.clear();
+    size_t i = 0, start = 0, blank = 0; // blank: just past the last blank, if after start
+    int col = 0, startCol = 0, blankCol = 0;
+    while (i < t.size()) {
+        size_t next;
+        int w = cellWidth(t, i, col, tabSize, next);
+        bool isBlank = t[i] == ' ' || t[i] == '\t';
+        if (col + w - startCol > width && i > start && !isBlank) {
+            if (blank > start) {
+                start = blank;
+                startCol = blankCol;
+            } else {
+                start = i;
+                startCol = col;
+            }
+            ci.wraps.push_back({(uint32_t)start, (uint32_t)startCol});
+            continue; // the character goes on the new line
+        }
+        if (isBlank) {
+            blank = next;
+            blankCol = col + w;
+        }
+        col += w;
+        i = next;
+    }
+    return &ci;
+}
+
+
+// Screen lines row takes
+int wrapCount(EditorState &E, int row) {
+    if (row < 0 || row >= (int)E.buf.lineCount()) return 1;
+    Line &l = E.buf.lineRef(row);
+    if (longLine(l)) {
+        int width = wrapWidth(E);
+        int cols = displayColumn(E.buf, row, l.size(), E.config.tabSize);
+        return std::max(1, (cols + width - 1) / width);
+    }
+    const ColumnIndex *ci = wrapIndex(E, l);
+    return ci ? (int)ci->wraps.size() + 1 : 1;
+}
+
+
+// Screen line k of row
+WrapLine wrapLine(EditorState &E, int row, int k) {
+    WrapLine w;
+    if (row < 0 || row >= (int)E.buf.lineCount()) return w;
+    Line &l = E.buf.lineRef(row);
+    w.end = l.size();
+    k = std::max(0, std::min(k, wrapCount(E, row) - 1));
+    if (longLine(l)) {
+        int width = wrapWidth(E), startCol;
+        w.col = k * width;
+        w.start = byteAtColumn(E.buf, row, w.col, E.config.tabSize, startCol);
+        if (k + 1 < wrapCount(E, row)) w.end = byteAtColumn(E.buf, row, w.col + width, E.config.tabSize, startCol);
+        return w;
+    }
+    const ColumnIndex *ci = wrapIndex(E, l);
+    if (!ci) return w;
+    if (k > 0) {
+        w.start = ci->wraps[k - 1].first;
+        w.col = ci->wraps[k - 1].second;
+    }
+    if (k < (int)ci->wraps.size()) w.end = ci->wraps[k].first;
+    return w;
+}
+
+
+// Screen line of row that byte is on
+int wrapLineOf(EditorState &E, int row, size_t byte) {
+    if (row < 0 || row >= (int)E.buf.lineCount()) return 0;
+    Line &l = E.buf.lineRef(row);
+    if (longLine(l)) {
+        int k = displayColumn(E.buf, row, byte, E.config.tabSize) / wrapWidth(E);
+        return std::min(k, wrapCount(E, row) - 1);
+    }
+    const ColumnIndex *ci = wrapIndex(E, l);
+    if (!ci) return 0;
+    auto it = std::upper_bound(ci->wraps.begin(), ci->wraps.end(), byte,
+                               [](size_t b, const std::pair<uint32_t, uint32_t> &w) { return b < w.first; });
+    return (int)(it - ci->wraps.begin());
+}
+
+
+// Moves (row, k) n screen lines down, or up for n < 0, stopping at the first
+// and last line of the file; returns how many it moved
+int wrapStep(EditorState &E, int &row, int &k, int n) {
+    int moved = 0;
+    int rows = (int)E.buf.lineCount();
+    for (; n > 0; n--, moved++) {
+        if (k + 1 < wrapCount(E, row)) {
+            k++;
+        } else if (row + 1 < rows) {
+            row++;
+            k = 0;
+        } else {
+            break;
+        }
+    }
+    for (; n < 0; n++, moved++) {
+        if (k > 0) {
+            k--;
+        } else if (row > 0) {
+            row--;
+            k = wrapCount(E, row) - 1;
+        } else {
+            break;
+        }
+    }
+    return moved;
+}
+
+
+// Moves the cursor n screen lines down, or up for n < 0, keeping its place on the line
+void wrapMove(EditorState &E, int n) {
+    if (E.cy >= (int)E.buf.lineCount()) return;
+    int tabSize = E.config.tabSize;
+    int row = E.cy, k = wrapLineOf(E, row, E.cx);
+    int x = displayColumn(E.buf, row, E.cx, tabSize) - wrapLine(E, row, k).col;
+    wrapStep(E, row, k, n);
+    WrapLine to = wrapLine(E, row, k);
+    int startCol;
+    size_t at = std::max(to.start, byteAtColumn(E.buf, row, to.col + x, tabSize, startCol));
+    // The end of a line that breaks is the start of the next one
+    if (at >= to.end && to.end < E.buf.lineLength(row)) at = prevCharIn(E.buf, row, to.end);
+    E.cy = row;
+    E.cx = (int)at;
+}
+
+
+// editorScroll with soft wrap: moves the top line only as far as it takes to
+// show the cursor, walking at most a screenful of lines back from it
+void wrapScroll(EditorState &E) {
+    E.colOffset = 0;
+    E.wrapOffset = std::max(0, std::min(E.wrapOffset, wrapCount(E, E.rowOffset) - 1));
+    int row = E.cy, k = wrapLineOf(E, E.cy, E.cx);
+    if (row < E.rowOffset || (row == E.rowOffset && k < E.wrapOffset)) {
+        E.rowOffset = row;
+        E.wrapOffset = k;
+        return;
+    }
+    for (int n = 1; n < E.screenRows; n++) {
+        if (row == E.rowOffset && k == E.wrapOffset) return;
+        if (wrapStep(E, row, k, -1) == 0) break;
+    }
+    E.rowOffset = row;
+    E.wrapOffset = k;
+}
+
+
+void wrapToggle(EditorState &E) {
+    E.config.softWrap = !E.config.softWrap;
+    E.wrapOffset = 0;
+    E.colOffset = 0;
+    setStatusMessage(E, E.config.softWrap ? "Soft wrap on" : "Soft wrap off");
+}
+
+
+// [Editor Layout and Logic]
+void editorScroll(EditorState &E) {
+    if (E.config.softWrap) {
+        wrapScroll(E);
+        return;
+    }
+    if (E.cy < E.rowOffset) {
+        E.rowOffset = E.cy;
+    }
+    if (E.cy >= E.rowOffset + E.screenRows) {
+        E.rowOffset = E.cy - E.screenRows + 1;
+    }
+
+    // colOffset counts display columns, like what is left of the line numbers
+    int textCols = std::max(1, E.screenCols - lineNumberWidth(E));
+    int x = computeScreenX(E);
+    if (x < E.colOffset) {
+        E.colOffset = x;
+    }
+    if (x >= E.colOffset + textCols) {
+        E.colOffset = x - textCols + 1;
+    }
+}
+
+
+
+// --insert and delete--
+void insertChar(EditorState &E, char c) {
+    if (E.cy < 0 || E.cy > (int)E.buf.lineCount()) return;
+
+    int rowLen = E.cy < (int)E.buf.lineCount() ? (int)E.buf.lineLength(E.cy) : 0;
+    if (E.cx < 0) E.cx = 0;
+    if (E.cx > rowLen) E.cx = rowLen;
+    editInsert(E, std::string(1, c), true);
+}
+
+
+void insertNewline(EditorState &E) {
+    if (E.cy < 0 || E.cy > (int)E.buf.lineCount()) return;
+
+    int rowLen = E.cy < (int)E.buf.lineCount() ? (int)E.buf.lineLength(E.cy) : 0;
+    if (E.cx < 0) E.cx = 0;
+    if (E.cx > rowLen) E.cx = rowLen;
+    editInsert(E, "\n", false);
+}
+
+
+void deleteChar(EditorState &E) {
+    if (E.cy < 0 || E.cy >= (int)E.buf.lineCount()) return;
+    if (E.cx < 0) E.cx = 0;
+    if (E.cx > (int)E.buf.lineLength(E.cy)) E.cx = E.buf.lineLength(E.cy);
+    if (E.cx == 0 && E.cy == 0) return;
+
+    if (E.cx > 0) {
+        int start = (int)prevCharIn(E.buf, E.cy, E.cx);
+        editErase(E, E.cy, start, E.cx - start, true);
+    } else {
+        // merge with previous line
+        int prevLen = E.buf.lineLength(E.cy - 1);
+        editErase(E, E.cy - 1, prevLen, 1, false);
+    }
+}
+
+// --Cursor--
+// The cursor moved from row fromRow to E.cy: keep its display column, landing
+// on a character start, and keep it inside the row
+void keepColumn(EditorState &E, int fromRow) {
+    if (E.cy != fromRow && fromRow < (int)E.buf.lineCount() && E.cy < (int)E.buf.lineCount()) {
+        int col = displayColumn(E.buf, fromRow, E.cx, E.config.tabSize);
+        int startCol;
+        E.cx = (int)byteAtColumn(E.buf, E.cy, col, E.config.tabSize, startCol);
+    }
+
+    // clamp cx to row length
+    if (E.cy < (int)E.buf.lineCount()) {
+        int rowLen = E.buf.lineLength(E.cy);
+        if (E.cx > rowLen) E.cx = rowLen;
+    } else {
+        E.cx = 0;
+    }
+}
+
+
+void moveCursor(EditorState &E, Action action) {
+    if (E.config.softWrap && (action == Action::MOVE_UP || action == Action::MOVE_DOWN)) {
+        wrapMove(E, action == Action::MOVE_UP ? -1 : 1);
+        return;
+    }
+    int fromRow = E.cy;
+    switch (action) {
+        case Action::MOVE_UP:
+            if (E.cy > 0) E.cy--;
+            break;
+
+        case Action::MOVE_DOWN:
+            if (E.cy + 1 < (int)E.buf.lineCount()) {
+                E.cy++;
+            }
+            break;
+
+        case Action::MOVE_LEFT:
+            if (E.cx > 0) {
+                E.cx = (int)prevCharIn(E.buf, E.cy, E.cx);
+            } else if (E.cy > 0) {
+                E.cy--;
+                E.cx = E.buf.lineLength(E.cy);
+            }
+            break;
+
+        case Action::MOVE_RIGHT:
+            if (E.cy < (int)E.buf.lineCount()) {
+                int rowLen = (E.cy == (int)E.buf.lineCount()) ? 0 : E.buf.lineLength(E.cy);
+                if (E.cx < rowLen) {
+                    E.cx = (int)nextCharIn(E.buf, E.cy, E.cx);
+                } else if (E.cx == rowLen && E.cy + 1 < (int)E.buf.lineCount()) {
+                    E.cy++;
+                    E.cx = 0;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    // Only up and down keep the display column; left and right already
+    // land on a character start
+    keepColumn(E, action == Action::MOVE_UP || action == Action::MOVE_DOWN ? fromRow : E.cy);
+}
+
+// --Cursor jump to next Word--
+void moveWordRight(EditorState &E) {
+    if (E.cy >= (int)E.buf.lineCount()) return;
+    RowBytes row(E.buf, E.cy);
+
+    int len = E.buf.lineLength(E.cy);
+    int x = E.cx;
+
+    if (x >= len) {
+        if (E.cy + 1 < (int)E.buf.lineCount()) {
+            E.cy++;
+            E.cx = 0;
+        }
+        return;
+    }
+
+    // Skip current word
+    while (x < len && !std::isspace((unsigned char)row[x])) x++;
+
+    // Skip spaces
+    while (x < len && std::isspace((unsigned char)row[x])) x++;
+
+    E.cx = x;
+}
+
+void moveWordLeft(EditorState &E) {
+    if (E.cy >= (int)E.buf.lineCount()) return;
+    RowBytes row(E.buf, E.cy);
+
+    if (E.cx == 0) {
+        if (E.cy > 0) {
+            E.cy--;
+            E.cx = E.buf.lineLength(E.cy);
+        }
+        return;
+    }
+
+    int x = E.cx - 1;
+
+    // Skip spaces
+    while (x > 0 && std::isspace((unsigned char)row[x])) x--;
+
+    // Skip word characters
+    while (x > 0 && !std::isspace((unsigned char)row[x])) x--;
+
+    // If we stopped on a space, move forward one
+    if (std::isspace((unsigned char)row[x]) && x < (int)E.buf.lineLength(E.cy) - 1) x++;
+
+    E.cx = x;
+}
+
+
+// [Search]
+// Substring kernel: compares the first and the last byte of the needle at 32
+// (or 16) positions at once and runs memcmp only where both match.
+size_t findSubstringScalar(const char *p, size_t n, const char *s, size_t k, size_t from) {
+    while (from + k <= n) {
+        const char *q = (const char *)std::memchr(p + from, s[0], n - k + 1 - from);
+        if (!q) break;
+        size_t at = q - p;
+        if (std::memcmp(p + at, s, k) == 0) return at;
+        from = at + 1;
+    }
+    return std::string_view::npos;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+size_t findSubstringAVX2(const char *p, size_t n, const char *s, size_t k) {
+    const __m256i first = _mm256_set1_epi8(s[0]);
+    const __m256i last = _mm256_set1_epi8(s[k - 1]);
+    size_t i = 0;
+    for (; i + k - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + k - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (std::memcmp(p + at + 1, s + 1, k - 2) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringScalar(p, n, s, k, i);
+}
+
+
+__attribute__((target("sse2")))
+size_t findSubstringSSE2(const char *p, size_t n, const char *s, size_t k) {
+    const __m128i first = _mm_set1_epi8(s[0]);
+    const __m128i last = _mm_set1_epi8(s[k - 1]);
+    size_t i = 0;
+    for (; i + k - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + k - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (std::memcmp(p + at + 1, s + 1, k - 2) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    return findSubstringScalar(p, n, s, k, i);
+}
+#endif
+
+
+// Offset of the first occurrence of needle in p[0..n), npos if there is none
+size_t findSubstring(const char *p, size_t n, std::string_view needle) {
+    size_t k = needle.size();
+    if (k == 0 || k > n) return std::string_view::npos;
+    if (k == 1) {
+        const char *q = (const char *)std::memchr(p, needle[0], n);
+        return q ? (size_t)(q - p) : std::string_view::npos;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    static const bool hasSSE2 = __builtin_cpu_supports("sse2");
+    if (hasAVX2) return findSubstringAVX2(p, n, needle.data(), k);
+    if (hasSSE2) return findSubstringSSE2(p, n, needle.data(), k);
+#endif
+    return findSubstringScalar(p, n, needle.data(), k, 0);
+}
+
+
+size_t findLastSubstring(const char *p, size_t n, std::string_view needle) {
+    size_t found = std::string_view::npos;
+    for (size_t at = 0; at < n;) {
+        size_t hit = findSubstring(p + at, n - at, needle);
+        if (hit == std::string_view::npos) break;
+        found = at + hit;
+        at = found + 1;
+    }
+    return found;
+}
+
+
+// Rows i..end that lie back to back in the mapping (separated only by their
+// line break) can be searched as one range; returns the end of that run
+size_t mappedRun(const std::vector<Line> &lines, size_t i, size_t end) {
+    size_t j = i + 1;
+    if (!lines[i].mapped()) return j;
+    for (; j < end && lines[j].mapped(); j++) {
+        const char *prevEnd = lines[j - 1].data + lines[j - 1].len;
+        if (lines[j].data <= prevEnd || lines[j].data > prevEnd + 2) break;
+    }
+    return j;
+}
+
+
+// Row of a run that holds the byte at p
+size_t runRowOf(const std::vector<Line> &lines, size_t i, size_t j, const char *p) {
+    auto it = std::upper_bound(lines.begin() + i, lines.begin() + j, p,
+                               [](const char *q, const Line &l) { return q < l.data; });
+    return (it - lines.begin()) - 1;
+}
+
+
+// Searches rows from..to-1 of a block, starting at column col of the first one
+bool searchLinesForward(const std::vector<Line> &lines, size_t from, size_t to, size_t col,
+                        std::string_view q, size_t &hitRow, size_t &hitCol, size_t &bytes) {
+    for (size_t i = from; i < to;) {
+        if (i == from && col > 0) {
+            std::string_view t = lines[i].text();
+            bytes += t.size();
+            size_t at = col < t.size() ? findSubstring(t.data() + col, t.size() - col, q) : std::string_view::npos;
+            if (at != std::string_view::npos) {
+                hitRow = i;
+                hitCol = col + at;
+                return true;
+            }
+            i++;
+            continue;
+        }
+
+        size_t j = mappedRun(lines, i, to);
+        const char *p = lines[i].text().data();
+        size_t n = lines[i].mapped() ? lines[j - 1].data + lines[j - 1].len - p : lines[i].size();
+        bytes += n;
+        size_t at = findSubstring(p, n, q);
+        if (at != std::string_view::npos) {
+            hitRow = lines[i].mapped() ? runRowOf(lines, i, j, p + at) : i;
+            hitCol = p + at - lines[hitRow].text().data();
+            return true;
+        }
+        i = j;
+    }
+    return false;
+}
+
+
+// Searches rows from down to to of a block for the last match; in the first
+// row it has to start before column col (npos: anywhere)
+bool searchLinesBackward(const std::vector<Line> &lines, size_t from, size_t to, size_t col,
+                         std::string_view q, size_t &hitRow, size_t &hitCol, size_t &bytes) {
+    for (size_t i = from + 1; i-- > to;) {
+        std::string_view t = lines[i].text();
+        size_t n = t.size();
+        if (i == from && col != std::string_view::npos) {
+            n = col == 0 ? 0 : std::min(n, col - 1 + q.size());
+        }
+        bytes += n;
+        size_t at = findLastSubstring(t.data(), n, q);
+        if (at != std::string_view::npos) {
+            hitRow = i;
+            hitCol = at;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Starts looking for the query at (row, col) and runs the first step
+void searchStart(EditorState &E, size_t row, size_t col, int dir) {
+    SearchState &S = E.search;
+    S.dir = dir;
+    S.row = row;
+    S.col = col;
+    S.rowsLeft = E.buf.lineCount() + 1; // the start row again, for matches before col
+    S.pending = !S.query.empty() && !E.buf.empty();
+    S.matchRow = -1;
+    E.screen.full = true;
+    searchStep(E, SEARCH_STEP_BYTES);
+}
+
+
+// Scans up to about budget bytes; the main loop calls it again until the
+// scan finishes, so a huge file never blocks the keyboard. True when done.
+bool searchStep(EditorState &E, size_t budget) {
+    SearchState &S = E.search;
+    size_t bytes = 0;
+    while (S.pending && bytes < budget) {
+        size_t count = E.buf.lineCount();
+        if (S.rowsLeft == 0 || count == 0) {
+            S.pending = false;
+            break;
+        }
+        if (S.row >= count) S.row = S.dir > 0 ? 0 : count - 1;
+
+        size_t off = S.row;
+        size_t b = E.buf.locate(off);
+        const std::vector<Line> &lines = E.buf.blocks[b].lines;
+        size_t hitRow = 0, hitCol = 0;
+        bool hit;
+        size_t n;
+        if (S.dir > 0) {
+            n = std::min(lines.size() - off, S.rowsLeft);
+            hit = searchLinesForward(lines, off, off + n, S.col, S.query, hitRow, hitCol, bytes);
+        } else {
+            n = std::min(off + 1, S.rowsLeft);
+            hit = searchLinesBackward(lines, off, off + 1 - n, S.col, S.query, hitRow, hitCol, bytes);
+        }
+
+        if (hit) {
+            S.pending = false;
+            S.matchRow = (int)(S.row - off + hitRow);
+            S.matchCol = hitCol;
+            E.cy = S.matchRow;
+            E.cx = (int)hitCol;
+            E.screen.full = true;
+            break;
+        }
+        S.rowsLeft -= n;
+        if (S.dir > 0) {
+            S.row += n;
+            S.col = 0;
+        } else {
+            S.row = S.row >= n ? S.row - n : count - 1;
+            S.col = std::string_view::npos;
+        }
+    }
+    return !S.pending;
+}
+
+
+void searchClose(EditorState &E, bool restore) {
+    SearchState &S = E.search;
+    if (restore) {
+        E.cx = S.savedCx;
+        E.cy = S.savedCy;
+        E.rowOffset = S.savedRowOffset;
+        E.colOffset = S.savedColOffset;
+    }
+    if (!S.query.empty()) S.last = S.query;
+    S.active = false;
+    S.pending = false;
+    S.query.clear();
+    S.matchRow = -1;
+    E.screen.full = true;
+}
+
+
+// Keys while the search prompt is open; false if the key closes the prompt
+// and should then be handled as usual
+bool searchKey(EditorState &E, int c) {
+    SearchState &S = E.search;
+    Action act = mapKeyToAction(E, c);
+    bool haveMatch = S.matchRow >= 0;
+    size_t fromRow = haveMatch ? S.matchRow : S.savedCy;
+    size_t fromCol = haveMatch ? S.matchCol : S.savedCx;
+
+    if (c == 27) { // Escape
+        searchClose(E, true);
+    } else if (c == '\r' || c == '\n') {
+        searchClose(E, false);
+    } else if (c == LUME_KEY_BACKSPACE || c == 127 || c == CTRL_KEY('h')) {
+        if (!S.query.empty()) S.query.pop_back();
+        if (S.query.empty()) {
+            S.pending = false;
+            S.matchRow = -1;
+            E.cx = S.savedCx;
+            E.cy = S.savedCy;
+            E.screen.full = true;
+        } else {
+            searchStart(E, S.savedCy, S.savedCx, 1);
+        }
+    } else if (act == Action::SEARCH || c == LUME_KEY_DOWN || c == LUME_KEY_RIGHT) {
+        if (S.query.empty()) S.query = S.last;
+        searchStart(E, fromRow, haveMatch ? fromCol + 1 : fromCol, 1);
+    } else if (c == LUME_KEY_UP || c == LUME_KEY_LEFT) {
+        if (S.query.empty()) S.query = S.last;
+        searchStart(E, fromRow, fromCol, -1);
+    } else if (c >= 32 && c < 127) {
+        // The current match may still match the longer query
+        S.query += (char)c;
+        searchStart(E, fromRow, fromCol, 1);
+    } else {
+        searchClose(E, false);
+        return false;
+    }
+    return true;
+}
+
+
+void searchOpen(EditorState &E) {
+    SearchState &S = E.search;
+    S.active = true;
+    S.query.clear();
+    S.matchRow = -1;
+    S.savedCx = E.cx;
+    S.savedCy = E.cy;
+    S.savedRowOffset = E.rowOffset;
+    S.savedColOffset = E.colOffset;
+}
+
+
+// [Key Process Action]
+// Inserts a whole block of text at the cursor as one edit and one undo step
+void insertText(EditorState &E, const std::string &text) {
+    if (text.empty() || E.pager.active || E.cy < 0 || E.cy > (int)E.buf.lineCount()) return;
+
+    int rowLen = E.cy < (int)E.buf.lineCount() ? (int)E.buf.lineLength(E.cy) : 0;
+    if (E.cx < 0) E.cx = 0;
+    if (E.cx > rowLen) E.cx = rowLen;
+    closeUndoRun(E);
+    editInsert(E, text, false);
+}
+
+
+// Applies one key to the editor: bound actions first, then editing and
+// navigation keys. The front end handles paste and resize before this.
+void editorHandleKey(EditorState &E, int c) {
+    if (pagerKey(E, c)) return;
+    if (E.prompt.kind != PromptKind::NONE) {
+        promptKey(E, c);
+        return;
+    }
+    if (E.search.active && searchKey(E, c)) return;
+
+    // Map to actions if possible
+    Action act = mapKeyToAction(E, c);
+    if (act != Action::NONE) {
+        switch (act) {
+            case Action::QUIT:
+                E.quit = true;
+                return;
+
+            case Action::SAVE:
+                saveFile(E);
+                return;
+
+            case Action::MOVE_UP:
+            case Action::MOVE_DOWN:
+            case Action::MOVE_LEFT:
+            case Action::MOVE_RIGHT:
+                moveCursor(E, act);
+                return;
+
+            case Action::MOVE_WORD_LEFT:
+                moveWordLeft(E);
+                return;
+
+            case Action::MOVE_WORD_RIGHT:
+                moveWordRight(E);
+                return;
+
+            case Action::UNDO:
+                undo(E);
+                return;
+
+            case Action::REDO:
+                redo(E);
+                return;
+
+            case Action::RELOAD_CONFIG:
+                reloadConfig(E);
+                return;
+
+            case Action::PERF_OVERLAY:
+                E.perf.overlay = !E.perf.overlay;
+                return;
+
+            case Action::SEARCH:
+                searchOpen(E);
+                return;
+
+            case Action::REPLACE:
+                promptOpen(E, PromptKind::REPLACE_PATTERN, "Replace regex: ");
+                return;
+
+            case Action::GOTO:
+                promptOpen(E, PromptKind::GOTO, "Go to line or N%: ");
+                return;
+
+            case Action::MATCH_BRACKET:
+                jumpToBracket(E);
+                return;
+
+            case Action::SOFT_WRAP:
+                wrapToggle(E);
+                return;
+
+            case Action::FOLLOW:
+                if (E.pager.active) {
+                    setStatusMessage(E, "No follow mode in --view");
+                } else if (E.follow.active) {
+                    followStop(E);
+                    setStatusMessage(E, "Stopped following " + E.filename);
+                } else {
+                    followStart(E);
+                }
+                return;
+
+            default:
+                break;
+        }
+    }
+
+    switch (c) {
+        case LUME_KEY_HOME:
+            E.cx = 0;
+            break;
+
+        case LUME_KEY_END:
+            if (E.cy < (int)E.buf.lineCount()) {
+                E.cx = E.buf.lineLength(E.cy);
+            }
+            break;
+
+        case LUME_KEY_PPAGE:
+            if (E.config.softWrap) {
+                wrapMove(E, -E.screenRows);
+                break;
+            }
+            {
+                int fromRow = E.cy;
+                E.cy = std::max(0, E.cy - E.screenRows);
+                keepColumn(E, fromRow);
+            }
+            break;
+
+        case LUME_KEY_NPAGE:
+            if (E.config.softWrap) {
+                wrapMove(E, E.screenRows);
+                break;
+            }
+            {
+                int fromRow = E.cy;
+                E.cy += E.screenRows;
+                if (E.cy >= (int)E.buf.lineCount()) {
+                    E.cy = E.buf.empty() ? 0 : (int)E.buf.lineCount() - 1;
+                }
+                keepColumn(E, fromRow);
+            }
+            break;
+
+        case LUME_KEY_BACKSPACE:
+        case 127:
+            deleteChar(E);
+            break;
+        case '\r':
+        case '\n':
+            insertNewline(E);
+            break;
+
+        case '\t':
+            insertChar(E, '\t');
+            return;
+
+        default:
+            // Bytes of UTF-8 sequences arrive one at a time and go in as they are
+            if (std::isprint(c) || (c >= 0x80 && c < 0x100)) {
+                insertChar(E, (char)c);
+            }
+            break;
+    }
+}
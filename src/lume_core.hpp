@@ -0,0 +1,947 @@
+/*
+ * Lume
+ * Copyright (C) 2025 Dogwalker-kryt
+ *
+*/
+
+// Everything the editor does that does not need a terminal: the buffer,
+// highlighting, undo, loading and saving, and key handling. main_Lume.cpp
+// puts it on screen with ncurses, bench_Lume.cpp drives it from a script.
+#ifndef LUME_CORE_HPP
+#define LUME_CORE_HPP
+
+// [Indcludes]
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <cstdio>
+#include <array>
+#include <bitset>
+#include <sys/uio.h>
+
+
+// [Defines]
+#define CTRL_LEFT 554 
+#define CTRL_RIGHT 569
+// Helper: simple CTRL macro
+#ifndef KEY_CTRL
+#define CTRL_KEY(k) ((k) & 0x1f)
+#endif
+
+// Key codes as getch() reports them (curses numbering), so the core can
+// name special keys without including ncurses
+#define LUME_KEY_DOWN 0402
+#define LUME_KEY_UP 0403
+#define LUME_KEY_LEFT 0404
+#define LUME_KEY_RIGHT 0405
+#define LUME_KEY_HOME 0406
+#define LUME_KEY_BACKSPACE 0407
+#define LUME_KEY_F0 0410
+#define LUME_KEY_F(n) (LUME_KEY_F0 + (n))
+#define LUME_KEY_NPAGE 0522
+#define LUME_KEY_PPAGE 0523
+#define LUME_KEY_END 0550
+#define LUME_KEY_MAX 0777
+
+
+// [Actions]
+enum class Action {
+    MOVE_UP,
+    MOVE_DOWN,
+    MOVE_LEFT,
+    MOVE_RIGHT,
+    MOVE_WORD_LEFT,
+    MOVE_WORD_RIGHT,
+    QUIT,
+    SAVE,
+    UNDO,
+    REDO,
+    RELOAD_CONFIG,
+    PERF_OVERLAY,
+    SEARCH,
+    REPLACE,
+    FOLLOW,
+    GOTO,
+    MATCH_BRACKET,
+    SOFT_WRAP,
+    NONE
+};
+
+
+// [config structure]
+const int KEY_TABLE_SIZE = 1024; // covers KEY_MAX and the Ctrl-Arrow codes
+
+struct EditorConfig {
+    int tabSize = 4;
+    bool showLineNumbers = true;
+    bool journal = true; // keep an edit journal next to the file for crash recovery
+    bool reopenCache = true; // remember the row index and cursor of files between sessions
+    size_t undoMemory = 16 << 20; // undo history kept in memory; older steps are compressed to a temp file
+    bool softWrap = false; // rows wider than the screen go on over the next screen lines
+    std::unordered_map<std::string, int> keyMap; // action -> key code
+    std::vector<std::string> userBound;          // actions bound by config.toml
+    std::vector<Action> dispatch;                // key code -> action, see buildDispatchTable
+    std::vector<std::string> warnings;           // problems found while loading
+};
+
+
+// [Text buffer]
+// Checkpoints (byte, display column) about every COL_CHECKPOINT bytes of a
+// long row, so the column of a byte, or the byte at a column, is found by
+// walking at most that far. With soft wrap on, also where the row breaks onto
+// the next screen line. Built on demand, dropped when the row changes.
+const size_t COL_CHECKPOINT = 256;
+const uint32_t UTF8_INVALID = 0xFFFFFFFF; // decodeUtf8 on a byte that starts no valid sequence
+
+struct ColumnIndex {
+    int tabSize = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> marks; // at character starts
+    int wrapWidth = 0;   // text width the breaks were found for, 0 for none yet
+    int wrapTabSize = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> wraps; // (byte, column) starting each screen line after the first
+};
+
+
+struct HlSpan {
+    uint32_t start;
+    uint32_t len;
+    uint8_t color; // COLOR_PAIR index
+};
+
+const uint32_t HL_UNKNOWN = 0xFFFFFFFF;
+
+
+// Rows longer than LONG_LINE are kept as chunks of about LINE_CHUNK bytes, cut
+// after a space or separator byte, so typing deep in a huge row only moves the
+// bytes of one chunk. Each chunk also checkpoints the lexer state and display
+// column it starts at: drawing or editing only lexes and walks nearby chunks.
+const size_t LONG_LINE = 16 * 1024;
+const size_t LINE_CHUNK = 4 * 1024;
+const size_t CHUNK_CUT_REACH = LINE_CHUNK / 2; // how far a cut may move to a safe place
+
+struct LineChunk {
+    std::string text;
+    size_t start = 0;           // byte offset in the row
+    uint32_t hlIn = HL_UNKNOWN;  // lexer state at the start of the chunk
+    uint32_t hlOut = HL_UNKNOWN; // and at its end, HL_UNKNOWN once the text changed
+    uint32_t col = 0;           // display column of the first byte
+    int width = -1;             // cells taken, -1 once the text changed
+    bool tabs = false;          // width depends on where the chunk starts
+};
+
+struct LongLine {
+    std::vector<LineChunk> chunks;
+    size_t len = 0;
+    int tabSize = 0;     // the chunk columns were counted with
+    size_t colValid = 0; // chunks before this have a checked col and width
+    std::string flat;    // the whole row for search and save, until the next edit
+    bool flatValid = false;
+
+    std::string_view text() {
+        if (!flatValid) {
+            flat.clear();
+            flat.reserve(len);
+            for (const LineChunk &c : chunks) flat += c.text;
+            flatValid = true;
+        }
+        return flat;
+    }
+};
+
+
+// A row is a view into the mapped file until it is edited for the first time;
+// only then does it get its own heap string (or chunks, if it is long). It
+// also caches the lexer state it was highlighted with and, once drawn, its
+// token spans.
+struct Line {
+    const char *data = nullptr;
+    size_t len = 0;
+    std::unique_ptr<std::string> owned;
+    uint32_t hlIn = 0;           // lexer state at the start of the row
+    uint32_t hlOut = HL_UNKNOWN; // lexer state at the end, HL_UNKNOWN until lexed
+    std::unique_ptr<std::vector<HlSpan>> spans;
+    std::unique_ptr<ColumnIndex> cols; // only for rows longer than COL_CHECKPOINT
+    std::unique_ptr<LongLine> big;     // rows above LONG_LINE; data and owned are then unused
+
+    Line() = default;
+    Line(const char *d, size_t n) : data(d), len(n) {}
+    explicit Line(std::string s) : owned(new std::string(std::move(s))) {}
+
+    std::string_view text() const {
+        if (big) return big->text();
+        return owned ? std::string_view(*owned) : std::string_view(data, len);
+    }
+
+    size_t size() const { return big ? big->len : owned ? owned->size() : len; }
+
+    // Still a view into the mapping
+    bool mapped() const { return !owned && !big; }
+};
+
+
+// What a run of text does to the bracket depth, per kind ( [ {, counting
+// only brackets that are code: the change over the run, and the lowest depth
+// reached after and before any of its brackets (BRACKET_NONE if it has none).
+// Two runs combine like a segment tree node.
+const int32_t BRACKET_NONE = INT32_MAX / 2;
+
+struct BracketSum {
+    int32_t delta[3] = {0, 0, 0};
+    int32_t minAfter[3] = {BRACKET_NONE, BRACKET_NONE, BRACKET_NONE};
+    int32_t minBefore[3] = {BRACKET_NONE, BRACKET_NONE, BRACKET_NONE};
+};
+
+
+// Rows are stored in blocks of at most BLOCK_MAX lines. A Fenwick tree over the
+// block sizes maps a line number to its block in O(log n), so inserting or
+// removing a row only shifts the rows of one block, not the rest of the file.
+struct TextBuffer {
+    static constexpr size_t BLOCK_MAX = 512;
+
+    struct Block {
+        std::vector<Line> lines;
+        bool hlStale = true; // some row changed since the block was last lexed in order
+        bool bracketsValid = false; // brackets still counts the rows as they are
+        uint32_t bracketsIn = 0;    // lexer state of the first row when they were counted
+        BracketSum brackets;
+    };
+
+    std::vector<Block> blocks;
+    std::vector<size_t> tree; // Fenwick tree of per-block line counts
+    size_t count = 0;
+    size_t hlFrontier = 0; // rows before this have a consistent lexer state chain
+    size_t hlSpanCount = 0; // rows with cached spans or column indexes, roughly
+    size_t hlBudget = SIZE_MAX; // rows hlSync may still lex; the background lexer does the rest
+    unsigned long hlEdits = 0;  // bumped by every change to a row
+    std::vector<BracketSum> bracketTree; // segment tree over the blocks' brackets, see bracketNode
+    std::vector<char> bracketTreeValid;
+
+    size_t lineCount() const { return count; }
+    bool empty() const { return count == 0; }
+
+    std::string_view line(size_t i) const {
+        size_t b = locate(i);
+        return blocks[b].lines[i].text();
+    }
+
+    // Access for the highlighter; does not invalidate anything
+    Line &lineRef(size_t i) {
+        size_t b = locate(i);
+        return blocks[b].lines[i];
+    }
+
+    size_t lineLength(size_t i) const {
+        size_t b = locate(i);
+        return blocks[b].lines[i].size();
+    }
+
+    // Drops what is cached about row i before it is changed in place
+    Line &changeLine(size_t i) {
+        touch(i);
+        size_t b = locate(i);
+        Line &l = blocks[b].lines[i];
+        l.hlOut = HL_UNKNOWN;
+        l.spans.reset();
+        l.cols.reset();
+        return l;
+    }
+
+    // Copies a mapped row into its own string the first time it is changed;
+    // a chunked row is joined back into one string
+    std::string &mutableLine(size_t i) {
+        Line &l = changeLine(i);
+        if (l.big) {
+            l.big->text();
+            l.owned.reset(new std::string(std::move(l.big->flat)));
+            l.big.reset();
+        } else if (!l.owned) {
+            l.owned.reset(new std::string(l.data, l.len));
+        }
+        return *l.owned;
+    }
+
+    void clear() {
+        blocks.clear();
+        tree.clear();
+        count = 0;
+        hlFrontier = 0;
+        hlSpanCount = 0;
+        hlEdits++;
+        bracketTree.clear();
+        bracketTreeValid.clear();
+    }
+
+    // Bulk load path used by openFile: fills the last block, no searching.
+    void appendLine(std::string text) {
+        appendLine(Line(std::move(text)));
+    }
+
+    void appendView(const char *data, size_t len) {
+        appendLine(Line(data, len));
+    }
+
+    void appendLine(Line l) {
+        if (blocks.empty() || blocks.back().lines.size() >= BLOCK_MAX) pushBlock();
+        blocks.back().lines.push_back(std::move(l));
+        blocks.back().hlStale = true;
+        bracketsStale(blocks.size() - 1);
+        treeAdd(blocks.size() - 1, 1);
+        count++;
+    }
+
+    void insertLine(size_t at, std::string text) {
+        if (at >= count) {
+            appendLine(std::move(text));
+            return;
+        }
+        touch(at);
+        size_t b = locate(at);
+        std::vector<Line> &blk = blocks[b].lines;
+        blk.insert(blk.begin() + at, Line(std::move(text)));
+        treeAdd(b, 1);
+        count++;
+
+        if (blk.size() > BLOCK_MAX) {
+            // Split the full block in half and rebuild the (small) block index
+            Block tail;
+            tail.lines.assign(std::make_move_iterator(blk.begin() + blk.size() / 2),
+                              std::make_move_iterator(blk.end()));
+            blk.resize(blk.size() / 2);
+            blocks.insert(blocks.begin() + b + 1, std::move(tail));
+            rebuildTree();
+        }
+    }
+
+    void eraseLine(size_t at) {
+        if (at >= count) return;
+        touch(at);
+        size_t b = locate(at);
+        std::vector<Line> &blk = blocks[b].lines;
+        blk.erase(blk.begin() + at);
+        treeAdd(b, -1);
+        count--;
+
+        if (blk.empty()) {
+            blocks.erase(blocks.begin() + b);
+            rebuildTree();
+        }
+    }
+
+    template <typename F>
+    void forEachLine(F fn) const {
+        size_t i = 0;
+        for (const Block &blk : blocks) {
+            for (const Line &l : blk.lines) fn(i++, l.text());
+        }
+    }
+
+    // Block b's bracket counts are out of date, and so is every tree node above it
+    void bracketsStale(size_t b) {
+        if (b < blocks.size()) blocks[b].bracketsValid = false;
+        size_t leaves = bracketTreeValid.size() / 2;
+        if (b >= leaves) return;
+        for (size_t n = (leaves + b) / 2; n > 0 && bracketTreeValid[n]; n /= 2) bracketTreeValid[n] = 0;
+    }
+
+    // Turns a line number into (block index, offset in block); i becomes the offset
+    size_t locate(size_t &i) const {
+        size_t pos = 0;
+        size_t step = 1;
+        while (step * 2 <= tree.size()) step *= 2;
+        for (; step > 0; step /= 2) {
+            if (pos + step <= tree.size() && tree[pos + step - 1] <= i) {
+                pos += step;
+                i -= tree[pos - 1];
+            }
+        }
+        return pos;
+    }
+
+    // First line number of block b
+    size_t blockStart(size_t b) const { return prefix(b); }
+
+private:
+    // Row i changes: its block must be re-lexed and the chain is only good up to i
+    void touch(size_t i) {
+        hlEdits++;
+        if (i < hlFrontier) hlFrontier = i;
+        size_t off = i;
+        size_t b = locate(off);
+        if (b < blocks.size()) blocks[b].hlStale = true;
+        bracketsStale(b);
+    }
+
+    size_t prefix(size_t n) const {
+        size_t sum = 0;
+        for (; n > 0; n -= n & (~n + 1)) sum += tree[n - 1];
+        return sum;
+    }
+
+    void treeAdd(size_t b, long delta) {
+        for (size_t k = b + 1; k <= tree.size(); k += k & (~k + 1)) {
+            tree[k - 1] += delta;
+        }
+    }
+
+    // Appends an empty block and its Fenwick node without a full rebuild
+    void pushBlock() {
+        blocks.emplace_back();
+        blocks.back().lines.reserve(BLOCK_MAX);
+        size_t k = blocks.size();
+        tree.push_back(prefix(k - 1) - prefix(k - (k & (~k + 1))));
+    }
+
+    void rebuildTree() {
+        std::fill(bracketTreeValid.begin(), bracketTreeValid.end(), 0); // blocks moved
+        tree.assign(blocks.size(), 0);
+        for (size_t k = 1; k <= tree.size(); k++) {
+            tree[k - 1] += blocks[k - 1].lines.size();
+            size_t parent = k + (k & (~k + 1));
+            if (parent <= tree.size()) tree[parent - 1] += tree[k - 1];
+        }
+    }
+};
+
+
+// Part of a row as the renderer needs it: text from a lexer checkpoint at or
+// before the first visible byte, and its token spans relative to base. Short
+// rows come back whole, with their cached spans.
+struct RowView {
+    std::string_view text;
+    size_t base = 0;
+    const std::vector<HlSpan> *spans = nullptr;
+    std::string scratch;            // text copied out of several chunks
+    std::vector<HlSpan> chunkSpans; // spans lexed for a long row
+};
+
+
+// [Undo history]
+struct EditOp {
+    bool insert; // true: text was inserted at row/col, false: text was removed from there
+    int row;
+    int col;
+    std::string text;
+};
+
+struct UndoGroup {
+    std::vector<EditOp> ops;
+    int cxBefore, cyBefore;
+    int cxAfter, cyAfter;
+    bool open = false; // a run of typing or backspacing that may still grow
+};
+
+// Undo history is bounded by config.undoMemory rather than a step count. When
+// undoStack grows past it, the oldest steps are serialized, compressed in the
+// LZ4 block format and appended to an unlinked temp file as one chunk. The
+// chunks form a stack: when undo empties undoStack, the newest chunk is read
+// back and the file truncated there.
+struct SpillChunk {
+    off_t offset;
+    size_t packed;
+    size_t raw;
+};
+
+struct UndoSpill {
+    int fd = -1;
+    bool failed = false; // no temp file: the oldest steps are dropped instead
+    std::vector<SpillChunk> chunks;
+    off_t end = 0;
+    std::vector<uint32_t> hashTable; // lz4Compress's, reused between spills
+};
+
+struct UndoHistory {
+    std::deque<UndoGroup> undoStack;
+    std::vector<UndoGroup> redoStack;
+    size_t undoBytes = 0; // what the groups in undoStack take, roughly
+    UndoSpill spill;
+};
+
+
+// [File mapping]
+// openFile maps the file read-only and finds the line breaks on a background
+// thread. The main loop moves finished rows into the buffer as views, so the
+// first screen shows before the whole file has been read.
+struct MappedFile {
+    const char *data = nullptr;
+    size_t size = 0;
+    int fd = -1;         // kept open while mapped
+    bool copied = false; // read into the heap for follow mode, see followDetach
+};
+
+struct LineLoader {
+    std::thread worker;
+    std::mutex lock;
+    std::vector<std::pair<size_t, size_t>> ready; // offset and length of rows not yet in the buffer
+    std::atomic<size_t> scanned{0};
+    std::atomic<bool> done{false};
+    std::atomic<bool> stop{false};
+    bool active = false;
+    size_t nextRow = 0; // file offset of the first row not yet in the buffer
+};
+
+
+// [Background save]
+// saveFile snapshots the buffer as a list of byte spans (views into the
+// mapping plus a copy of the edited rows) and a writer thread streams them
+// to a temp file with writev, fsyncs it and renames it over the original.
+// A file with other hard links, or whose owner or attributes the temp file
+// cannot be given, is rewritten in place instead.
+struct SaveJob {
+    std::thread worker;
+    std::vector<iovec> spans;
+    std::string arena; // edited rows, copied so typing can go on during the save
+    std::string path;
+    std::string tmpPath; // made by saveTempFile, empty to write in place
+    int fd = -1;         // the temp file, open for the writer
+    size_t total = 0;
+    unsigned long changeId = 0; // E.changeId when the snapshot was taken
+    std::atomic<size_t> written{0};
+    std::atomic<bool> done{false};
+    std::string error; // written by the worker before done is set
+    bool active = false;
+};
+
+
+// [Edit journal]
+// Every edit is appended to .<name>.lume-journal next to the file as a small
+// binary record. A writer thread does the write() and fdatasync(), so typing
+// never waits for the disk. The header pins the size and mtime of the file the
+// records apply to; a save or a clean quit deletes the journal, and one found
+// when the file is opened is replayed onto it.
+struct EditJournal {
+    std::string path;
+    int fd = -1;
+    bool failed = false;   // could not be created, do not retry every key
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::string pending;   // records not written yet, guarded by lock
+    bool stop = false;     // guarded by lock
+    bool saving = false;   // a save is running: also keep the records made since
+    std::string sinceSave; // they start the next journal if the save succeeds
+};
+
+
+// [Follow mode]
+// Watches the file with inotify, like tail -f. Appended bytes are read from
+// the last known offset and become new rows; a file that shrank, or a new
+// file under the same name after log rotation, is opened again.
+const size_t FOLLOW_STEP_BYTES = 4 << 20; // read per poll, so a burst of output does not stall typing
+const size_t FOLLOW_TAIL = 64;
+
+struct FollowState {
+    bool active = false;
+    int notify = -1;      // inotify descriptor, non-blocking
+    int watch = -1;       // on the file itself; the directory watch sees rotation
+    int fd = -1;          // the followed file, read with pread
+    dev_t dev = 0;
+    ino_t ino = 0;
+    size_t offset = 0;    // bytes of the file already in the buffer
+    std::string tail;     // last bytes before offset, to notice a file rewritten behind our back
+    bool partial = false; // the last row has no newline yet, so new bytes continue it
+    std::string last;     // the buffer's last row as read from the file; appending stops once it changes
+    bool toEnd = false;   // put the cursor on the last row once the file is loaded
+};
+
+
+// [Pager]
+// --view never indexes every row. A scan on a worker thread records where
+// every PAGER_CHECKPOINT-th row starts, and the buffer only holds the rows of
+// a window of about PAGER_WINDOW_BYTES read with pread around the cursor, so
+// memory stays flat however big the file is. Row numbers are known once the
+// scan has passed the window.
+const size_t PAGER_CHECKPOINT = 4096;
+const size_t PAGER_WINDOW_BYTES = 1 << 20;
+
+struct PagerState {
+    bool active = false;
+    int fd = -1;
+    size_t size = 0;
+    std::thread worker;
+    std::mutex lock;
+    std::vector<uint64_t> checkpoints; // start of row i * PAGER_CHECKPOINT, guarded by lock
+    std::atomic<size_t> scanned{0};    // bytes the scan has passed
+    std::atomic<bool> done{false};
+    std::atomic<bool> stop{false};
+    size_t rows = 0;                   // rows in the file, once done
+    std::string window;                // the bytes the buffer rows point into
+    size_t windowStart = 0;            // file offset of window[0], a row start
+    std::vector<uint32_t> rowStarts;   // where each buffer row starts in the window
+    long baseRow = -1;                 // row number of the buffer's first row, -1: not known yet
+};
+
+
+// [Reopen cache]
+// A clean quit writes a sidecar under ~/.cache/lume with the cursor and scroll
+// position and, for big files, the row index and the lexer states of the rows
+// already highlighted. Opening the file again unchanged (same size, mtime,
+// inode and hash of a few sampled blocks) takes the rows from there instead
+// of scanning the file, and lands where the last session left off.
+const size_t CACHE_INDEX_MIN = 8 << 20; // smaller files scan faster than the index reads
+
+struct ReopenCache {
+    std::string path;                 // the sidecar, empty if there is no cache directory
+    std::array<uint64_t, 5> stamp{};  // of the file as it was opened
+    size_t indexRows = 0;             // the sidecar holds an index of this many rows
+    size_t indexBytes = 0;
+    bool pending = false;             // read by openFile, cacheRestore not run yet
+    int cx = 0, cy = 0, rowOffset = 0, colOffset = 0;
+    size_t hlFrontier = 0;
+    uint32_t hlLast = HL_UNKNOWN;     // hlOut of the row before the frontier
+    std::vector<std::pair<size_t, uint32_t>> hlStates; // rows before it that start inside a comment or string
+};
+
+
+// [Bracket matching]
+// The bracket under the cursor and its match, as found for drawing; the key
+// says what it was found for, so it is only looked up again when that changes
+struct BracketPair {
+    long row = -1;       // -1: no bracket at the cursor, or no match found
+    size_t col = 0;
+    long matchRow = -1;
+    size_t matchCol = 0;
+    bool pending = false;  // the rows that would decide it are not lexed or counted yet
+    bool counting = false; // pending only for the blocks a frame may count
+    unsigned long edits = 0;
+    size_t lines = 0;
+    size_t frontier = 0;
+    int cx = -1, cy = -1;
+};
+
+
+// [Background lexer]
+// drawRows lexes at most HL_SYNC_ROWS rows a frame itself. When the rows on
+// screen are further past the highlight frontier (a "/*" opened near the top
+// of a big file), a worker thread lexes the rows in between, then on towards
+// the furthest row highlighted before, in jobs of HL_JOB_ROWS. A job carries
+// its rows as views into the mapping or copies, so the worker never touches
+// the buffer. Finished jobs come back through an atomic pointer; drawRows
+// takes whatever is there and never waits. Until then the rows past the
+// frontier are drawn with the state they had.
+const size_t HL_SYNC_ROWS = 2000;
+const size_t HL_JOB_ROWS = 1 << 16;
+
+struct Syntax;
+
+struct HlJob {
+    const Syntax *syn;
+    unsigned long edits;               // buf.hlEdits when it was made
+    size_t first;                      // row the job starts at, the frontier then
+    uint32_t state;                    // lexer state row first starts in
+    std::vector<std::string_view> parts; // row texts; a chunked row has one per chunk
+    std::vector<uint32_t> ends;        // per row, one past its last part
+    std::vector<uint32_t> oldIn, oldOut; // the states the rows had, reused where still right
+    std::deque<std::string> copies;    // rows that are not views into the mapping
+    std::vector<uint32_t> out;         // filled by the worker: state at the end of each row
+};
+
+struct BackgroundLexer {
+    std::thread worker;
+    std::mutex lock;                        // only for sleeping
+    std::condition_variable wake;
+    std::atomic<HlJob *> job{nullptr};      // handed over, not taken yet
+    std::atomic<HlJob *> result{nullptr};   // done, not applied yet
+    std::atomic<unsigned long> latest{0};   // buf.hlEdits as last seen: older jobs are given up
+    std::atomic<bool> stop{false};
+    bool busy = false;                      // a job is out
+    size_t reach = 0;                       // furthest the frontier has been
+};
+
+
+// [Screen damage]
+// What is currently on the terminal, so a frame only repaints rows that
+// changed. Edits mark rows dirty, scrolling moves the painted rows with a
+// terminal scroll region and only the newly exposed rows are drawn.
+struct ScreenState {
+    std::vector<char> dirty;        // per screen row
+    std::vector<uint32_t> paintedHl; // lexer state each row was painted with
+    int rowOffset = -1;
+    int colOffset = -1;
+    int lineNumberWidth = -1;
+    size_t lineCount = 0;
+    std::string status;
+    bool full = true;
+    bool wrap = false;
+    std::vector<std::pair<int, int>> painted; // soft wrap: (row, screen line of it) on each screen row
+};
+
+
+// [Latency instrumentation]
+// Stages of one trip through the main loop
+enum PerfStage {
+    PERF_INPUT,     // reading queued keys
+    PERF_EDIT,      // applying them
+    PERF_HIGHLIGHT, // lexing the visible rows
+    PERF_PAINT,     // building the screen in ncurses
+    PERF_REFRESH,   // refresh(), the write to the terminal
+    PERF_LATENCY,   // first key of a batch until its frame is on screen
+    PERF_STAGES
+};
+
+// Log-linear buckets of nanoseconds: 8 per power of two, so a percentile
+// is within 12.5% and recording one sample is a few instructions
+const int HIST_SUB = 8;
+const int HIST_BUCKETS = 64 * HIST_SUB;
+
+struct LatencyHistogram {
+    uint32_t counts[HIST_BUCKETS] = {};
+    uint64_t samples = 0;
+    uint64_t maxNs = 0;
+};
+
+struct PerfStats {
+    LatencyHistogram hist[PERF_STAGES];
+    uint64_t frameNs[PERF_STAGES] = {}; // current frame, summed per stage
+    uint64_t inputAt = 0;               // first key of the batch, 0 if none
+    int frameKeys = 0;
+    unsigned long frames = 0;
+    bool overlay = false;               // p50/p99 in the status bar
+    FILE *trace = nullptr;              // per-frame timings, see --trace
+};
+
+
+// [Search]
+// Incremental search: every key in the prompt restarts the scan, which runs
+// in steps of SEARCH_STEP_BYTES so the main loop stays responsive.
+struct SearchState {
+    bool active = false;  // the prompt is open
+    bool pending = false; // a scan has not finished yet
+    std::string query;
+    std::string last;     // previous query, reused by Ctrl-F on an empty prompt
+    int dir = 1;          // 1 forward, -1 backward
+    size_t row = 0;       // where the scan continues
+    size_t col = 0;       // forward: first column to try, backward: matches start before it
+    size_t rowsLeft = 0;
+    int matchRow = -1;
+    size_t matchCol = 0;
+    int savedCx = 0, savedCy = 0, savedRowOffset = 0, savedColOffset = 0; // restored by Escape
+};
+
+const size_t SEARCH_STEP_BYTES = 8 << 20;
+
+
+// [Prompt]
+// A one-line question in the status bar, answered with Enter or dropped with Escape
+enum class PromptKind {
+    NONE,
+    REPLACE_PATTERN,
+    REPLACE_WITH,
+    GOTO
+};
+
+struct PromptState {
+    PromptKind kind = PromptKind::NONE;
+    std::string label;
+    std::string text;
+    std::string pattern; // replace: the regex, while asking for the replacement
+};
+
+
+// [Regular expressions]
+enum ReOp : uint8_t {
+    RE_CHAR,
+    RE_ANY,
+    RE_CLASS,
+    RE_SPLIT, // try x, then y
+    RE_JMP,
+    RE_SAVE,  // record the position in capture slot x
+    RE_BOL,
+    RE_EOL,
+    RE_WORDB,
+    RE_NWORDB,
+    RE_MATCH
+};
+
+struct ReInst {
+    ReOp op;
+    unsigned char c;
+    int x;
+    int y;
+};
+
+const int REGEX_MAX_GROUPS = 9;
+const size_t REGEX_MAX_PROGRAM = 4096;
+typedef std::array<size_t, 2 * (REGEX_MAX_GROUPS + 1)> RegexCaps;
+
+struct Regex {
+    std::vector<ReInst> prog;
+    std::vector<std::bitset<256>> classes;
+    std::string prefix; // literal start of every match, found with findSubstring
+    bool literal = false; // the pattern is just the prefix
+    int groups = 0;
+};
+
+// Thread lists of the Pike VM, reused between searches; one per thread
+struct RegexVM {
+    struct Thread {
+        int pc;
+        RegexCaps caps;
+    };
+    std::vector<Thread> cur, next;
+    std::vector<uint64_t> mark; // generation in which a pc was last queued
+    uint64_t gen = 0;
+};
+
+
+// [Soft wrap]
+// One screen line of a wrapped row: bytes start..end-1, from display column col
+struct WrapLine {
+    size_t start = 0;
+    size_t end = 0;
+    int col = 0;
+};
+
+
+// [Editor states]
+struct Syntax;
+
+struct EditorState {
+    int cx = 0; // cursor x (in characters, not including line number)
+    int cy = 0; // cursor y in file (row index)
+    int rowOffset = 0; // top row visible
+    int colOffset = 0; // left column visible
+    int wrapOffset = 0; // with soft wrap: the screen line of rowOffset at the top
+    int screenRows = 0;
+    int screenCols = 0;
+    bool quit = false;
+    bool dirty = false;
+    unsigned long changeId = 0; // bumped on every change to the text
+    std::string filename;
+    std::string configPath;
+    const Syntax *syntax = nullptr; // set by selectSyntax
+    std::string statusMsg;
+    time_t statusTime = 0;
+    TextBuffer buf;
+    MappedFile map;
+    LineLoader loader;
+    SaveJob save;
+    EditJournal journal;
+    FollowState follow;
+    PagerState pager;
+    ReopenCache cache;
+    BackgroundLexer lexer;
+    BracketPair bracket;
+    ScreenState screen;
+    EditorConfig config;
+    PerfStats perf;
+    SearchState search;
+    PromptState prompt;
+    UndoHistory history;
+
+    EditorState() = default;
+    ~EditorState(); // stops and joins the worker threads
+};
+
+
+
+// Rows whose spans are cached before the renderer drops them all
+const size_t HL_SPAN_LIMIT = 20000;
+
+
+// [Core functions]
+void setDefaultKeybindings(EditorConfig &conf);
+Action actionFromName(const std::string &name);
+int parseKeyString(const std::string &keyStr);
+std::string keyName(int code);
+void loadConfig(EditorConfig &conf, const std::string &path);
+void buildDispatchTable(EditorConfig &conf);
+Action mapKeyToAction(const EditorState &E, int key);
+void setStatusMessage(EditorState &E, const std::string &msg);
+void reloadConfig(EditorState &E);
+
+uint64_t perfNow();
+void histAdd(LatencyHistogram &h, uint64_t ns);
+uint64_t histPercentile(const LatencyHistogram &h, double p);
+void perfEndFrame(PerfStats &P, uint64_t now);
+std::string perfSummary(const PerfStats &P);
+
+uint32_t decodeUtf8(std::string_view s, size_t i, size_t &len);
+int codepointWidth(uint32_t cp);
+int cellWidth(std::string_view s, size_t i, int col, int tabSize, size_t &next);
+size_t nextCharStart(std::string_view s, size_t i);
+size_t prevCharStart(std::string_view s, size_t i);
+std::string_view lineSlice(TextBuffer &buf, size_t row, size_t from, size_t to, std::string &scratch);
+int displayColumn(TextBuffer &buf, size_t row, size_t byte, int tabSize);
+size_t byteAtColumn(TextBuffer &buf, size_t row, int col, int tabSize, int &startCol);
+int lineNumberWidth(const EditorState &E);
+int computeScreenX(EditorState &E);
+const Syntax *selectSyntax(const std::string &filename);
+uint32_t lexLine(const Syntax &syn, std::string_view row, uint32_t state, std::vector<HlSpan> *out, bool more = false,
+                 std::vector<uint32_t> *brackets = nullptr);
+void hlSync(TextBuffer &buf, const Syntax &syn, size_t target);
+const std::vector<HlSpan> &hlSpans(TextBuffer &buf, const Syntax &syn, size_t row);
+void hlTrimSpans(TextBuffer &buf);
+void rowView(TextBuffer &buf, const Syntax *syn, size_t row, size_t from, size_t to, RowView &v);
+void lexerUpdate(EditorState &E, size_t lastRow);
+void lexerStop(EditorState &E);
+bool bracketPair(EditorState &E, BracketPair &p, bool sync);
+void bracketUpdate(EditorState &E);
+void jumpToBracket(EditorState &E);
+
+void damageRows(EditorState &E, int from, int to);
+void undo(EditorState &E);
+void redo(EditorState &E);
+
+bool pullLoadedLines(EditorState &E);
+void finishLoading(EditorState &E);
+void closeFile(EditorState &E);
+void openFile(EditorState &E, const std::string &filename);
+bool copyMapping(EditorState &E, size_t size);
+void saveFile(EditorState &E);
+bool pollSave(EditorState &E);
+void finishSave(EditorState &E);
+void journalEdit(EditorState &E, bool insert, int row, int col, const std::string &text);
+void journalRecover(EditorState &E);
+void journalDiscard(EditorState &E);
+bool followStart(EditorState &E);
+void followStop(EditorState &E);
+bool followPoll(EditorState &E);
+bool pagerOpen(EditorState &E, const std::string &filename);
+void pagerClose(EditorState &E);
+void pagerPoll(EditorState &E);
+bool pagerKey(EditorState &E, int c);
+size_t pagerCursorByte(const EditorState &E);
+long rowNumber(const EditorState &E, int row);
+void gotoLine(EditorState &E, const std::string &where);
+void cacheRestore(EditorState &E);
+void cacheSave(EditorState &E);
+
+int wrapCount(EditorState &E, int row);
+WrapLine wrapLine(EditorState &E, int row, int k);
+int wrapLineOf(EditorState &E, int row, size_t byte);
+int wrapStep(EditorState &E, int &row, int &k, int n);
+void wrapToggle(EditorState &E);
+void editorScroll(EditorState &E);
+void insertChar(EditorState &E, char c);
+void insertNewline(EditorState &E);
+void deleteChar(EditorState &E);
+void moveCursor(EditorState &E, Action action);
+void moveWordRight(EditorState &E);
+void moveWordLeft(EditorState &E);
+size_t findSubstring(const char *p, size_t n, std::string_view needle);
+void searchOpen(EditorState &E);
+void searchStart(EditorState &E, size_t row, size_t col, int dir);
+bool searchStep(EditorState &E, size_t budget);
+bool searchKey(EditorState &E, int c);
+void searchClose(EditorState &E, bool restore);
+
+bool compileRegex(const std::string &pattern, Regex &re, std::string &error);
+bool regexSearch(const Regex &re, RegexVM &vm, std::string_view t, size_t from, RegexCaps &caps);
+void regexExpand(const std::string &tmpl, std::string_view t, const RegexCaps &caps, std::string &out);
+void replaceAll(EditorState &E, const std::string &pattern, const std::string &with);
+void promptOpen(EditorState &E, PromptKind kind, const std::string &label);
+void promptKey(EditorState &E, int c);
+
+void insertText(EditorState &E, const std::string &text);
+void editorHandleKey(EditorState &E, int c);
+
+#endif
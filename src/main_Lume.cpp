@@ -6,347 +6,152 @@
 
 // [Indcludes]
 #include <ncurses.h>
+#include "lume_core.hpp"
 #include <string>
 #include <vector>
-#include <fstream>
-#include <sstream>
-#include <unordered_map>
 #include <algorithm>
-#include <cctype>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <clocale>
+#include <langinfo.h>
+#include <poll.h>
+#include <unistd.h>
 
 
 // [Defines]
-#define CTRL_LEFT 554 
-#define CTRL_RIGHT 569
-// Helper: simple CTRL macro
-#ifndef KEY_CTRL
-#define CTRL_KEY(k) ((k) & 0x1f)
-#endif
-
-
-// [config structure]
-struct EditorConfig {
-    int tabSize = 4;
-    bool showLineNumbers = true;
-    std::unordered_map<std::string, int> keyMap; // action -> key code
-};
-
-
-// [Editor states]
-struct EditorState {
-    int cx = 0; // cursor x (in characters, not including line number)
-    int cy = 0; // cursor y in file (row index)
-    int rowOffset = 0; // top row visible
-    int colOffset = 0; // left column visible
-    int screenRows = 0;
-    int screenCols = 0;
-    bool quit = false;
-    bool dirty = false;
-    std::string filename;
-    std::vector<std::string> rows;
-    EditorConfig config;
-};
-
-
-// [Actions]
-enum class Action {
-    MOVE_UP,
-    MOVE_DOWN,
-    MOVE_LEFT,
-    MOVE_RIGHT,
-    MOVE_WORD_LEFT,
-    MOVE_WORD_RIGHT,
-    QUIT,
-    SAVE,
-    UNDO,
-    NONE
-};
-
-
-// [Default keybindings (fallback if not set in config)]
-void setDefaultKeybindings(EditorConfig &conf) {
-    conf.keyMap["quit"] = CTRL_KEY('q');   
-    conf.keyMap["save"] = CTRL_KEY('s');
-    conf.keyMap["move_up"] = KEY_UP;
-    conf.keyMap["move_down"] = KEY_DOWN;
-    conf.keyMap["move_left"] = KEY_LEFT;
-    conf.keyMap["move_right"] = KEY_RIGHT;
-    conf.keyMap["move_word_left"] = CTRL_LEFT; 
-    conf.keyMap["move_word_right"] = CTRL_RIGHT;
-    conf.keyMap["undo"] = CTRL_KEY('z');
-}
-
-
-// We treat certain strings in config.toml as special keys like "Ctrl-q", "ArrowUp"
-int parseKeyString(const std::string &keyStr) {
-    if (keyStr == "ArrowUp") return KEY_UP;
-    if (keyStr == "ArrowDown") return KEY_DOWN;
-    if (keyStr == "ArrowLeft") return KEY_LEFT;
-    if (keyStr == "ArrowRight") return KEY_RIGHT;
-    if (keyStr == "PageUp") return KEY_PPAGE;
-    if (keyStr == "PageDown") return KEY_NPAGE;
-    if (keyStr == "Home") return KEY_HOME;
-    if (keyStr == "End") return KEY_END;
-    if (keyStr == "Ctrl-ArrowLeft") return 554; 
-    if (keyStr == "Ctrl-ArrowRight") return 569;
-
-    // Ctrl-X: "Ctrl-q", "Ctrl-s", etc.
-    if (keyStr.rfind("Ctrl-", 0) == 0 && keyStr.size() == 6) {
-        char c = keyStr[5];
-        if (std::isalpha(static_cast<unsigned char>(c))) {
-            c = std::tolower(static_cast<unsigned char>(c));
-            return CTRL_KEY(c);
-        }
-    }
-
-    // Single character key
-    if (keyStr.size() == 1) {
-        return static_cast<unsigned char>(keyStr[0]);
-    }
-
-    // Fallback
-    return -1;
-}
-
-
-// [moving Cursor with tabs syncronisation]
-int computeScreenX(const EditorState &E) {
-    if (E.cy >= (int)E.rows.size()) return 0;
-
-    const std::string &row = E.rows[E.cy];
-    int screenX = 0;
-
-    for (int i = 0; i < E.cx && i < (int)row.size(); i++) {
-        if (row[i] == '\t') {
-            int spaces = E.config.tabSize - (screenX % E.config.tabSize);
-            screenX += spaces;
-        } else {
-            screenX++;
-        }
-    }
-    return screenX;
-}
-
-
-// [C/C++ Syntax Highlighting]
-bool isKeyword(const std::string &word) {
-    static const std::vector<std::string> keywords = {
-        "if","else","for","while","switch","case","default","break","continue",
-        "return","goto","do","sizeof","typedef","static","const","volatile",
-        "inline","struct","class","public","private","protected","virtual",
-        "override","template","typename","using","namespace","enum","union",
-        "new","delete","this","operator","try","catch","throw"
+// Bracketed paste markers, registered with define_key
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+#define KEY_PASTE_END (KEY_MAX + 2)
+#define INPUT_BATCH_MAX 4096
+
+// The core names keys without curses; its codes must be the real ones
+static_assert(LUME_KEY_UP == KEY_UP && LUME_KEY_DOWN == KEY_DOWN &&
+              LUME_KEY_LEFT == KEY_LEFT && LUME_KEY_RIGHT == KEY_RIGHT, "arrow key codes");
+static_assert(LUME_KEY_HOME == KEY_HOME && LUME_KEY_END == KEY_END &&
+              LUME_KEY_PPAGE == KEY_PPAGE && LUME_KEY_NPAGE == KEY_NPAGE, "navigation key codes");
+static_assert(LUME_KEY_BACKSPACE == KEY_BACKSPACE && LUME_KEY_F(5) == KEY_F(5) &&
+              LUME_KEY_MAX == KEY_MAX, "key codes");
+
+
+// [Syntax Highlighting output]
+// Draws a row as runs of equal colour: the visible text is tab-expanded
+// into a scratch buffer and each run goes out with one attrset + addnstr,
+// instead of attron/mvaddch/attroff for every character. Search matches and
+// the bracket pair at the cursor are laid over the token colours. Drawing
+// starts at byte x of file row fileRow, the character under colOffset (at
+// column col), not at byte 0; v holds the row from at or before x, with
+// spans and offsets relative to v.base.
+void drawHighlightedLine(const RowView &v, size_t x, int col, int y, int fileRow, int colOffset, int startCol, int maxCols, const EditorState &E) {
+    static std::string run;
+    static std::vector<size_t> hits;
+    std::string_view row = v.text;
+    const std::vector<HlSpan> &spans = *v.spans;
+    std::string_view query = E.search.active ? std::string_view(E.search.query) : std::string_view();
+    hits.clear();
+    for (size_t at = 0; !query.empty() && at < row.size();) {
+        size_t hit = findSubstring(row.data() + at, row.size() - at, query);
+        if (hit == std::string_view::npos) break;
+        hits.push_back(at + hit);
+        at += hit + 1;
+    }
+    // Brackets to mark in this row, relative to v.base; SIZE_MAX for none
+    size_t marks[2] = {SIZE_MAX, SIZE_MAX};
+    const BracketPair &pair = E.bracket;
+    if (pair.matchRow >= 0) {
+        if (pair.row == fileRow && pair.col >= v.base) marks[0] = pair.col - v.base;
+        if (pair.matchRow == fileRow && pair.matchCol >= v.base) marks[1] = pair.matchCol - v.base;
+        if (marks[0] > marks[1]) std::swap(marks[0], marks[1]);
+    }
+
+    int tabSize = E.config.tabSize;
+    int runColor = 0;
+    x -= v.base;
+    int cells = 0; // screen cells used
+    run.clear();
+
+    auto flush = [&]() {
+        if (run.empty()) return;
+        attrset(runColor ? COLOR_PAIR(runColor) : A_NORMAL);
+        addnstr(run.data(), (int)run.size());
+        run.clear();
     };
-    return std::find(keywords.begin(), keywords.end(), word) != keywords.end();
-}
-
 
-bool isTypeLike(const std::string &word) {
-    static const std::vector<std::string> types = {
-        "int","long","short","char","float","double","void","bool",
-        "unsigned","signed","auto","std","string","size_t"
-    };
-    return std::find(types.begin(), types.end(), word) != types.end();
-}
-
-
-void drawHighlightedLine(const std::string &row, int y, int colOffset, int startCol, int maxCols, const EditorState &E) {
-    int x = 0;
-    int screenCol = startCol;
-
-    bool inString = false;
-    char stringChar = 0;
-    bool inLineComment = false;
-
-    while (x < (int)row.size() && screenCol - startCol < maxCols) {
-        char c = row[x];
-
-        // Skip until visible column
-        if (screenCol < startCol + colOffset) {
-            if (!inString && !inLineComment && c == '/' && x + 1 < (int)row.size() && row[x+1] == '/') {
-                inLineComment = true;
-            } else if (!inLineComment && (c == '"' || c == '\'')) {
-                inString = true;
-                stringChar = c;
-            } else if (inString && c == stringChar && (x == 0 || row[x-1] != '\\')) {
-                inString = false;
-            }
-            x++;
-            screenCol++;
-            continue;
-        }
-
-        // Comments
-        if (!inString && !inLineComment && c == '/' && x + 1 < (int)row.size() && row[x+1] == '/') {
-            inLineComment = true;
-            attron(COLOR_PAIR(4));
-            mvaddnstr(y, screenCol, row.c_str() + x,
-                      std::min(maxCols - (screenCol - startCol), (int)row.size() - x));
-            attroff(COLOR_PAIR(4));
-            break;
-        }
-
-        // Strings
-        if (!inLineComment && (c == '"' || c == '\'')) {
-            inString = true;
-            stringChar = c;
-            attron(COLOR_PAIR(5));
-            mvaddch(y, screenCol, c);
-            attroff(COLOR_PAIR(5));
-            x++;
-            screenCol++;
-            continue;
-        }
-
-        if (inString) {
-            attron(COLOR_PAIR(5));
-            mvaddch(y, screenCol, c);
-            attroff(COLOR_PAIR(5));
-            if (c == stringChar && (x == 0 || row[x-1] != '\\')) {
-                inString = false;
-            }
-            x++;
-            screenCol++;
-            continue;
+    move(y, startCol);
+    if (col < colOffset && x < row.size()) {
+        // A tab or wide character cut by the left edge: blank out what shows
+        size_t next;
+        int w = cellWidth(row, x, col, tabSize, next);
+        for (; col + w > colOffset && cells < maxCols && colOffset + cells < col + w; cells++) run += ' ';
+        col += w;
+        x = next;
+    }
+
+    size_t si = 0;
+    size_t hi = 0;
+    bool room = cells < maxCols;
+    while (room && x < row.size()) {
+        // The colour is constant up to the next span boundary
+        while (si < spans.size() && spans[si].start + spans[si].len <= x) si++;
+        int color = 0;
+        size_t segEnd = row.size();
+        if (si < spans.size() && spans[si].start <= x) {
+            color = spans[si].color;
+            segEnd = std::min<size_t>(segEnd, spans[si].start + spans[si].len);
+        } else if (si < spans.size()) {
+            segEnd = spans[si].start;
         }
-
-        // Numbers
-        if (std::isdigit((unsigned char)c)) {
-            int start = x;
-            while (x < (int)row.size() && (std::isdigit((unsigned char)row[x]) || row[x]=='.')) x++;
-            int len = x - start;
-            attron(COLOR_PAIR(6));
-            mvaddnstr(y, screenCol, row.c_str() + start,
-                      std::min(len, maxCols - (screenCol - startCol)));
-            attroff(COLOR_PAIR(6));
-            screenCol += len;
-            continue;
+        while (hi < hits.size() && hits[hi] + query.size() <= x) hi++;
+        if (hi < hits.size() && hits[hi] <= x) {
+            color = 7;
+            segEnd = hits[hi] + query.size();
+        } else if (hi < hits.size()) {
+            segEnd = std::min(segEnd, hits[hi]);
         }
-
-        // Identifiers
-        if (std::isalpha((unsigned char)c) || c == '_' ) {
-            int start = x;
-            while (x < (int)row.size() && (std::isalnum((unsigned char)row[x]) || row[x]=='_')) x++;
-            int len = x - start;
-            std::string word = row.substr(start, len);
-
-            if (isKeyword(word)) {
-                attron(COLOR_PAIR(1));
-                mvaddnstr(y, screenCol, row.c_str() + start,
-                          std::min(len, maxCols - (screenCol - startCol)));
-                attroff(COLOR_PAIR(1));
-            } else if (isTypeLike(word)) {
-                attron(COLOR_PAIR(2));
-                mvaddnstr(y, screenCol, row.c_str() + start,
-                          std::min(len, maxCols - (screenCol - startCol)));
-                attroff(COLOR_PAIR(2));
-            } else {
-                mvaddnstr(y, screenCol, row.c_str() + start,
-                          std::min(len, maxCols - (screenCol - startCol)));
+        for (size_t mark : marks) {
+            if (mark == x) {
+                color = 8;
+                segEnd = x + 1;
+            } else if (mark > x) {
+                segEnd = std::min(segEnd, mark);
             }
-            screenCol += len;
-            continue;
         }
 
-        if (c == '\t') {
-            // Expand real tab into spaces visually
-            int spaces = E.config.tabSize - ((screenCol - startCol) % E.config.tabSize);
-            for (int i = 0; i < spaces && screenCol - startCol < maxCols; i++) {
-                mvaddch(y, screenCol++, ' ');
-            }
-            x++;
-            continue;
+        if (color != runColor) {
+            flush();
+            runColor = color;
         }
-
-        // Normal character
-        mvaddch(y, screenCol, c);
-        x++;
-        screenCol++;
-
-    }
-}
-
-// [Config and Key Management]
-
-// Minimal "TOML-like" parser for our config file
-void loadConfig(EditorConfig &conf, const std::string &path) {
-    setDefaultKeybindings(conf);
-
-    std::ifstream in(path);
-    if (!in) {
-        // No config file, keep defaults
-        return;
-    }
-
-    std::string line;
-    std::string section;
-    while (std::getline(in, line)) {
-        // Trim
-        auto trim = [](std::string &s) {
-            s.erase(s.begin(), std::find_if(s.begin(), s.end(),
-                   [](unsigned char ch){ return !std::isspace(ch); }));
-            s.erase(std::find_if(s.rbegin(), s.rend(),
-                   [](unsigned char ch){ return !std::isspace(ch); }).base(),
-                   s.end());
-        };
-
-        trim(line);
-        if (line.empty() || line[0] == '#') continue;
-
-        if (line.front() == '[' && line.back() == ']') {
-            section = line.substr(1, line.size() - 2);
-            trim(section);
-            continue;
-        }
-
-        auto pos = line.find('=');
-        if (pos == std::string::npos) continue;
-
-        std::string key = line.substr(0, pos);
-        std::string value = line.substr(pos + 1);
-        trim(key);
-        trim(value);
-
-        // Remove quotes if present
-        if (!value.empty() && value.front() == '"' && value.back() == '"') {
-            value = value.substr(1, value.size() - 2);
-        }
-
-        if (section == "options") {
-            if (key == "tabsize") {
-                conf.tabSize = std::atoi(value.c_str());
-            } else if (key == "show_line_numbers") {
-                conf.showLineNumbers = (value == "true" || value == "1");
+        while (room && x < segEnd) {
+            unsigned char c = row[x];
+            size_t next;
+            int w = cellWidth(row, x, col, tabSize, next);
+            if (cells + w > maxCols) {
+                // Half a wide character or tab at the right edge
+                for (; cells < maxCols; cells++) run += ' ';
+                room = false;
+                break;
             }
-        } else if (section == "keys") {
-            int kcode = parseKeyString(key);
-            if (kcode != -1) {
-                conf.keyMap[value] = kcode;
+            if (c == '\t') {
+                // Expand real tab into spaces visually
+                run.append(w, ' ');
+            } else if (c < 32 || c == 127) {
+                run += '?'; // control characters would take two cells as ^X
+            } else if (c < 0x80) {
+                run += (char)c;
+            } else {
+                size_t len;
+                uint32_t cp = decodeUtf8(row, x, len);
+                if (cp == UTF8_INVALID || cp < 0xA0) run += '?';
+                else run.append(row.data() + x, next - x);
             }
+            col += w;
+            cells += w;
+            x = next;
+            room = cells < maxCols;
         }
     }
-}
-
-
-Action mapKeyToAction(const EditorState &E, int key) {
-    for (const auto &kv : E.config.keyMap) {
-        if (kv.second == key) {
-            const std::string &actionName = kv.first;
-            if (actionName == "quit") return Action::QUIT;
-            if (actionName == "save") return Action::SAVE;
-            if (actionName == "move_up") return Action::MOVE_UP;
-            if (actionName == "move_down") return Action::MOVE_DOWN;
-            if (actionName == "move_left") return Action::MOVE_LEFT;
-            if (actionName == "move_right") return Action::MOVE_RIGHT;
-            if (actionName == "move_word_left") return Action::MOVE_WORD_LEFT;
-            if (actionName == "move_word_right") return Action::MOVE_WORD_RIGHT;
-            if (actionName == "undo") return Action::UNDO;
-
-        }
-    }
-    return Action::NONE;
+    flush();
+    attrset(A_NORMAL);
 }
 
 
@@ -359,7 +164,13 @@ void die(const char *msg) {
 
 
 void initEditor(EditorState &E, const std::string &configPath) {
+    E.configPath = configPath;
     loadConfig(E.config, configPath);
+    E.syntax = selectSyntax("");
+
+    // Multibyte output needs a UTF-8 locale; fall back to C.UTF-8 under LANG=C
+    std::setlocale(LC_ALL, "");
+    if (std::strcmp(nl_langinfo(CODESET), "UTF-8") != 0) std::setlocale(LC_CTYPE, "C.UTF-8");
 
     if (initscr() == nullptr) {
         std::fprintf(stderr, "Failed to init ncurses\n");
@@ -375,129 +186,157 @@ void initEditor(EditorState &E, const std::string &configPath) {
         init_pair(4, COLOR_BLUE,  -1); // comments
         init_pair(5, COLOR_MAGENTA,-1);// strings
         init_pair(6, COLOR_GREEN, -1); // numbers
+        init_pair(7, COLOR_BLACK, COLOR_YELLOW); // search matches
+        init_pair(8, COLOR_BLACK, COLOR_CYAN);   // bracket under the cursor and its match
     }
 
     raw();
     noecho();
     keypad(stdscr, TRUE);
+    set_escdelay(25); // Escape closes the search prompt without a pause
+
+    // Bracketed paste: the terminal wraps pasted text in ESC[200~ ... ESC[201~
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    define_key("\033[201~", KEY_PASTE_END);
+    std::printf("\033[?2004h");
+    std::fflush(stdout);
     // hide cursor while rendering; we'll set later
     curs_set(1);
 
+    buildDispatchTable(E.config);
+    if (!E.config.warnings.empty()) {
+        setStatusMessage(E, "config: " + E.config.warnings.front());
+    }
+
     getmaxyx(stdscr, E.screenRows, E.screenCols);
     // Reserve one row for status bar
     E.screenRows -= 1;
+    // Vertical scrolling shifts only the text rows, never the status bar
+    idlok(stdscr, TRUE);
+    setscrreg(0, E.screenRows - 1);
 }
 
 
-// [Snapshot and Undo Logic]
-
-struct UndoSnapshot {
-    std::vector<std::string> rows;
-    int cx;
-    int cy;
-};
-
-std::vector<UndoSnapshot> undoStack;
-const size_t UNDO_LIMIT = 100;
-
-
-void pushUndo(const EditorState &E) {
-    UndoSnapshot snap;
-    snap.rows = E.rows;
-    snap.cx = E.cx;
-    snap.cy = E.cy;
-    undoStack.push_back(std::move(snap));
-    if (undoStack.size() > UNDO_LIMIT) {
-        undoStack.erase(undoStack.begin());
-    }
-}
-
-
-void undo(EditorState &E) {
-    if (undoStack.empty()) return;
-    UndoSnapshot snap = undoStack.back();
-    undoStack.pop_back();
-
-    E.rows = std::move(snap.rows);
-    E.cx = snap.cx;
-    E.cy = snap.cy;
-    E.dirty = true; // still dirty after undo
+// [Editor Layout and Logic]
+// With soft wrap: how many screen rows the lines of layout moved up since
+// painted was drawn (negative for down), rows when they have nothing in common
+int wrapShift(const std::vector<std::pair<int, int>> &painted, const std::vector<std::pair<int, int>> &layout, int rows) {
+    if (painted.empty() || layout.empty()) return rows;
+    auto it = std::find(painted.begin(), painted.end(), layout[0]);
+    if (it != painted.end()) return (int)(it - painted.begin());
+    it = std::find(layout.begin(), layout.end(), painted[0]);
+    if (it != layout.end()) return -(int)(it - layout.begin());
+    return rows;
 }
 
 
+// Brings the painted rows in line with E.rowOffset, or with soft wrap with
+// the screen lines in layout: scrolls the terminal for small moves and marks
+// what cannot be reused
+void scrollScreen(EditorState &E, int lineNumberWidth, const std::vector<std::pair<int, int>> &layout) {
+    ScreenState &S = E.screen;
+    int rows = E.screenRows;
+    bool wrap = E.config.softWrap;
 
-// [file I/O Logic]
-void openFile(EditorState &E, const std::string &filename) {
-    E.filename = filename;
-    E.rows.clear();
-
-    std::ifstream in(filename);
-    if (!in) {
-        // File doesn't exist yet: treat as empty buffer
-        return;
+    if ((int)S.dirty.size() != rows) {
+        S.dirty.assign(rows, 1);
+        S.paintedHl.assign(rows, HL_UNKNOWN);
+        S.full = true;
     }
+    if (lineNumberWidth != S.lineNumberWidth || E.colOffset != S.colOffset || wrap != S.wrap) S.full = true;
 
-    std::string line;
-    while (std::getline(in, line)) {
-        // Remove trailing '\r'
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
+    int d = wrap ? wrapShift(S.painted, layout, rows) : E.rowOffset - S.rowOffset;
+    if (!S.full && d != 0) {
+        if (std::abs(d) >= rows) {
+            S.full = true;
+        } else {
+            // scrollok only for the scroll itself: writing the bottom-right
+            // cell must never scroll the window
+            scrollok(stdscr, TRUE);
+            scrl(d);
+            scrollok(stdscr, FALSE);
+            if (d > 0) {
+                std::copy(S.dirty.begin() + d, S.dirty.end(), S.dirty.begin());
+                std::copy(S.paintedHl.begin() + d, S.paintedHl.end(), S.paintedHl.begin());
+                std::fill(S.dirty.end() - d, S.dirty.end(), 1);
+            } else {
+                std::copy_backward(S.dirty.begin(), S.dirty.end() + d, S.dirty.end());
+                std::copy_backward(S.paintedHl.begin(), S.paintedHl.end() + d, S.paintedHl.end());
+                std::fill(S.dirty.begin(), S.dirty.begin() - d, 1);
+            }
         }
-        E.rows.push_back(line);
     }
-}
-
-
-void saveFile(EditorState &E) {
-    if (E.filename.empty()) return;
-
-    std::ofstream out(E.filename);
-    if (!out) return; // For now, ignore errors
+    if (wrap) {
+        // A row that wraps differently since shifts the screen lines below it
+        for (int y = 0; y < rows; y++) {
+            int from = y + d;
+            if (from < 0 || from >= (int)S.painted.size() || S.painted[from] != layout[y]) S.dirty[y] = 1;
+        }
+    }
+    S.painted = layout;
+    S.wrap = wrap;
+    S.rowOffset = E.rowOffset;
+    S.colOffset = E.colOffset;
+    S.lineNumberWidth = lineNumberWidth;
 
-    for (size_t i = 0; i < E.rows.size(); ++i) {
-        out << E.rows[i];
-        if (i + 1 < E.rows.size()) out << "\n";
+    // Rows past the old or new end of the file change between text and '~'
+    if (E.buf.lineCount() != S.lineCount) {
+        damageRows(E, (int)std::min(E.buf.lineCount(), S.lineCount), -1);
+        if (E.buf.empty() || S.lineCount == 0) S.full = true; // splash message
+        S.lineCount = E.buf.lineCount();
     }
-    E.dirty = false;
+    if (S.full) std::fill(S.dirty.begin(), S.dirty.end(), 1);
 }
 
 
-// [Editor Layout and Logic]
-void editorScroll(EditorState &E) {
-    if (E.cy < E.rowOffset) {
-        E.rowOffset = E.cy;
-    }
-    if (E.cy >= E.rowOffset + E.screenRows) {
-        E.rowOffset = E.cy - E.screenRows + 1;
-    }
+void drawRows(EditorState &E) {
+    static RowView view;
+    static std::vector<std::pair<int, int>> layout;
+    int lineNumberWidth = ::lineNumberWidth(E);
+    bool wrap = E.config.softWrap;
 
-    if (E.cx < E.colOffset) {
-        E.colOffset = E.cx;
-    }
-    if (E.cx >= E.colOffset + E.screenCols) {
-        E.colOffset = E.cx - E.screenCols + 1;
-    }
-}
+    if (E.buf.hlSpanCount > HL_SPAN_LIMIT) hlTrimSpans(E.buf);
 
+    // The file row on each screen row and, with soft wrap, which of its screen lines
+    layout.clear();
+    int row = E.rowOffset, k = wrap ? E.wrapOffset : 0;
+    for (int y = 0; y < E.screenRows; y++) {
+        layout.push_back({row, k});
+        if (wrap && k + 1 < wrapCount(E, row)) {
+            k++;
+        } else {
+            row++;
+            k = 0;
+        }
+    }
 
-void drawRows(EditorState &E) {
-    int screenRow = 0;
-    int lineNumberWidth = 0;
+    scrollScreen(E, lineNumberWidth, layout);
+    ScreenState &S = E.screen;
 
-    if (E.config.showLineNumbers) {
-        int maxLine = std::max<int>(1, E.rows.size());
-        lineNumberWidth = std::to_string(maxLine).size() + 1; // "N " 
+    int lastRow = std::min<int>(layout.empty() ? E.rowOffset : layout.back().first + 1, E.buf.lineCount()) - 1;
+    bool colors = has_colors();
+    uint64_t hlStart = perfNow();
+    if (colors && lastRow >= 0) {
+        lexerUpdate(E, lastRow);
+        bracketUpdate(E);
     }
+    uint64_t hlNs = perfNow() - hlStart;
 
     for (int y = 0; y < E.screenRows; y++) {
-        int fileRow = E.rowOffset + y;
+        int fileRow = layout[y].first;
+        // A row also needs repainting when an edit above changed its lexer state
+        uint32_t hl = colors && fileRow <= lastRow ? E.buf.lineRef(fileRow).hlIn : HL_UNKNOWN;
+        if (!S.dirty[y] && hl == S.paintedHl[y]) continue;
+        S.dirty[y] = 0;
+        S.paintedHl[y] = hl;
+
         move(y, 0);
         clrtoeol();
 
-        if (fileRow >= (int)E.rows.size()) {
+        if (fileRow >= (int)E.buf.lineCount()) {
             // Empty tilde lines (like vim)
-            if (E.rows.empty() && y == E.screenRows / 3) {
-                std::string msg = "vLte -- very Light Terminal Editor with 54.5 kb";
+            if (E.buf.empty() && y == E.screenRows / 3) {
+                std::string msg = "vLte -- very Light Terminal Editor";
                 int padding = (E.screenCols - (int)msg.size()) / 2;
                 if (padding < 0) padding = 0;
                 for (int i = 0; i < padding; ++i) addch('~');
@@ -506,47 +345,45 @@ void drawRows(EditorState &E) {
                 addch('~');
             }
         } else {
-            // Line number
+            // Line number, on the first screen line of the row
             if (E.config.showLineNumbers) {
                 char ln[32];
-                std::snprintf(ln, sizeof(ln), "%*d ", lineNumberWidth - 1, fileRow + 1);
+                long n = layout[y].second > 0 ? -1 : rowNumber(E, fileRow);
+                if (n < 0) std::snprintf(ln, sizeof(ln), "%*s ", lineNumberWidth - 1, "");
+                else std::snprintf(ln, sizeof(ln), "%*ld ", lineNumberWidth - 1, n + 1);
                 attron(A_DIM);
                 addstr(ln);
                 attroff(A_DIM);
             }
 
-            const std::string &row = E.rows[fileRow];
-            int len = (int)row.size() - E.colOffset;
-            if (len < 0) len = 0;
-            if (len > E.screenCols - lineNumberWidth) {
-                len = E.screenCols - lineNumberWidth;
-            }
-
-            if (has_colors()) {
-                int maxCols = E.screenCols - lineNumberWidth;
-                if (maxCols < 0) maxCols = 0;
-                drawHighlightedLine(row, y, E.colOffset, lineNumberWidth, maxCols, E);
-            } else {
-                int len = (int)row.size() - E.colOffset;
-                if (len < 0) len = 0;
-                if (len > E.screenCols - lineNumberWidth) {
-                    len = E.screenCols - lineNumberWidth;
-                }
-                if (len > 0) {
-                    addnstr(row.c_str() + E.colOffset, len);
-                }
+            int maxCols = E.screenCols - lineNumberWidth;
+            if (maxCols < 0) maxCols = 0;
+            // Only the visible part of a long row is fetched and lexed; a cell
+            // takes at most four bytes, combining marks aside
+            int col, colOffset = E.colOffset;
+            size_t end = SIZE_MAX;
+            if (wrap) {
+                WrapLine line = wrapLine(E, fileRow, layout[y].second);
+                colOffset = line.col;
+                end = line.end;
             }
+            size_t x = byteAtColumn(E.buf, fileRow, colOffset, E.config.tabSize, col);
+            uint64_t t = perfNow();
+            rowView(E.buf, colors ? E.syntax : nullptr, fileRow, x, x + 4 * (size_t)maxCols + 64, view);
+            hlNs += perfNow() - t;
+            // A wrapped line stops where the next one starts
+            if (end - view.base < view.text.size()) view.text = view.text.substr(0, end - view.base);
+            drawHighlightedLine(view, x, col, y, fileRow, colOffset, lineNumberWidth, maxCols, E);
 
         }
-        screenRow++;
     }
+    E.perf.frameNs[PERF_HIGHLIGHT] += hlNs;
 }
 
 
 void drawStatusBar(EditorState &E) {
     attron(A_REVERSE);
     move(E.screenRows, 0);
-    clrtoeol();
 
     std::string status;
     if (!E.filename.empty()) {
@@ -562,8 +399,48 @@ void drawStatusBar(EditorState &E) {
     }
 
     status += "  |  ";
-    status += "Ln " + std::to_string(E.cy + 1);
-    status += ", Col " + std::to_string(E.cx + 1);
+    long row = rowNumber(E, E.cy);
+    status += "Ln " + (row < 0 ? std::string("?") : std::to_string(row + 1));
+    status += ", Col " + std::to_string(computeScreenX(E) + 1);
+
+    if (E.loader.active) {
+        status += "  |  loading " + std::to_string(E.loader.scanned * 100 / E.map.size) + "%";
+    }
+    if (E.follow.active) {
+        status += "  |  following";
+    }
+    if (E.pager.active) {
+        const PagerState &P = E.pager;
+        status += "  |  view " + std::to_string(P.size ? pagerCursorByte(E) * 100 / P.size : 100) + "%";
+        if (!P.done) status += ", indexing " + std::to_string(P.scanned * 100 / std::max<size_t>(1, P.size)) + "%";
+    }
+    if (E.save.active) {
+        size_t total = std::max<size_t>(1, E.save.total);
+        status += "  |  saving " + std::to_string(E.save.written * 100 / total) + "%";
+    } else if (!E.statusMsg.empty() && std::time(nullptr) - E.statusTime < 5) {
+        status += "  |  " + E.statusMsg;
+    }
+    if (E.prompt.kind != PromptKind::NONE) {
+        status = E.prompt.label + E.prompt.text;
+    } else if (E.search.active) {
+        status = "Search: " + E.search.query;
+        if (E.search.pending) {
+            status += "  (searching...)";
+        } else if (!E.search.query.empty() && E.search.matchRow < 0) {
+            status += "  (not found)";
+        }
+        status += "  |  Enter keep, Esc cancel, arrows next/prev";
+    }
+    if (E.perf.overlay) {
+        status += "  |  " + perfSummary(E.perf);
+    }
+
+    if (!E.screen.full && status == E.screen.status) {
+        attroff(A_REVERSE);
+        return;
+    }
+    E.screen.status = status;
+    clrtoeol();
 
     int len = status.size();
     if (len > E.screenCols) len = E.screenCols;
@@ -574,268 +451,108 @@ void drawStatusBar(EditorState &E) {
 
 
 void editorRefreshScreen(EditorState &E) {
+    uint64_t start = perfNow();
     editorScroll(E);
     drawRows(E);
     drawStatusBar(E);
 
-    int lineNumberWidth = 0;
-    if (E.config.showLineNumbers) {
-        int maxLine = std::max<int>(1, E.rows.size());
-        lineNumberWidth = std::to_string(maxLine).size() + 1;
-    }
-
+    int lineNumberWidth = ::lineNumberWidth(E);
     int screenY = E.cy - E.rowOffset;
     int screenX = computeScreenX(E) - E.colOffset + lineNumberWidth;
+    if (E.config.softWrap) {
+        const std::vector<std::pair<int, int>> &painted = E.screen.painted;
+        int k = wrapLineOf(E, E.cy, E.cx);
+        screenY = (int)(std::find(painted.begin(), painted.end(), std::make_pair(E.cy, k)) - painted.begin());
+        screenX = computeScreenX(E) - wrapLine(E, E.cy, k).col + lineNumberWidth;
+    }
     if (screenY < 0) screenY = 0;
     if (screenY >= E.screenRows) screenY = E.screenRows - 1;
     if (screenX < 0) screenX = 0;
     if (screenX >= E.screenCols) screenX = E.screenCols - 1;
 
-    move(screenY, screenX);
-    refresh();
-}
-
-// --insert and delete--
-void insertChar(EditorState &E, char c) {
-    pushUndo(E);
-    if (E.cy < 0 || E.cy > (int)E.rows.size()) return;
-    if (E.cy == (int)E.rows.size()) {
-        E.rows.push_back("");
-    }
-
-    std::string &row = E.rows[E.cy];
-    if (E.cx < 0) E.cx = 0;
-    if (E.cx > (int)row.size()) E.cx = row.size();
-    row.insert(row.begin() + E.cx, c);
-    E.cx++;
-    E.dirty = true;
-}
-
-
-void insertNewline(EditorState &E) {
-    pushUndo(E);
-    if (E.cy < 0 || E.cy > (int)E.rows.size()) return;
-
-    if (E.cy == (int)E.rows.size()) {
-        E.rows.push_back("");
-        E.cy++;
-        E.cx = 0;
-        return;
+    if (E.prompt.kind != PromptKind::NONE) {
+        // Type into the status bar
+        screenY = E.screenRows;
+        screenX = std::min<int>(E.prompt.label.size() + E.prompt.text.size(), E.screenCols - 1);
     }
 
-    std::string &row = E.rows[E.cy];
-    std::string newRow = row.substr(E.cx);
-    row.erase(E.cx);
-    E.rows.insert(E.rows.begin() + E.cy + 1, newRow);
-    E.cy++;
-    E.cx = 0;
-    E.dirty = true;
-}
-
-
-void deleteChar(EditorState &E) {
-    pushUndo(E);
-    if (E.cy < 0 || E.cy >= (int)E.rows.size()) return;
-    if (E.cx == 0 && E.cy == 0) return;
+    move(screenY, screenX);
+    uint64_t painted = perfNow();
+    refresh();
+    E.screen.full = false;
 
-    std::string &row = E.rows[E.cy];
-    if (E.cx > 0) {
-        row.erase(row.begin() + E.cx - 1);
-        E.cx--;
-    } else {
-        // merge with previous line
-        int prevLen = E.rows[E.cy - 1].size();
-        E.rows[E.cy - 1] += row;
-        E.rows.erase(E.rows.begin() + E.cy);
-        E.cy--;
-        E.cx = prevLen;
-    }
-    E.dirty = true;
+    PerfStats &P = E.perf;
+    uint64_t now = perfNow();
+    P.frameNs[PERF_PAINT] += painted - start - P.frameNs[PERF_HIGHLIGHT];
+    P.frameNs[PERF_REFRESH] += now - painted;
+    perfEndFrame(P, now);
 }
 
-// --Cursor--
-void moveCursor(EditorState &E, Action action) {
-    switch (action) {
-        case Action::MOVE_UP:
-            if (E.cy > 0) E.cy--;
-            break;
 
-        case Action::MOVE_DOWN:
-            if (E.cy + 1 < (int)E.rows.size()) {
-                E.cy++;
-            }
-            break;
-
-        case Action::MOVE_LEFT:
-            if (E.cx > 0) {
-                E.cx--;
-            } else if (E.cy > 0) {
-                E.cy--;
-                E.cx = E.rows[E.cy].size();
-            }
-            break;
-
-        case Action::MOVE_RIGHT:
-            if (E.cy < (int)E.rows.size()) {
-                int rowLen = (E.cy == (int)E.rows.size()) ? 0 : E.rows[E.cy].size();
-                if (E.cx < rowLen) {
-                    E.cx++;
-                } else if (E.cx == rowLen && E.cy + 1 < (int)E.rows.size()) {
-                    E.cy++;
-                    E.cx = 0;
-                }
-            }
-            break;
-        default:
-            break;
-    }
-
-    // clamp cx to row length
-    if (E.cy < (int)E.rows.size()) {
-        int rowLen = E.rows[E.cy].size();
-        if (E.cx > rowLen) E.cx = rowLen;
-    } else {
-        E.cx = 0;
+// [Key Process Action]
+// Collects everything up to the paste end marker; terminals send line
+// breaks inside a paste as '\r'
+void readPaste(EditorState &E) {
+    std::string text;
+    timeout(200); // never hang if the end marker gets lost
+    int c;
+    while ((c = getch()) != ERR && c != KEY_PASTE_END) {
+        if (c == '\r') {
+            text += '\n';
+        } else if (c == '\n') {
+            if (text.empty() || text.back() != '\n') text += '\n';
+        } else if (c == '\t' || (c >= 32 && c < 256 && c != 127)) {
+            text += (char)c;
+        }
     }
+    insertText(E, text);
 }
 
-// --Cursor jump to next Word--
-void moveWordRight(EditorState &E) {
-    if (E.cy >= (int)E.rows.size()) return;
-    std::string &row = E.rows[E.cy];
-
-    int len = row.size();
-    int x = E.cx;
 
-    if (x >= len) {
-        if (E.cy + 1 < (int)E.rows.size()) {
-            E.cy++;
-            E.cx = 0;
-        }
+void editorProcessKey(EditorState &E, int c) {
+    if (c == KEY_PASTE_BEGIN) {
+        readPaste(E);
         return;
     }
-
-    // Skip current word
-    while (x < len && !std::isspace(row[x])) x++;
-
-    // Skip spaces
-    while (x < len && std::isspace(row[x])) x++;
-
-    E.cx = x;
-}
-
-void moveWordLeft(EditorState &E) {
-    if (E.cy >= (int)E.rows.size()) return;
-    std::string &row = E.rows[E.cy];
-
-    if (E.cx == 0) {
-        if (E.cy > 0) {
-            E.cy--;
-            E.cx = E.rows[E.cy].size();
-        }
+    if (c == KEY_RESIZE) {
+        getmaxyx(stdscr, E.screenRows, E.screenCols);
+        E.screenRows -= 1;
+        setscrreg(0, E.screenRows - 1);
+        E.screen.full = true;
         return;
     }
-
-    int x = E.cx - 1;
-
-    // Skip spaces
-    while (x > 0 && std::isspace(row[x])) x--;
-
-    // Skip word characters
-    while (x > 0 && !std::isspace(row[x])) x--;
-
-    // If we stopped on a space, move forward one
-    if (std::isspace(row[x]) && x < (int)row.size() - 1) x++;
-
-    E.cx = x;
+    editorHandleKey(E, c);
 }
 
 
-// [Key Process Action]
+// Handles one key, then everything else that is already queued, so a burst
+// of input (fast typing, a paste without bracketing) costs one repaint
 void editorProcessKeypress(EditorState &E) {
     int c = getch();
+    if (c == ERR) return; // timed out while the file is still loading
+    PerfStats &P = E.perf;
+    uint64_t start = perfNow(), editNs = 0;
+    if (!P.inputAt) P.inputAt = start;
+
+    timeout(0);
+    for (int n = 0; n < INPUT_BATCH_MAX && !E.quit; n++) {
+        if (n > 0 && (c = getch()) == ERR) break;
+        uint64_t t = perfNow();
+        editorProcessKey(E, c);
+        editNs += perfNow() - t;
+        P.frameKeys++;
+    }
+    P.frameNs[PERF_EDIT] += editNs;
+    P.frameNs[PERF_INPUT] += perfNow() - start - editNs;
+}
 
-    // Map to actions if possible
-    Action act = mapKeyToAction(E, c);
-    if (act != Action::NONE) {
-        switch (act) {
-            case Action::QUIT:
-                E.quit = true;
-                return;
-
-            case Action::SAVE:
-                saveFile(E);
-                return;
-
-            case Action::MOVE_UP:
-            case Action::MOVE_DOWN:
-            case Action::MOVE_LEFT:
-            case Action::MOVE_RIGHT:
-                moveCursor(E, act);
-                return;
-
-            case Action::MOVE_WORD_LEFT:
-                moveWordLeft(E);
-                return;
-
-            case Action::MOVE_WORD_RIGHT:
-                moveWordRight(E);
-                return;
-
-            case Action::UNDO:
-                undo(E);
-                return;
-
-            default:
-                break;
-        }
-    }
-
-    switch (c) {
-        case KEY_HOME:
-            E.cx = 0;
-            break;
-
-        case KEY_END:
-            if (E.cy < (int)E.rows.size()) {
-                E.cx = E.rows[E.cy].size();
-            }
-            break;
-
-        case KEY_PPAGE:
-            E.cy -= E.screenRows;
-            if (E.cy < 0) E.cy = 0;
-            break;
-
-        case KEY_NPAGE:
-            E.cy += E.screenRows;
-            if (E.cy >= (int)E.rows.size()) {
-                E.cy = E.rows.empty() ? 0 : (int)E.rows.size() - 1;
-            }
-            break;
-
-        case KEY_BACKSPACE:
-        case 127:
-            deleteChar(E);
-            break;
-        case '\r':
-        case '\n':
-            insertNewline(E);
-            break;
-
-        case '\t': {
-            pushUndo(E);
-            insertChar(E, '\t');
-            E.dirty = true;
-            return;
-        }
 
-        default:
-            if (std::isprint(c)) {
-                insertChar(E, (char)c);
-            }
-            break;
-    }
+// Sleeps until a key comes in or the followed file changes, then lets
+// getch look without waiting
+void waitForKeyOrFile(EditorState &E) {
+    pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {E.follow.notify, POLLIN, 0}};
+    poll(fds, 2, -1);
+    timeout(0);
 }
 
 
@@ -845,17 +562,70 @@ int main(int argc, char *argv[]) {
     std::string configPath = std::string(getenv("HOME") ? getenv("HOME") : ".") +
                              "/.config/Lume/config.toml";
 
+    std::string filename, tracePath;
+    bool follow = false, view = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "-f" || arg == "--follow") {
+            follow = true;
+        } else if (arg == "--view") {
+            view = true;
+        } else {
+            filename = arg;
+        }
+    }
+
+    // One line per frame: frame keys input edit highlight paint refresh latency (us)
+    if (!tracePath.empty()) {
+        E.perf.trace = std::fopen(tracePath.c_str(), "w");
+        if (!E.perf.trace) {
+            std::perror(tracePath.c_str());
+            return 1;
+        }
+        std::fprintf(E.perf.trace, "# frame keys input_us edit_us highlight_us paint_us refresh_us latency_us\n");
+    }
+
     initEditor(E, configPath);
 
-    if (argc >= 2) {
-        openFile(E, argv[1]);
+    if (!filename.empty() && view) {
+        pagerOpen(E, filename);
+    } else if (!filename.empty()) {
+        openFile(E, filename);
+        cacheRestore(E);
+        journalRecover(E);
+        if (follow) followStart(E);
     }
 
     while (!E.quit) {
+        pullLoadedLines(E);
+        pollSave(E);
+        bool more = followPoll(E);
+        pagerPoll(E);
+        if (E.search.pending) searchStep(E, SEARCH_STEP_BYTES);
         editorRefreshScreen(E);
+        // Wake up regularly while the loader, the writer, the background
+        // lexer or the bracket matcher is busy, right away while a search is still scanning or the
+        // followed file has more to read, and when it grows
+        if (E.search.pending || more) timeout(0);
+        else if (E.lexer.busy || E.bracket.counting) timeout(10);
+        else if (E.loader.active || E.save.active || (E.pager.active && !E.pager.done)) timeout(50);
+        else if (E.follow.active) waitForKeyOrFile(E);
+        else timeout(-1);
         editorProcessKeypress(E);
     }
 
+    std::printf("\033[?2004l"); // bracketed paste off
+    std::fflush(stdout);
+
+    // Let a running save finish first: the cache and journal depend on how it went
+    finishSave(E);
+    cacheSave(E);
+    journalDiscard(E); // a clean quit leaves nothing to recover
+    followStop(E);
+    closeFile(E);
     endwin();
+    if (E.perf.trace) std::fclose(E.perf.trace);
     return 0;
 }